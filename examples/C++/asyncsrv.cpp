@@ -11,6 +11,8 @@
 
 #include <zmq.hpp>
 #include "zhelpers.hpp"
+#include "zaffinity.hpp"
+#include "zpool.hpp"
 
 
 //  This is our client task class.
@@ -62,47 +64,20 @@ private:
 
 
 //  .split worker task
-//  Each worker task works on one request at a time and sends a random number
-//  of replies back, with random delays between replies:
+//  Each worker thread works on one request at a time and sends a random number
+//  of replies back, with random delays between replies. The pool hands us
+//  the request without its envelope, and addresses our replies:
 
-class server_worker {
-public:
-    server_worker(zmq::context_t &ctx, int sock_type)
-        : ctx_(ctx),
-          worker_(ctx_, sock_type)
-    {}
-
-    void work() {
-            worker_.connect("inproc://backend");
-
-        try {
-            while (true) {
-                zmq::message_t identity;
-                zmq::message_t msg;
-                zmq::message_t copied_id;
-                zmq::message_t copied_msg;
-                worker_.recv(&identity);
-                worker_.recv(&msg);
-
-                int replies = within(5);
-                for (int reply = 0; reply < replies; ++reply) {
-                    s_sleep(within(1000) + 1);
-                    copied_id.copy(&identity);
-                    copied_msg.copy(&msg);
-                    worker_.send(copied_id, ZMQ_SNDMORE);
-                    worker_.send(copied_msg);
-                }
-            }
-        }
-        catch (std::exception &e) {}
+static void
+server_worker(zmsg &request, zpool_worker &worker)
+{
+    int replies = within(5);
+    for (int reply = 0; reply < replies; ++reply) {
+        s_sleep(within(1000) + 1);
+        zmsg copied(request);
+        worker.reply(copied);
     }
-
-
-
-private:
-    zmq::context_t &ctx_;
-    zmq::socket_t worker_;
-};
+}
 
 
 //  .split server task
@@ -110,56 +85,40 @@ private:
 //  It uses the multithreaded server model to deal requests out to a pool
 //  of workers and route replies back to clients. One worker can handle
 //  one request at a time but one client can talk to multiple workers at
-//  once.
+//  once. The pool adds threads while requests wait, and retires them when
+//  they are idle.
 
 
 class server_task {
 public:
     server_task()
         : ctx_(1),
-          frontend_(ctx_, ZMQ_ROUTER),
-          backend_(ctx_, ZMQ_DEALER)
+          placed_(zaffinity::global().configure(ctx_)),
+          frontend_(ctx_, ZMQ_ROUTER)
     {}
 
-    enum { kMaxThread = 5 };
+    enum { kMinThread = 2, kMaxThread = 16 };
 
     void run() {
         frontend_.bind("tcp://*:5570");
-        backend_.bind("inproc://backend");
-
-        std::vector<server_worker *> worker;
-        std::vector<std::thread *> worker_thread;
-        for (int i = 0; i < kMaxThread; ++i) {
-            worker.push_back(new server_worker(ctx_, ZMQ_DEALER));
-
-            worker_thread.push_back(new std::thread(std::bind(&server_worker::work, worker[i])));
-            worker_thread[i]->detach();
-        }
 
-
-        try {
-            zmq::proxy(static_cast<void*>(frontend_),
-                       static_cast<void*>(backend_),
-                       nullptr);
-        }
-        catch (std::exception &e) {}
-
-        for (int i = 0; i < kMaxThread; ++i) {
-            delete worker[i];
-            delete worker_thread[i];
-        }
+        //  Serves until Ctrl-C, then finishes the requests it has and
+        //  joins its threads
+        zpool pool(ctx_, server_worker, kMinThread, kMaxThread);
+        pool.run(frontend_);
+        std::cout << "I: " << pool.report() << std::endl;
     }
 
 
 private:
     zmq::context_t ctx_;
+    int placed_;            //  I/O threads are set before the first socket
     zmq::socket_t frontend_;
-    zmq::socket_t backend_;
 };
 
 
 //  The main thread simply starts several clients and a server, and then
-//  waits for the server to finish.
+//  waits for the server to finish, which it does on Ctrl-C.
 
 int main (void)
 {
@@ -176,8 +135,8 @@ int main (void)
     t1.detach();
     t2.detach();
     t3.detach();
-    t4.detach();
 
-    getchar();
+    s_catch_signals();
+    t4.join();
     return 0;
 }
@@ -4,6 +4,7 @@
 // Olivier Chamoux <olivier.chamoux@fr.thalesgroup.com>
 
 #include "zhelpers.hpp"
+#include "zspin.hpp"
 #include <pthread.h>
 #include <queue>
 
@@ -67,8 +68,24 @@ worker_thread(void *arg) {
     return (NULL);
 }
 
+//  Syntax: lbbroker [-s spin usecs] [-c cpu]
+
 int main(int argc, char *argv[])
 {
+    //  Optionally busy-poll, and pin the broker to a CPU, for latency
+    zspin spin;
+    int cpu = -1;
+    for (int argn = 1; argn < argc; argn++) {
+        if (argn + 1 < argc && strcmp (argv [argn], "-s") == 0)
+            spin.set_budget (atoi (argv [++argn]));
+        else
+        if (argn + 1 < argc && strcmp (argv [argn], "-c") == 0)
+            cpu = atoi (argv [++argn]);
+        else {
+            printf ("syntax: lbbroker [-s spin usecs] [-c cpu]\n");
+            return 0;
+        }
+    }
 
     //  Prepare our context and sockets
     zmq::context_t context(1);
@@ -93,6 +110,10 @@ int main(int argc, char *argv[])
         pthread_t worker;
         pthread_create(&worker, NULL, worker_thread, (void *)(intptr_t)worker_nbr);
     }
+    //  Pin only now, so that threads we started don't inherit it
+    if (cpu >= 0 && zspin::pin (cpu) == -1)
+        std::cout << "W: can't pin broker to CPU " << cpu << std::endl;
+
     //  Logic of LRU loop
     //  - Poll backend always, frontend only if 1+ worker ready
     //  - If worker replies, queue worker as ready and forward reply
@@ -112,9 +133,9 @@ int main(int argc, char *argv[])
                 { frontend, 0, ZMQ_POLLIN, 0 }
         };
         if (worker_queue.size())
-            zmq::poll(&items[0], 2, -1);
+            spin.poll(&items[0], 2, -1);
         else
-            zmq::poll(&items[0], 1, -1);
+            spin.poll(&items[0], 1, -1);
 
         //  Handle worker activity on backend
         if (items[0].revents & ZMQ_POLLIN) {
@@ -171,5 +192,7 @@ int main(int argc, char *argv[])
             s_send(backend, request);
         }
     }
+    if (spin.budget())
+        std::cout << "I: broker loop " << spin.report() << std::endl;
     return 0;
 }
@@ -0,0 +1,158 @@
+//
+//  Lazy Pirate crowd
+//
+//  Many Lazy Pirate clients in one thread, each a coroutine. Every client
+//  is the same flow as lpclient: send, wait for the reply with a timeout,
+//  and on timeout reopen the socket and resend, giving up after a few
+//  tries. Written as a coroutine that is a plain loop, where lpclient has
+//  to poll and count retries by hand.
+//
+//  Start lpserver, then run this; kill and restart the server to watch
+//  clients retry. Needs C++20 for coroutines.
+//
+//  Syntax: lpcrowd [-e endpoint] [-c clients] [-n requests] [-t timeout]
+//
+#include "zco.hpp"
+#include "zhistogram.hpp"
+
+#include <sstream>
+
+#define REQUEST_TIMEOUT     2500    //  msecs, (> 1000!)
+#define REQUEST_RETRIES     3       //  Before we abandon
+
+#if defined (ZCO_ENABLED)
+
+//  What all clients saw, shared by the flows on our one thread
+typedef struct {
+    int replies;
+    int retries;
+    int abandoned;
+    zhistogram latency;             //  nsecs, first send to reply
+} tally_t;
+
+static zmq::socket_t *
+s_client_socket (zmq::context_t &context, std::string endpoint)
+{
+    zmq::socket_t *client = new zmq::socket_t (context, ZMQ_REQ);
+    client->connect (endpoint.c_str ());
+    int linger = 0;
+    client->setsockopt (ZMQ_LINGER, &linger, sizeof (linger));
+    return client;
+}
+
+//  ---------------------------------------------------------------------
+//  One client: send each request, and wait for its reply or resend
+
+static zco_flow
+s_client_flow (zmq::context_t &context, zloop &loop, std::string endpoint,
+               int index, int requests, int timeout, tally_t &tally)
+{
+    zmq::socket_t *client = s_client_socket (context, endpoint);
+    zco_socket *reader = new zco_socket (loop, *client);
+
+    for (int sequence = 1; sequence <= requests; sequence++) {
+        std::stringstream request;
+        request << index << "-" << sequence;
+        s_send (*client, request.str ());
+        int64_t sent = s_clock_ns ();
+
+        int retries_left = REQUEST_RETRIES;
+        while (true) {
+            zmsg *reply = co_await reader->recv (timeout);
+            if (reply) {
+                //  We got a reply from the server, must match request
+                if (request.str ().compare (reply->body ()) == 0) {
+                    tally.latency.record (s_loop_ns () - sent);
+                    tally.replies++;
+                    delete reply;
+                    break;
+                }
+                std::cout << "E: malformed reply from server: " << reply->body () << std::endl;
+                delete reply;
+                continue;
+            }
+            if (--retries_left == 0) {
+                std::cout << "E: client " << index << ": server seems to be offline, abandoning" << std::endl;
+                tally.abandoned++;
+                delete reader;
+                delete client;
+                co_return;
+            }
+            //  Old socket will be confused; close it and open a new one
+            tally.retries++;
+            delete reader;
+            delete client;
+            client = s_client_socket (context, endpoint);
+            reader = new zco_socket (loop, *client);
+            //  Send request again, on new socket
+            s_send (*client, request.str ());
+        }
+    }
+    delete reader;
+    delete client;
+}
+
+int main (int argc, char *argv [])
+{
+    std::string endpoint = "tcp://localhost:5555";
+    int clients = 100;
+    int requests = 10;
+    int timeout = REQUEST_TIMEOUT;
+
+    for (int argn = 1; argn < argc; argn++) {
+        if (argn + 1 < argc && strcmp (argv [argn], "-e") == 0)
+            endpoint = argv [++argn];
+        else
+        if (argn + 1 < argc && strcmp (argv [argn], "-c") == 0)
+            clients = atoi (argv [++argn]);
+        else
+        if (argn + 1 < argc && strcmp (argv [argn], "-n") == 0)
+            requests = atoi (argv [++argn]);
+        else
+        if (argn + 1 < argc && strcmp (argv [argn], "-t") == 0)
+            timeout = atoi (argv [++argn]);
+        else {
+            printf ("syntax: lpcrowd [-e endpoint] [-c clients] [-n requests] [-t timeout]\n");
+            return 0;
+        }
+    }
+    s_catch_signals ();
+
+    //  Each client has a socket, and a retry opens another before the
+    //  old one has quite gone
+    zmq::context_t *context = new zmq::context_t (1);
+    zmq_ctx_set (static_cast<void*>(*context), ZMQ_MAX_SOCKETS, clients * 2 + 16);
+
+    zloop loop;
+    tally_t tally;
+    tally.replies = tally.retries = tally.abandoned = 0;
+    int64_t started = s_clock_ns ();
+    for (int index = 0; index < clients; index++)
+        s_client_flow (*context, loop, endpoint, index, requests, timeout, tally);
+    loop.start ();
+
+    double seconds = (s_clock_ns () - started) / 1e9;
+    std::cout << "I: clients=" << clients << " replies=" << tally.replies
+              << " retries=" << tally.retries << " abandoned=" << tally.abandoned
+              << " in " << seconds << "s" << std::endl;
+    if (tally.latency.count ())
+        std::cout << "I: latency p50=" << tally.latency.percentile (50) / 1000 << "us"
+                  << " p99=" << tally.latency.percentile (99) / 1000 << "us"
+                  << " max=" << tally.latency.max () / 1000 << "us" << std::endl;
+
+    //  If we were interrupted, flows still hold sockets and the context
+    //  would wait for them forever; leave it to the OS
+    if (s_zco_flows == 0)
+        delete context;
+    return 0;
+}
+
+#else
+
+int main (void)
+{
+    printf ("lpcrowd needs a compiler with coroutines, e.g. -std=c++20\n");
+    return 1;
+}
+
+#endif
@@ -3,6 +3,9 @@
 
 #include <unordered_map>
 #include "zhelpers.hpp"
+#include "zmetrics.hpp"
+#include "zmonitor.hpp"
+#include "zloop.hpp"
 
 int main ()
 {
@@ -10,6 +13,12 @@ int main ()
     zmq::socket_t  frontend(context, ZMQ_SUB);
     zmq::socket_t  backend(context, ZMQ_XPUB);
 
+    //  Metrics, served from a side thread, including our connection to
+    //  the publisher and connections from subscribers
+    zmetrics metrics;
+    zmonitor frontend_monitor (context, frontend, "frontend", metrics);
+    zmonitor backend_monitor (context, backend, "backend", metrics);
+
     frontend.connect("tcp://localhost:5557");
     backend.bind("tcp://*:5558");
 
@@ -19,57 +28,65 @@ int main ()
     //  Store last instance of each topic in a cache
     std::unordered_map<std::string, std::string> cache_map;
 
-    zmq::pollitem_t items[2] = {
-        { static_cast<void*>(frontend), 0, ZMQ_POLLIN, 0 },
-        { static_cast<void*>(backend), 0, ZMQ_POLLIN, 0 }
-    };
-
-    //  .split main poll loop
+    zcounter updates, subscriptions, hits;
+    zgauge topics;
+    metrics.add ("lvc_updates_total", "Updates received from publisher", "", &updates);
+    metrics.add ("lvc_subscriptions_total", "Subscriptions from clients", "",
+                 &subscriptions);
+    metrics.add ("lvc_cache_hits_total", "Subscriptions answered from cache", "",
+                 &hits);
+    metrics.add ("lvc_topics", "Topics in the cache", "", &topics);
+    metrics.serve ("tcp://*:9558");
+
+    //  .split main loop
     //  We route topic updates from frontend to backend, and we handle
     //  subscriptions by sending whatever we cached, if anything:
-    while (1)
-    {
-        if (zmq::poll(items, 2, 1000) == -1)
-            break; //  Interrupted
-
-        //  Any new topic data we cache and then forward
-        if (items[0].revents & ZMQ_POLLIN)
-        {
-            std::string topic = s_recv(frontend);
-            std::string data  = s_recv(frontend);
-
-            if (topic.empty())
-                break;
-
-            cache_map[topic] = data;
-
-            s_sendmore(backend, topic);
-            s_send(backend, data);
-        }
-
-        //  .split handle subscriptions
-        //  When we get a new subscription, we pull data from the cache:
-        if (items[1].revents & ZMQ_POLLIN) {
-            zmq::message_t msg;
-
-            backend.recv(&msg);
-            if (msg.size() == 0)
-                break;
-
-            //  Event is one byte 0=unsub or 1=sub, followed by topic
-            uint8_t *event = (uint8_t *)msg.data();
-            if (event[0] == 1) {
-                std::string topic((char *)(event+1), msg.size()-1);
-
-                auto i = cache_map.find(topic);
-                if (i != cache_map.end())
-                {
-                    s_sendmore(backend, topic);
-                    s_send(backend, i->second);
-                }
+    zloop loop;
+
+    //  Any new topic data we cache and then forward
+    loop.reader (frontend, [&] () {
+        std::string topic = s_recv(frontend);
+        std::string data  = s_recv(frontend);
+
+        if (topic.empty())
+            return -1;
+
+        cache_map[topic] = data;
+        updates++;
+        topics.set (cache_map.size());
+
+        s_sendmore(backend, topic);
+        s_send(backend, data);
+        return 0;
+    }, 64);
+
+    //  .split handle subscriptions
+    //  When we get a new subscription, we pull data from the cache:
+    loop.reader (backend, [&] () {
+        zmq::message_t msg;
+
+        backend.recv(&msg);
+        if (msg.size() == 0)
+            return -1;
+
+        //  Event is one byte 0=unsub or 1=sub, followed by topic
+        uint8_t *event = (uint8_t *)msg.data();
+        if (event[0] == 1) {
+            std::string topic((char *)(event+1), msg.size()-1);
+            subscriptions++;
+
+            auto i = cache_map.find(topic);
+            if (i != cache_map.end())
+            {
+                hits++;
+                s_sendmore(backend, topic);
+                s_send(backend, i->second);
             }
         }
-    }
+        return 0;
+    });
+    loop.start ();
 
+    metrics.stop ();
     return 0;
 }
@@ -0,0 +1,1327 @@
+#ifndef __MDBROKER_HPP_INCLUDED__
+#define __MDBROKER_HPP_INCLUDED__
+
+//
+//  Majordomo Protocol broker
+//  A minimal implementation of http://rfc.zeromq.org/spec:7 and spec:8
+//
+//  The broker logic lives here so that mdsim can drive it in virtual
+//  time; mdbroker.cpp runs it over a real socket.
+//
+//     Andreas Hoelzlwimmer <andreas.hoelzlwimmer@fh-hagenberg.at>
+//
+#include "zmsg.hpp"
+#include "mdp.h"
+#include "zhistogram.hpp"
+#include "zlog.hpp"
+#include "zloop.hpp"
+#include "zrecorder.hpp"
+#include "zmetrics.hpp"
+#include "zmonitor.hpp"
+#include "zprobes.hpp"
+#include "zprofile.hpp"
+
+#include <map>
+#include <set>
+#include <deque>
+#include <list>
+#include <unordered_map>
+#include <algorithm>
+
+//  We'd normally pull these from config data
+
+#define HEARTBEAT_LIVENESS  3       //  3-5 is reasonable
+#define HEARTBEAT_INTERVAL  2500    //  msecs
+#define HEARTBEAT_EXPIRY    HEARTBEAT_INTERVAL * HEARTBEAT_LIVENESS
+#define RECORDER_SIZE       4096    //  Messages kept by flight recorder
+#define PROFILE_INTERVAL    10000   //  msecs between profile reports
+#define BROKER_BATCH        32      //  Messages handled per wake-up
+
+//  Phases of the broker loop, when built with -DZPROFILE
+enum {
+    PHASE_POLL,                     //  Waiting in zmq::poll
+    PHASE_RECV,                     //  Reading and parsing messages
+    PHASE_PROCESS,                  //  Protocol handling and lookups
+    PHASE_SEND,                     //  Writing messages
+    PHASE_PURGE                     //  Expiring workers, ticking stats
+};
+
+//  Outlier ejection: workers that fail or stall repeatedly are taken out
+//  of rotation for a while, then get a single probe request
+#define EJECT_FAILURES      3       //  Consecutive failures to eject
+#define EJECT_TIME          10000   //  msecs, doubles per ejection
+#define EJECT_MAX_PERCENT   50      //  Never eject more of a service
+#define SLOW_FACTOR         5       //  Slower than average by this much
+#define SLOW_MIN            100     //  msecs, and slower than this
+
+struct service;
+
+//  This defines one worker, idle or active
+struct worker
+{
+    std::string m_identity;   //  Address of worker
+    service * m_service;      //  Owning service, if known
+    std::list<worker*>::iterator m_member;  //  Our place in its member list
+    int64_t m_expiry;         //  Expires at unless heartbeat
+    std::string m_request;    //  Key of MDPC02 request in progress, if any
+    std::string m_request_id; //  Client's id for that request
+    bool m_cancelled;         //  Client cancelled request in progress
+    bool m_streaming;         //  Request in progress is streamed
+    bool m_traced;            //  Request in progress carries a trace
+    int64_t m_dispatched;     //  When we gave it its current request
+    int64_t m_dispatched_ns;  //  Same, on the monotonic clock
+    uint64_t m_requests_total;    //  Requests given to this worker
+    uint64_t m_replies_total;     //  Replies it sent back
+    uint64_t m_failures_total;    //  Requests it failed or stalled on
+    int64_t m_dispatch_time;      //  Sum of its requests' time queued, nsecs
+    int64_t m_reply_time;         //  Sum of dispatch to reply, nsecs
+    double m_request_rate;        //  Requests/sec, last interval
+    double m_reply_rate;          //  Replies/sec, last interval
+    uint64_t m_requests_last;     //  Totals at start of interval
+    uint64_t m_replies_last;
+
+    //  Circuit breaker state
+    int m_failures;           //  Consecutive failed requests
+    int m_ejections;          //  Consecutive ejections
+    int64_t m_ejected_until;  //  Out of rotation until, or 0
+    bool m_probing;           //  Half-open, on its probe request
+    bool m_stalled;           //  Request counted as failed before it replied
+
+    worker(std::string identity, service * service = 0, int64_t expiry = 0) {
+       m_identity = identity;
+       m_service = service;
+       m_expiry = expiry;
+       m_cancelled = false;
+       m_streaming = false;
+       m_traced = false;
+       m_dispatched = 0;
+       m_dispatched_ns = 0;
+       m_requests_total = 0;
+       m_replies_total = 0;
+       m_failures_total = 0;
+       m_dispatch_time = 0;
+       m_reply_time = 0;
+       m_request_rate = 0;
+       m_reply_rate = 0;
+       m_requests_last = 0;
+       m_replies_last = 0;
+       m_failures = 0;
+       m_ejections = 0;
+       m_ejected_until = 0;
+       m_probing = false;
+       m_stalled = false;
+    }
+};
+
+//  This defines one client request waiting for a worker
+struct request
+{
+    zmsg * m_msg;             //  Client envelope and request body
+    std::string m_client;     //  Address of client
+    std::string m_id;         //  Client's request id, empty for MDPC01
+    int m_credit;             //  Initial stream credit, 0 for single reply
+    std::string m_trace;      //  Trace frame, empty if not traced
+    int64_t m_queued_ns;      //  When we queued it, on the monotonic clock
+
+    request(zmsg *msg, std::string client, std::string id = "", int credit = 0,
+            std::string trace = "") {
+       m_msg = msg;
+       m_client = client;
+       m_id = id;
+       m_credit = credit;
+       m_trace = trace;
+       m_queued_ns = 0;
+    }
+
+    ~request() {
+       delete m_msg;
+    }
+};
+
+//  This defines a single service
+struct service
+{
+   ~service ()
+   {
+       for(std::list<request*>::iterator it = m_requests.begin();
+             it != m_requests.end(); ++it) {
+           delete *it;
+       }
+   }
+
+    std::string m_name;             //  Service name
+    std::list<request*> m_requests;   //  List of client requests
+    //  Queued MDPC02 requests by client and request id, for cancellation
+    std::unordered_map<std::string, std::list<request*>::iterator> m_index;
+    std::list<worker*> m_waiting;  //  List of waiting workers
+    std::list<worker*> m_ejected;  //  Idle workers out of rotation
+    std::list<worker*> m_members;  //  All its workers, idle or busy
+    size_t m_workers;               //  How many workers we have
+    size_t m_ejected_count;         //  Workers ejected, idle or busy
+    double m_latency;               //  Average dispatch to reply, msecs
+
+    //  Statistics, kept up to date as we go so reading them is cheap
+    zcounter m_requests_total;      //  Requests received
+    zcounter m_replies_total;       //  Replies sent back
+    zcounter m_errors_total;        //  Requests failed or stalled
+    zcounter m_cancels_total;       //  Requests cancelled by clients
+    zcounter m_dispatch_total;      //  Requests given to workers
+    int64_t m_dispatch_time;        //  Sum of time queued, nsecs
+    int64_t m_dispatch_max;         //  Longest time queued, nsecs
+    double m_request_rate;          //  Requests/sec, last interval
+    double m_reply_rate;            //  Replies/sec, last interval
+    uint64_t m_requests_last;       //  Totals at start of interval
+    uint64_t m_replies_last;
+    zhistogram m_queue_time;        //  Enqueue to dispatch, nsecs
+    zhistogram m_reply_time;        //  Dispatch to reply, nsecs
+
+    //  Exported as metrics; queue is current, the others as of last tick
+    zgauge m_queue_gauge;
+    zgauge m_workers_gauge;
+    zgauge m_waiting_gauge;
+
+    service(std::string name)
+    {
+        m_name = name;
+        m_workers = 0;
+        m_ejected_count = 0;
+        m_latency = -1;
+        m_dispatch_time = m_dispatch_max = 0;
+        m_request_rate = m_reply_rate = 0;
+        m_requests_last = m_replies_last = 0;
+    }
+};
+
+//  The broker's clock and transport. By default these are the loop time,
+//  which the broker's zloop refreshes once per wake-up, and the broker's
+//  ROUTER socket; a simulator overrides them to run the broker in virtual
+//  time without sockets.
+class broker_io {
+public:
+    broker_io (zmq::socket_t *socket = 0) : m_socket (socket) {}
+    virtual ~broker_io () {}
+
+    //  Current time in msecs, monotonic
+    virtual int64_t clock () {
+        return s_loop_ms ();
+    }
+    //  Current time in nsecs, monotonic
+    virtual int64_t clock_ns () {
+        return s_loop_ns ();
+    }
+    //  Send message to the peer addressed by its first frame; this
+    //  leaves the message empty
+    virtual void send (zmsg &msg) {
+        msg.send (*m_socket);
+    }
+
+protected:
+    zmq::socket_t *m_socket;
+};
+
+//  This defines a single broker
+class broker {
+public:
+
+   //  ---------------------------------------------------------------------
+   //  Constructor for broker object. Without io, the broker makes its own
+   //  socket; with io, it uses that for time and messages and the caller
+   //  feeds it messages through process() and heartbeat().
+
+   broker (int verbose, broker_io *io = 0) : m_recorder (RECORDER_SIZE)
+   {
+       //  Initialize broker state
+       m_verbose = verbose;
+       if (io) {
+           m_context = 0;
+           m_socket = 0;
+           m_monitor = 0;
+           m_io = io;
+       }
+       else {
+           m_context = new zmq::context_t(1);
+           m_socket = new zmq::socket_t(*m_context, ZMQ_ROUTER);
+           m_monitor = new zmonitor (*m_context, *m_socket, "broker", m_metrics, verbose);
+           m_spin.add_metrics (m_metrics, "");
+           m_io = new broker_io (m_socket);
+           s_loop_refresh ();
+       }
+       m_ticked_at = m_io->clock();
+       m_cpu = -1;
+#if defined (ZPROFILE)
+       m_profile.phase (PHASE_POLL, "poll");
+       m_profile.phase (PHASE_RECV, "recv");
+       m_profile.phase (PHASE_PROCESS, "process");
+       m_profile.phase (PHASE_SEND, "send");
+       m_profile.phase (PHASE_PURGE, "purge");
+       m_profiled_at = m_ticked_at;
+#endif
+   }
+
+   //  ---------------------------------------------------------------------
+   //  Destructor for broker object
+
+   virtual
+   ~broker ()
+   {
+       m_metrics.stop ();
+       delete m_monitor;
+       if (m_socket)
+           delete m_io;             //  Ours, not the caller's
+       while (! m_services.empty())
+       {
+           delete m_services.begin()->second;
+           m_services.erase(m_services.begin());
+       }
+       while (! m_workers.empty())
+       {
+           delete m_workers.begin()->second;
+           m_workers.erase(m_workers.begin());
+       }
+   }
+
+   //  ---------------------------------------------------------------------
+   //  Bind broker to endpoint, can call this multiple times
+   //  We use a single socket for both clients and workers.
+
+   void
+   bind (std::string endpoint)
+   {
+       assert (m_socket);
+       m_endpoint = endpoint;
+       m_socket->bind(m_endpoint.c_str());
+       s_console ("I: MDP broker/0.1.1 is active at %s", endpoint.c_str());
+   }
+
+   //  ---------------------------------------------------------------------
+   //  Serve metrics for Prometheus on endpoint, from a side thread
+
+   void
+   serve_metrics (std::string endpoint)
+   {
+       m_metrics.add ("mdp_messages_received_total",
+           "Messages received from clients and workers", "", &m_messages_in);
+       m_metrics.add ("mdp_messages_sent_total",
+           "Messages sent to clients and workers", "", &m_messages_out);
+       m_metrics.serve (endpoint);
+       s_console ("I: serving metrics at %s", endpoint.c_str());
+   }
+	
+private:
+
+   //  ---------------------------------------------------------------------
+   //  Delete any idle workers that haven't pinged us in a while, and
+   //  streaming workers, which heartbeat while they work. Other busy
+   //  workers may be deep in a request and can't answer.
+
+   void
+   purge_workers ()
+   {
+       std::deque<worker*> toCull;
+       int64_t now = m_io->clock();
+       for (std::map<std::string, worker*>::iterator it = m_workers.begin();
+             it != m_workers.end(); ++it)
+       {
+           worker *wrk = it->second;
+           if (wrk->m_expiry <= now
+           &&  (m_waiting.count (wrk) || wrk->m_streaming))
+               toCull.push_back(wrk);
+	   }
+       for (std::deque<worker*>::iterator wrk = toCull.begin(); wrk != toCull.end(); ++wrk)
+	   {
+           if (m_verbose) {
+               ZLOG ("I: deleting expired worker: %s",
+                     (*wrk)->m_identity.c_str());
+           }
+           ZPROBE2 (mdp_broker_purge, (*wrk)->m_identity.c_str(),
+               (*wrk)->m_service? (*wrk)->m_service->m_name.c_str(): "");
+           worker_delete(*wrk, 0);
+       }
+   }
+
+   //  ---------------------------------------------------------------------
+   //  Locate or create new service entry
+
+   service *
+   service_require (std::string name)
+   {
+       assert (name.size()>0);
+       if (m_services.count(name)) {
+          return m_services.at(name);
+       } else {
+           service * srv = new service(name);
+           m_services.insert(std::make_pair(name, srv));
+           if (name.compare(0, 4, "mmi.") != 0)
+               service_metrics (srv);
+           if (m_verbose) {
+               ZLOG ("I: added service: %s", name.c_str());
+           }
+           return srv;
+       }
+   }
+
+
+
+   //  ---------------------------------------------------------------------
+   //  Register a new service's metrics. The service must outlive them,
+   //  which it does, as we only delete services on the way out.
+
+   void
+   service_metrics (service *srv)
+   {
+       std::string labels = zmetrics::label ("service", srv->m_name);
+       m_metrics.add ("mdp_requests_total", "Requests received", labels,
+           &srv->m_requests_total);
+       m_metrics.add ("mdp_replies_total", "Replies sent to clients", labels,
+           &srv->m_replies_total);
+       m_metrics.add ("mdp_errors_total", "Requests workers failed or stalled on",
+           labels, &srv->m_errors_total);
+       m_metrics.add ("mdp_cancels_total", "Requests cancelled by clients",
+           labels, &srv->m_cancels_total);
+       m_metrics.add ("mdp_queue_depth", "Requests waiting for a worker",
+           labels, &srv->m_queue_gauge);
+       m_metrics.add ("mdp_workers", "Workers registered", labels,
+           &srv->m_workers_gauge);
+       m_metrics.add ("mdp_workers_waiting", "Idle workers", labels,
+           &srv->m_waiting_gauge);
+       m_metrics.add ("mdp_queue_seconds", "Time from request to dispatch",
+           labels, &srv->m_queue_time, 1e-9);
+       m_metrics.add ("mdp_reply_seconds", "Time from dispatch to reply",
+           labels, &srv->m_reply_time, 1e-9);
+   }
+
+   //  ---------------------------------------------------------------------
+   //  Dispatch requests to waiting workers as possible
+
+   void
+   service_dispatch (service *srv, request *req)
+   {
+       assert (srv);
+       if (req) {                    //  Queue request if any
+           req->m_queued_ns = m_io->clock_ns ();
+           srv->m_requests_total++;
+           srv->m_requests.push_back(req);
+           if (req->m_id.size() > 0) {
+               srv->m_index[req->m_client + "/" + req->m_id] =
+                   --srv->m_requests.end();
+           }
+           ZPROBE2 (mdp_broker_enqueue, srv->m_name.c_str(), srv->m_requests.size());
+       }
+
+       ZPROFILE_MARK (m_profile, PHASE_PROCESS);
+       purge_workers ();
+       ZPROFILE_MARK (m_profile, PHASE_PURGE);
+       while (! srv->m_waiting.empty() && ! srv->m_requests.empty())
+       {
+           // Choose the most recently seen idle worker; others might be about to expire
+           std::list<worker*>::iterator wrk = srv->m_waiting.begin();
+           std::list<worker*>::iterator next = wrk;
+           for (++next; next != srv->m_waiting.end(); ++next)
+           {
+              if ((*next)->m_expiry > (*wrk)->m_expiry)
+                 wrk = next;
+           }
+		   
+           request *req = srv->m_requests.front();
+           srv->m_requests.pop_front();
+           if (req->m_id.size() > 0) {
+               srv->m_index.erase(req->m_client + "/" + req->m_id);
+           }
+           if (req->m_trace.size() > 0) {
+               //  Worker gets the trace between client address and body
+               mdp_trace_hop (req->m_trace, MDP_HOP_BROKER_DISPATCH);
+               std::string client = req->m_msg->unwrap ();
+               req->m_msg->wrap (req->m_trace.c_str(), "");
+               req->m_msg->push_front ((char*)client.c_str());
+           }
+           if (req->m_credit > 0) {
+               std::stringstream credit;
+               credit << req->m_credit;
+               worker_send (*wrk, (char*)MDPW_STREAM, credit.str(), req->m_msg);
+           } else {
+               worker_send (*wrk, (char*)MDPW_REQUEST, "", req->m_msg);
+           }
+           //  Remember which request the worker is on, so we can route
+           //  credit to it and tag its replies with the request id
+           if (req->m_id.size() > 0) {
+               (*wrk)->m_request = req->m_client + "/" + req->m_id;
+               (*wrk)->m_request_id = req->m_id;
+               m_running.insert(std::make_pair((*wrk)->m_request, *wrk));
+           }
+           (*wrk)->m_dispatched = m_io->clock ();
+           (*wrk)->m_dispatched_ns = m_io->clock_ns ();
+           (*wrk)->m_streaming = req->m_credit > 0;
+           (*wrk)->m_expiry = (*wrk)->m_dispatched + HEARTBEAT_EXPIRY;
+           (*wrk)->m_stalled = false;
+           (*wrk)->m_traced = req->m_trace.size() > 0;
+           (*wrk)->m_requests_total++;
+           //  Most requests wait well under a msec, so use the fine clock
+           int64_t queued = (*wrk)->m_dispatched_ns - req->m_queued_ns;
+           srv->m_dispatch_total++;
+           srv->m_dispatch_time += queued;
+           if (queued > srv->m_dispatch_max)
+               srv->m_dispatch_max = queued;
+           (*wrk)->m_dispatch_time += queued;
+           srv->m_queue_time.record (queued);
+           ZPROBE4 (mdp_broker_dispatch, srv->m_name.c_str(),
+               (*wrk)->m_identity.c_str(), queued, srv->m_requests.size());
+           m_waiting.erase(*wrk);
+           srv->m_waiting.erase(wrk);
+           delete req;
+       }
+       srv->m_queue_gauge.set (srv->m_requests.size());
+   }
+
+   //  ---------------------------------------------------------------------
+   //  Handle internal service according to 8/MMI specification
+
+   void
+   service_internal (std::string service_name, std::string request_id, zmsg *msg,
+       std::string trace = "")
+   {
+       if (service_name.compare("mmi.service") == 0) {
+           std::map<std::string, service*>::iterator srv =
+               m_services.find(msg->body());
+           if (srv != m_services.end() && srv->second->m_workers) {
+               msg->body_set("200");
+           } else {
+               msg->body_set("404");
+           }
+       } else
+       if (service_name.compare("mmi.stats") == 0
+       ||  service_name.compare("mmi.stats.workers") == 0
+       ||  service_name.compare("mmi.stats.histogram") == 0) {
+           //  Body names one service, or is empty for all of them
+           std::string name = msg->body() ? msg->body() : "";
+           msg->body_set("200");
+           for (std::map<std::string, service*>::iterator it = m_services.begin();
+                 it != m_services.end(); ++it) {
+               if ((name.size() > 0 && it->first != name)
+               ||  it->first.compare(0, 4, "mmi.") == 0)
+                   continue;
+               if (service_name.compare("mmi.stats") == 0)
+                   service_stats (it->second, msg);
+               else
+               if (service_name.compare("mmi.stats.histogram") == 0)
+                   service_histogram (it->second, msg);
+               else
+                   worker_stats (it->second, msg);
+           }
+       } else
+#if defined (ZPROFILE)
+       if (service_name.compare("mmi.profile") == 0) {
+           msg->body_set("200");
+           msg->append (m_profile.report ().c_str());
+       } else
+#endif
+       if (service_name.compare("mmi.recorder") == 0) {
+           std::stringstream dump;
+           m_recorder.dump (dump);
+           msg->body_set("200");
+           msg->append (dump.str().c_str());
+       } else {
+           msg->body_set("501");
+       }
+
+       std::string client = msg->unwrap();
+       client_send (client, service_name, request_id, (char*)MDPC_FINAL, msg, trace);
+       delete msg;
+   }
+
+   //  ---------------------------------------------------------------------
+   //  Append one line of statistics for the service to msg
+
+   void
+   service_stats (service *srv, zmsg *msg)
+   {
+       std::stringstream line;
+       line << "service=" << srv->m_name
+            << " workers=" << srv->m_workers
+            << " waiting=" << srv->m_waiting.size()
+            << " ejected=" << srv->m_ejected_count
+            << " queue=" << srv->m_requests.size()
+            << " requests=" << srv->m_requests_total
+            << " replies=" << srv->m_replies_total
+            << " errors=" << srv->m_errors_total
+            << " cancels=" << srv->m_cancels_total
+            << " request_rate=" << srv->m_request_rate
+            << " reply_rate=" << srv->m_reply_rate
+            << " dispatch_avg_us=" << (srv->m_dispatch_total
+                ? srv->m_dispatch_time / (int64_t) srv->m_dispatch_total / 1000 : 0)
+            << " dispatch_max_us=" << srv->m_dispatch_max / 1000
+            << " latency_avg_ms=" << (srv->m_latency > 0 ? srv->m_latency : 0)
+            << " queue_p50_us=" << srv->m_queue_time.percentile (50) / 1000
+            << " queue_p99_us=" << srv->m_queue_time.percentile (99) / 1000
+            << " queue_p999_us=" << srv->m_queue_time.percentile (99.9) / 1000
+            << " reply_p50_us=" << srv->m_reply_time.percentile (50) / 1000
+            << " reply_p99_us=" << srv->m_reply_time.percentile (99) / 1000
+            << " reply_p999_us=" << srv->m_reply_time.percentile (99.9) / 1000;
+       msg->append (line.str().c_str());
+   }
+
+   //  ---------------------------------------------------------------------
+   //  Append the raw latency histograms for the service to msg, one frame
+   //  each, as "nsecs count" lines, so tools can merge them across brokers
+
+   void
+   service_histogram (service *srv, zmsg *msg)
+   {
+       std::stringstream queue;
+       queue << "service=" << srv->m_name << " histogram=queue_ns\n";
+       srv->m_queue_time.export_buckets (queue);
+       msg->append (queue.str().c_str());
+
+       std::stringstream reply;
+       reply << "service=" << srv->m_name << " histogram=reply_ns\n";
+       srv->m_reply_time.export_buckets (reply);
+       msg->append (reply.str().c_str());
+   }
+
+   //  ---------------------------------------------------------------------
+   //  Append one line of statistics per worker of the service to msg.
+
+   void
+   worker_stats (service *srv, zmsg *msg)
+   {
+       for (std::list<worker*>::iterator it = srv->m_members.begin();
+             it != srv->m_members.end(); ++it) {
+           worker *wrk = *it;
+           std::stringstream line;
+           line << "worker=" << wrk->m_identity
+                << " service=" << srv->m_name
+                << " state=" << (wrk->m_ejected_until ? "ejected"
+                               : m_waiting.count(wrk) ? "idle" : "busy")
+                << " requests=" << wrk->m_requests_total
+                << " replies=" << wrk->m_replies_total
+                << " failures=" << wrk->m_failures_total
+                << " request_rate=" << wrk->m_request_rate
+                << " reply_rate=" << wrk->m_reply_rate
+                << " dispatch_avg_us=" << (wrk->m_requests_total
+                    ? wrk->m_dispatch_time / (int64_t) wrk->m_requests_total / 1000 : 0)
+                << " reply_avg_us=" << (wrk->m_replies_total
+                    ? wrk->m_reply_time / (int64_t) wrk->m_replies_total / 1000 : 0);
+           msg->append (line.str().c_str());
+       }
+   }
+
+   //  ---------------------------------------------------------------------
+   //  Roll a worker's request and reply rates over, once per heartbeat
+
+   void
+   worker_tick (worker *wrk, int64_t interval)
+   {
+       if (interval <= 0)
+           return;
+       wrk->m_request_rate = (wrk->m_requests_total - wrk->m_requests_last)
+                           * 1000.0 / interval;
+       wrk->m_reply_rate = (wrk->m_replies_total - wrk->m_replies_last)
+                         * 1000.0 / interval;
+       wrk->m_requests_last = wrk->m_requests_total;
+       wrk->m_replies_last = wrk->m_replies_total;
+   }
+
+   //  ---------------------------------------------------------------------
+   //  Roll request and reply rates over, once per heartbeat
+
+   void
+   service_tick (service *srv, int64_t interval)
+   {
+       if (interval <= 0)
+           return;
+       srv->m_request_rate = (srv->m_requests_total - srv->m_requests_last)
+                           * 1000.0 / interval;
+       srv->m_reply_rate = (srv->m_replies_total - srv->m_replies_last)
+                         * 1000.0 / interval;
+       srv->m_requests_last = srv->m_requests_total;
+       srv->m_replies_last = srv->m_replies_total;
+       srv->m_workers_gauge.set (srv->m_workers);
+       srv->m_waiting_gauge.set (srv->m_waiting.size());
+   }
+
+   //  ---------------------------------------------------------------------
+   //  Send reply or stream chunk back to client
+   //  MDPC01 requests (no request id) get a plain MDPC01 reply, MDPC02
+   //  requests get the command and their request id in front of the body,
+   //  followed by the trace frame if the request was traced.
+
+   void
+   client_send (std::string client, std::string service_name,
+       std::string request_id, char *command, zmsg *msg, std::string trace = "")
+   {
+       //  Insert the protocol header and service name, then rewrap
+       //  the client return envelope.
+       if (request_id.size() > 0) {
+           if (trace.size() > 0) {
+               mdp_trace_hop (trace, MDP_HOP_BROKER_OUT);
+               msg->push_front ((char*)trace.c_str());
+           }
+           msg->push_front ((char*)request_id.c_str());
+           msg->push_front ((char*)service_name.c_str());
+           msg->push_front (command);
+           msg->push_front ((char*)MDPC_CLIENT2);
+       } else {
+           msg->wrap (MDPC_CLIENT, service_name.c_str());
+       }
+       m_recorder.record (zrecorder::OUT, client,
+           request_id.size() > 0? command_name (mdpc_commands, command): "REPLY",
+           service_name, msg->parts (), msg->size ());
+       msg->wrap (client.c_str(), "");
+       ZPROBE3 (mdp_broker_send, client.c_str(), (int) *command, msg->parts ());
+       ZPROFILE_MARK (m_profile, PHASE_PROCESS);
+       m_io->send (*msg);
+       ZPROFILE_MARK (m_profile, PHASE_SEND);
+       m_messages_out++;
+   }
+
+   //  ---------------------------------------------------------------------
+   //  Creates worker if necessary
+
+   worker *
+   worker_require (std::string identity)
+   {
+       assert (identity.length()!=0);
+
+       //  self->workers is keyed off worker identity
+       if (m_workers.count(identity)) {
+          return m_workers.at(identity);
+       } else {
+          worker *wrk = new worker(identity);
+          m_workers.insert(std::make_pair(identity, wrk));
+          if (m_verbose) {
+             ZLOG ("I: registering new worker: %s", identity.c_str());
+          }
+          return wrk;
+       }
+   }
+
+   //  ---------------------------------------------------------------------
+   //  Deletes worker from all data structures, and destroys worker
+
+   void
+   worker_delete (worker *&wrk, int disconnect)
+   {
+       assert (wrk);
+       if (disconnect) {
+           worker_send (wrk, (char*)MDPW_DISCONNECT, "", NULL);
+       }
+       //  A worker that goes before it replies has failed its request
+       if (wrk->m_service && !m_waiting.count (wrk)
+       &&  !wrk->m_cancelled && !wrk->m_stalled) {
+           if (m_verbose) {
+               ZLOG ("W: worker %s lost with a request in progress",
+                   wrk->m_identity.c_str());
+           }
+           worker_failed (wrk);
+       }
+
+       if (wrk->m_service) {
+           for(std::list<worker*>::iterator it = wrk->m_service->m_waiting.begin();
+                 it != wrk->m_service->m_waiting.end();) {
+              if (*it == wrk) {
+                 it = wrk->m_service->m_waiting.erase(it);
+              }
+              else {
+                 ++it;
+              }
+           }
+           wrk->m_service->m_ejected.remove(wrk);
+           if (wrk->m_ejected_until)
+               wrk->m_service->m_ejected_count--;
+           wrk->m_service->m_members.erase(wrk->m_member);
+           wrk->m_service->m_workers--;
+       }
+       if (wrk->m_request.size() > 0) {
+           m_running.erase(wrk->m_request);
+       }
+       m_waiting.erase(wrk);
+       //  This implicitly calls the worker destructor
+       m_workers.erase(wrk->m_identity);
+       delete wrk;
+   }
+
+
+
+   //  ---------------------------------------------------------------------
+   //  Process message sent to us by a worker
+
+   void
+   worker_process (std::string sender, zmsg *msg)
+   {
+       assert (msg && msg->parts() >= 1);     //  At least, command
+
+       std::string command = (char *)msg->pop_front().c_str();
+       bool worker_ready = m_workers.count(sender)>0;
+       worker *wrk = worker_require (sender);
+       static const std::string unknown;
+       m_recorder.record (zrecorder::IN, sender,
+           command_name (mdps_commands, command.c_str()),
+           wrk->m_service? wrk->m_service->m_name: unknown,
+           msg->parts (), msg->size ());
+
+       if (command.compare (MDPW_READY) == 0) {
+           if (worker_ready)  {              //  Not first command in session
+               worker_delete (wrk, 1);
+           }
+           else {
+               if (sender.size() >= 4  //  Reserved service name
+               &&  sender.find_first_of("mmi.") == 0) {
+                   worker_delete (wrk, 1);
+               } else {
+                   //  Attach worker to service and mark as idle
+                   std::string service_name = (char*)msg->pop_front ().c_str();
+                   wrk->m_service = service_require (service_name);
+                   wrk->m_member = wrk->m_service->m_members.insert(
+                       wrk->m_service->m_members.end(), wrk);
+                   wrk->m_service->m_workers++;
+                   worker_waiting (wrk);
+               }
+           }
+       } else {
+          if (command.compare (MDPW_REPLY) == 0) {
+              if (worker_ready) {
+                  //  Remove & save client return envelope and send the
+                  //  reply on, it also ends any stream in progress
+                  //  Replies to cancelled requests are dropped
+                  std::string client = msg->unwrap ();
+                  std::string trace;
+                  if (wrk->m_traced) {
+                      trace = (char*) msg->pop_front ().c_str();
+                      msg->pop_front ();      //  Empty delimiter
+                      mdp_trace_hop (trace, MDP_HOP_BROKER_REPLY);
+                  }
+                  if (!wrk->m_cancelled) {
+                      client_send (client, wrk->m_service->m_name,
+                          wrk->m_request_id, (char*)MDPC_FINAL, msg, trace);
+                      wrk->m_service->m_replies_total++;
+                      int64_t reply_ns = m_io->clock_ns () - wrk->m_dispatched_ns;
+                      wrk->m_service->m_reply_time.record (reply_ns);
+                      wrk->m_replies_total++;
+                      wrk->m_reply_time += reply_ns;
+                      ZPROBE3 (mdp_broker_reply, wrk->m_service->m_name.c_str(),
+                          wrk->m_identity.c_str(), reply_ns);
+                  }
+                  //  Even a cancelled request's reply shows how the
+                  //  worker is doing
+                  worker_outcome (wrk, m_io->clock () - wrk->m_dispatched);
+                  wrk->m_cancelled = false;
+                  wrk->m_traced = false;
+                  if (wrk->m_request.size() > 0) {
+                      m_running.erase(wrk->m_request);
+                      wrk->m_request = "";
+                      wrk->m_request_id = "";
+                  }
+                  worker_waiting (wrk);
+              }
+              else {
+                  worker_delete (wrk, 1);
+              }
+          } else
+          if (command.compare (MDPW_PARTIAL) == 0) {
+              //  Stream chunk; worker stays busy until its final REPLY
+              if (worker_ready && wrk->m_request.size() > 0) {
+                  std::string client = msg->unwrap ();
+                  client_send (client, wrk->m_service->m_name,
+                      wrk->m_request_id, (char*)MDPC_PARTIAL, msg);
+              }
+              else
+              if (worker_ready && wrk->m_cancelled) {
+                  //  Chunk was already in flight when client cancelled
+              }
+              else {
+                  worker_delete (wrk, 1);
+              }
+          } else {
+             if (command.compare (MDPW_HEARTBEAT) == 0) {
+                 if (worker_ready) {
+                     wrk->m_expiry = m_io->clock () + HEARTBEAT_EXPIRY;
+                 } else {
+                     worker_delete (wrk, 1);
+                 }
+             } else {
+                if (command.compare (MDPW_DISCONNECT) == 0) {
+                    worker_delete (wrk, 0);
+                } else {
+                    if (m_verbose)
+                        ZLOG_BLOCK (msg->describe (), "E: invalid input message (%d)",
+                            (int) *command.c_str());
+                    else
+                        ZLOG_LIMITED ("E: invalid input message (%d)",
+                            (int) *command.c_str());
+                }
+             }
+          }
+       }
+       delete msg;
+   }
+
+   //  ---------------------------------------------------------------------
+   //  Name of an MDP command, for the flight recorder
+
+   template <size_t count>
+   static const char *
+   command_name (char *(&names) [count], const char *command)
+   {
+       size_t index = (unsigned char) *command;
+       return index > 0 && index < count? names [index]: "?";
+   }
+
+   //  ---------------------------------------------------------------------
+   //  Send message to worker
+   //  If pointer to message is provided, sends that message
+
+   void
+   worker_send (worker *worker,
+       char *command, std::string option, zmsg *msg)
+   {
+       msg = (msg ? new zmsg(*msg) : new zmsg ());
+
+       //  Stack protocol envelope to start of message
+       if (option.size()>0) {                 //  Optional frame after command
+           msg->push_front ((char*)option.c_str());
+       }
+       msg->push_front (command);
+       msg->push_front ((char*)MDPW_WORKER);
+       //  Stack routing envelope to start of message
+       msg->wrap(worker->m_identity.c_str(), "");
+
+       if (m_verbose) {
+           ZLOG_BLOCK (msg->describe (), "I: sending %s to worker",
+               mdps_commands [(int) *command]);
+       }
+       static const std::string unknown;
+       m_recorder.record (zrecorder::OUT, worker->m_identity,
+           command_name (mdps_commands, command),
+           worker->m_service? worker->m_service->m_name: unknown,
+           msg->parts (), msg->size ());
+       ZPROBE3 (mdp_broker_send, worker->m_identity.c_str(), (int) *command,
+           msg->parts ());
+       ZPROFILE_MARK (m_profile, PHASE_PROCESS);
+       m_io->send (*msg);
+       ZPROFILE_MARK (m_profile, PHASE_SEND);
+       m_messages_out++;
+       delete msg;
+   }
+
+   //  ---------------------------------------------------------------------
+   //  This worker is now waiting for work
+
+   void
+   worker_waiting (worker *worker)
+   {
+       assert (worker);
+       //  Queue to broker and service waiting lists; ejected workers
+       //  still get heartbeats but no requests
+       m_waiting.insert(worker);
+       worker->m_expiry = m_io->clock () + HEARTBEAT_EXPIRY;
+       if (worker->m_ejected_until) {
+           worker->m_service->m_ejected.push_back(worker);
+           return;
+       }
+       worker->m_service->m_waiting.push_back(worker);
+       // Attempt to process outstanding requests
+       service_dispatch (worker->m_service, 0);
+   }
+
+   //  ---------------------------------------------------------------------
+   //  Account for a request the worker answered. A reply much slower
+   //  than the service average counts as a failure.
+
+   void
+   worker_outcome (worker *wrk, int64_t latency)
+   {
+       service *srv = wrk->m_service;
+       if (wrk->m_stalled) {
+           wrk->m_stalled = false;
+           return;             //  Counted when it stalled
+       }
+       if (!wrk->m_streaming) {
+           if (srv->m_latency > 0
+           &&  latency > SLOW_MIN
+           &&  latency > SLOW_FACTOR * srv->m_latency) {
+               if (m_verbose) {
+                   ZLOG ("W: worker %s slow, %d msecs",
+                       wrk->m_identity.c_str(), (int) latency);
+               }
+               worker_failed (wrk);
+               return;
+           }
+           if (srv->m_latency < 0)
+               srv->m_latency = (double) latency;
+           else
+               srv->m_latency += 0.1 * (latency - srv->m_latency);
+       }
+       if (wrk->m_probing && m_verbose) {
+           ZLOG ("I: worker %s recovered", wrk->m_identity.c_str());
+       }
+       wrk->m_failures = 0;
+       wrk->m_ejections = 0;
+       wrk->m_probing = false;
+   }
+
+   //  ---------------------------------------------------------------------
+   //  A worker that has been on a request for as long as a slow reply
+   //  takes has failed it, whether or not it ever replies. We count that
+   //  once, so a hung worker gets ejected like a slow one.
+
+   void
+   worker_stalled (worker *wrk, int64_t now)
+   {
+       service *srv = wrk->m_service;
+       if (wrk->m_streaming || wrk->m_stalled || wrk->m_cancelled
+       ||  m_waiting.count (wrk) || srv->m_latency <= 0)
+           return;
+       int64_t latency = now - wrk->m_dispatched;
+       if (latency > SLOW_MIN && latency > SLOW_FACTOR * srv->m_latency) {
+           if (m_verbose) {
+               ZLOG ("W: worker %s stalled, %d msecs",
+                   wrk->m_identity.c_str(), (int) latency);
+           }
+           wrk->m_stalled = true;
+           worker_failed (wrk);
+       }
+   }
+
+   //  ---------------------------------------------------------------------
+   //  Account for a failed request, ejecting the worker from rotation
+   //  if it keeps failing or fails its probe. We never eject more than
+   //  EJECT_MAX_PERCENT of a service's workers, since a service-wide
+   //  problem is not the workers' fault.
+
+   void
+   worker_failed (worker *wrk)
+   {
+       service *srv = wrk->m_service;
+       srv->m_errors_total++;
+       wrk->m_failures_total++;
+       wrk->m_failures++;
+       if (!wrk->m_probing && wrk->m_failures < EJECT_FAILURES)
+           return;
+       if (!wrk->m_probing
+       &&  !wrk->m_ejected_until
+       &&  (srv->m_ejected_count + 1) * 100 > srv->m_workers * EJECT_MAX_PERCENT)
+           return;
+
+       int64_t period = (int64_t) EJECT_TIME << std::min (wrk->m_ejections, 5);
+       if (!wrk->m_ejected_until)
+           srv->m_ejected_count++;
+       wrk->m_ejected_until = m_io->clock () + period;
+       wrk->m_ejections++;
+       wrk->m_failures = 0;
+       wrk->m_probing = false;
+       if (m_verbose) {
+           ZLOG ("W: ejecting worker %s for %d msecs",
+               wrk->m_identity.c_str(), (int) period);
+       }
+       //  If idle, take it out of rotation right away
+       std::list<worker*>::iterator it =
+           std::find (srv->m_waiting.begin(), srv->m_waiting.end(), wrk);
+       if (it != srv->m_waiting.end()) {
+           srv->m_waiting.erase (it);
+           srv->m_ejected.push_back (wrk);
+       }
+   }
+
+   //  ---------------------------------------------------------------------
+   //  Put ejected workers whose time is up back into rotation, half-open:
+   //  their next request is a probe that decides their fate
+
+   void
+   service_reinstate (service *srv)
+   {
+       int64_t now = m_io->clock ();
+       bool reinstated = false;
+       for (std::list<worker*>::iterator it = srv->m_ejected.begin();
+             it != srv->m_ejected.end();) {
+           if ((*it)->m_ejected_until <= now) {
+               (*it)->m_ejected_until = 0;
+               srv->m_ejected_count--;
+               (*it)->m_probing = true;
+               srv->m_waiting.push_back (*it);
+               it = srv->m_ejected.erase (it);
+               reinstated = true;
+           }
+           else
+               ++it;
+       }
+       if (reinstated)
+           service_dispatch (srv, 0);
+   }
+
+
+
+   //  ---------------------------------------------------------------------
+   //  Process a request coming from a client
+
+   void
+   client_process (std::string sender, zmsg *msg)
+   {
+       assert (msg && msg->parts () >= 2);     //  Service name + body
+
+       std::string service_name = (char *)msg->pop_front().c_str();
+       m_recorder.record (zrecorder::IN, sender, "REQUEST", service_name,
+           msg->parts (), msg->size ());
+       service *srv = service_require (service_name);
+       //  Set reply return address to client sender
+       msg->wrap (sender.c_str(), "");
+       if (service_name.length() >= 4
+       &&  service_name.find_first_of("mmi.") == 0) {
+           service_internal (service_name, "", msg);
+       } else {
+           service_dispatch (srv, new request (msg, sender));
+       }
+   }
+
+   //  ---------------------------------------------------------------------
+   //  Process a command coming from an MDPC02 client
+
+   void
+   client_command (std::string sender, zmsg *msg)
+   {
+       //  Command, service and id at least; this comes from any client,
+       //  so a bad message is dropped, never asserted on
+       if (msg->parts () < 3) {
+           if (m_verbose)
+               ZLOG_BLOCK (msg->describe (), "E: invalid client command from %s",
+                   sender.c_str());
+           else
+               ZLOG_LIMITED ("E: invalid client command from %s", sender.c_str());
+           delete msg;
+           return;
+       }
+       std::string command = (char *)msg->pop_front().c_str();
+       std::string service_name = (char *)msg->pop_front().c_str();
+       std::string request_id = (char *)msg->pop_front().c_str();
+       m_recorder.record (zrecorder::IN, sender,
+           command_name (mdpc_commands, command.c_str()), service_name,
+           msg->parts (), msg->size ());
+
+       if (((command.compare (MDPC_REQUEST) == 0 && msg->parts () >= 1)
+       ||   (command.compare (MDPC_TRACE) == 0 && msg->parts () >= 2))
+       &&  service_name.size () > 0) {
+           int credit = atoi ((char *)msg->pop_front().c_str());
+           std::string trace;
+           if (command.compare (MDPC_TRACE) == 0) {
+               trace = (char *)msg->pop_front().c_str();
+               mdp_trace_hop (trace, MDP_HOP_BROKER_IN);
+           }
+           service *srv = service_require (service_name);
+           msg->wrap (sender.c_str(), "");
+           if (service_name.length() >= 4
+           &&  service_name.find_first_of("mmi.") == 0) {
+               service_internal (service_name, request_id, msg, trace);
+           } else {
+               service_dispatch (srv,
+                   new request (msg, sender, request_id, credit, trace));
+           }
+           return;
+       }
+       if (command.compare (MDPC_CREDIT) == 0 && msg->parts () >= 1) {
+           //  Pass credit on to the worker streaming this request; it
+           //  may already have finished, in which case we drop it
+           std::map<std::string, worker*>::iterator it =
+               m_running.find (sender + "/" + request_id);
+           if (it != m_running.end()) {
+               worker_send (it->second, (char*)MDPW_CREDIT,
+                   (char *)msg->pop_front().c_str(), NULL);
+           }
+       } else
+       if (command.compare (MDPC_CANCEL) == 0) {
+           request_cancel (sender + "/" + request_id, service_name);
+       } else {
+           if (m_verbose)
+               ZLOG_BLOCK (msg->describe (), "E: invalid client command (%d)",
+                   (int) *command.c_str());
+           else
+               ZLOG_LIMITED ("E: invalid client command (%d)",
+                   (int) *command.c_str());
+       }
+       delete msg;
+   }
+	
+   //  ---------------------------------------------------------------------
+   //  Cancel a client request. If it is still queued we just drop it,
+   //  if a worker is on it we tell the worker and drop whatever it
+   //  sends back. Requests we don't know have already completed.
+
+   void
+   request_cancel (std::string key, std::string service_name)
+   {
+       std::map<std::string, service*>::iterator srv =
+           m_services.find (service_name);
+       if (srv != m_services.end()) {
+           std::unordered_map<std::string, std::list<request*>::iterator>::iterator
+               queued = srv->second->m_index.find (key);
+           if (queued != srv->second->m_index.end()) {
+               if (m_verbose) {
+                   ZLOG ("I: cancelling queued request %s", key.c_str());
+               }
+               delete *queued->second;
+               srv->second->m_cancels_total++;
+               srv->second->m_requests.erase (queued->second);
+               srv->second->m_index.erase (queued);
+               srv->second->m_queue_gauge.set (srv->second->m_requests.size());
+               return;
+           }
+       }
+       std::map<std::string, worker*>::iterator running = m_running.find (key);
+       if (running != m_running.end()) {
+           worker *wrk = running->second;
+           if (m_verbose) {
+               ZLOG ("I: cancelling request %s on worker %s",
+                   key.c_str(), wrk->m_identity.c_str());
+           }
+           worker_send (wrk, (char*)MDPW_CANCEL, "", NULL);
+           wrk->m_service->m_cancels_total++;
+           wrk->m_cancelled = true;
+           //  Hedges and failovers cancel healthy workers all the time, so
+           //  a cancel is no failure; the late reply tells us how it did
+           wrk->m_request = "";
+           wrk->m_request_id = "";
+           m_running.erase (running);
+       }
+   }
+
+public:
+
+   //  ---------------------------------------------------------------------
+   //  Process one message from a client or worker, which we then own
+
+   void
+   process (zmsg *msg)
+   {
+       m_messages_in++;
+       if (m_verbose) {
+           ZLOG_BLOCK (msg->describe (), "I: received message:");
+       }
+       std::string sender = std::string((char*)msg->pop_front ().c_str());
+       msg->pop_front (); //empty message
+       std::string header = std::string((char*)msg->pop_front ().c_str());
+       ZPROBE3 (mdp_broker_receive, sender.c_str(), header.c_str(),
+           msg->parts ());
+       ZPROFILE_MARK (m_profile, PHASE_RECV);
+
+       if (header.compare(MDPC_CLIENT) == 0) {
+           client_process (sender, msg);
+       }
+       else if (header.compare(MDPC_CLIENT2) == 0) {
+           client_command (sender, msg);
+       }
+       else if (header.compare(MDPW_WORKER) == 0) {
+           worker_process (sender, msg);
+       }
+       else {
+           if (m_verbose)
+               ZLOG_BLOCK (msg->describe (), "E: invalid message from %s",
+                   sender.c_str());
+           else
+               ZLOG_LIMITED ("E: invalid message from %s", sender.c_str());
+           delete msg;
+       }
+   }
+
+   //  ---------------------------------------------------------------------
+   //  Once per heartbeat interval, disconnect and delete any expired
+   //  workers, tick statistics, and send heartbeats to every worker that
+   //  has said READY. Busy workers need them too: a streaming worker that
+   //  waits for credit hears nothing else from us.
+
+   void
+   heartbeat ()
+   {
+       int64_t now = m_io->clock();
+       int64_t interval = now - m_ticked_at;
+       ZPROBE2 (mdp_broker_heartbeat, m_waiting.size(), m_workers.size());
+       ZPROFILE_MARK (m_profile, PHASE_PROCESS);
+       purge_workers ();
+       for (std::map<std::string, service*>::iterator it = m_services.begin();
+             it != m_services.end(); it++) {
+           service_reinstate (it->second);
+           service_tick (it->second, interval);
+       }
+       m_ticked_at = now;
+       ZPROFILE_MARK (m_profile, PHASE_PURGE);
+#if defined (ZPROFILE)
+       if (now >= m_profiled_at + PROFILE_INTERVAL) {
+           s_console ("I: broker loop profile:");
+           std::cerr << m_profile.report ();
+           m_profiled_at = now;
+       }
+#endif
+       for (std::map<std::string, worker*>::iterator it = m_workers.begin();
+             it != m_workers.end(); it++) {
+           if (it->second->m_service) {
+               worker_send (it->second, (char*)MDPW_HEARTBEAT, "", NULL);
+               worker_stalled (it->second, now);
+               worker_tick (it->second, interval);
+           }
+       }
+   }
+
+   //  ---------------------------------------------------------------------
+   //  Busy-poll for up to usecs before blocking, and pin the brokering
+   //  thread to cpu unless it is -1. Costs a CPU; see zspin.hpp.
+
+   void
+   set_spin (int64_t usecs, int cpu)
+   {
+       m_spin.set_budget (usecs);
+       m_cpu = cpu;
+   }
+
+   //  Get and process messages forever or until interrupted. We take a
+   //  batch of messages per wake-up, and check for a flight recorder dump
+   //  on each heartbeat.
+   void
+   start_brokering() {
+      assert (m_socket);
+      if (m_cpu >= 0 && zspin::pin (m_cpu) == -1)
+          s_console ("W: can't pin broker to CPU %d", m_cpu);
+      zloop loop;
+      loop.set_spin (&m_spin);
+      loop.reader (*m_socket, [this] () {
+          ZPROFILE_MARK (m_profile, PHASE_POLL);
+          process (new zmsg(*m_socket));
+          ZPROFILE_MARK (m_profile, PHASE_PROCESS);
+          return 0;
+      }, BROKER_BATCH);
+      loop.timer (HEARTBEAT_INTERVAL, 0, [this] () {
+          ZPROFILE_MARK (m_profile, PHASE_POLL);
+          if (s_recorder_dump) {
+              s_recorder_dump = 0;
+              s_console ("I: flight recorder, last %d messages:", RECORDER_SIZE);
+              m_recorder.dump (std::cerr);
+          }
+          heartbeat ();
+          ZPROFILE_MARK (m_profile, PHASE_PROCESS);
+          return 0;
+      });
+      loop.start ();
+      if (m_spin.budget ())
+          s_console ("I: broker loop %s", m_spin.report ().c_str());
+   }
+
+private:
+    zmq::context_t * m_context;                  //  0MQ context
+    zmq::socket_t * m_socket;                    //  Socket for clients & workers
+    broker_io * m_io;                            //  Clock and transport
+    int m_verbose;                               //  Print activity to stdout
+    std::string m_endpoint;                      //  Broker binds to this endpoint
+    std::map<std::string, service*> m_services;  //  Hash of known services
+    std::map<std::string, worker*> m_workers;    //  Hash of known workers
+    std::set<worker*> m_waiting;              //  List of waiting workers
+    zrecorder m_recorder;                        //  Recent traffic on m_socket
+    zmetrics m_metrics;                          //  Exported for Prometheus
+    zmonitor * m_monitor;                        //  Connections to m_socket
+    zspin m_spin;                                //  Busy-polling, if asked
+    int m_cpu;                                   //  Pin loop to this CPU, or -1
+    zcounter m_messages_in;
+    zcounter m_messages_out;
+    std::map<std::string, worker*> m_running;    //  MDPC02 requests in progress
+    int64_t m_ticked_at;                         //  Last statistics rollover
+#if defined (ZPROFILE)
+    zprofile m_profile;                          //  Time spent per loop phase
+    int64_t m_profiled_at;                       //  Last profile report
+#endif
+};
+
+#endif
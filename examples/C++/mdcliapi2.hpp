@@ -3,6 +3,21 @@
 
 #include "zmsg.hpp"
 #include "mdp.h"
+#include "zhistogram.hpp"
+
+#include <map>
+#include <set>
+#include <vector>
+#include <algorithm>
+
+//  Hedging parameters
+#define HEDGE_SAMPLES       256     //  Latencies we keep for percentiles
+#define HEDGE_MIN_SAMPLES   20      //  Don't hedge on less evidence
+#define HEDGE_BURST         10      //  Max hedges we can save up
+
+//  Circuit breaker parameters
+#define BREAKER_FAILURES    3       //  Timeouts in a row to open circuit
+#define BREAKER_TIME        5000    //  msecs to fail fast before probing
 
 //  Structure of our class
 //  We access these properties only via class methods
@@ -22,6 +37,13 @@ public:
        m_verbose = verbose;
        m_timeout = 2500;           //  msecs
        m_client = 0;
+       m_sequence = 0;
+       m_hedge_percentile = 0;     //  Hedging off
+       m_hedge_budget = 0;
+       m_hedge_tokens = 0;
+       m_hedge_delay = -1;
+       m_latency_nbr = 0;
+       m_trace_rate = 0;           //  Tracing off
 
        s_catch_signals ();
        connect_to_broker ();
@@ -34,6 +56,14 @@ public:
    virtual
    ~mdcli ()
    {
+       while (!m_pending.empty()) {
+           delete m_pending.begin()->second.m_request;
+           m_pending.erase (m_pending.begin());
+       }
+       while (!m_histograms.empty()) {
+           delete m_histograms.begin()->second;
+           m_histograms.erase (m_histograms.begin());
+       }
        delete m_client;
        delete m_context;
    }
@@ -67,29 +97,123 @@ public:
    }
 
 
+   //  ---------------------------------------------------------------------
+   //  Enable request hedging. If a reply takes longer than the given
+   //  percentile of recently observed latencies, we send a duplicate
+   //  which the broker will give to another worker; the first reply wins
+   //  and the other request is cancelled. Budget caps hedges to a
+   //  percentage of requests sent. Streamed requests are never hedged.
+
+   void
+   set_hedging (int percentile, int budget)
+   {
+       assert (percentile >= 0 && percentile < 100);
+       m_hedge_percentile = percentile;
+       m_hedge_budget = budget;
+       m_hedge_delay = -1;
+   }
+
+
+   //  ---------------------------------------------------------------------
+   //  Trace one in every 'rate' requests, or none if rate is 0. Traced
+   //  requests collect a timestamp at each hop, which we turn into a
+   //  latency breakdown when the final reply arrives; see last_trace().
+
+   void
+   set_tracing (int rate)
+   {
+       assert (rate >= 0);
+       m_trace_rate = rate;
+   }
+
+
+   //  ---------------------------------------------------------------------
+   //  Latency breakdown of the last traced request to complete, in usecs,
+   //  or an empty string if none has
+
+   std::string
+   last_trace ()
+   {
+       return m_last_trace;
+   }
+
+
+   //  ---------------------------------------------------------------------
+   //  End-to-end latency of completed requests to a service, in nsecs,
+   //  from send to final reply. Returns 0 if we have none yet. The
+   //  histogram stays owned by us; merge it to keep a copy.
+
+   const zhistogram *
+   latency (std::string service)
+   {
+       std::map<std::string, zhistogram*>::iterator it = m_histograms.find (service);
+       return it == m_histograms.end()? 0: it->second;
+   }
+
+
    //  ---------------------------------------------------------------------
    //  Send request to broker
    //  Takes ownership of request message and destroys it when sent.
+   //  Returns -1 without sending if the service's circuit is open.
 
    int
    send (std::string service, zmsg *&request_p)
    {
-       assert (request_p);
-       zmsg *request = request_p;
+       if (!breaker_allow (service, request_p))
+           return -1;
+       send_request (service, request_p, 0);
+       return 0;
+   }
 
-       //  Prefix request with protocol frames
-       //  Frame 0: empty (REQ emulation)
-       //  Frame 1: "MDPCxy" (six bytes, MDP/Client x.y)
-       //  Frame 2: Service name (printable string)
-       request->push_front ((char*)service.c_str());
-       request->push_front ((char*)MDPC_CLIENT);
-       request->push_front ((char*)"");
+
+   //  ---------------------------------------------------------------------
+   //  Send request to broker, asking for the reply to be streamed back
+   //  in chunks. The worker may send at most 'credit' chunks ahead of
+   //  what we have consumed through recv(). Returns the request id that
+   //  tags each chunk. Takes ownership of request message.
+
+   std::string
+   send_stream (std::string service, zmsg *&request_p, int credit)
+   {
+       assert (credit > 0);
+       if (!breaker_allow (service, request_p))
+           return "";
+       return send_request (service, request_p, credit);
+   }
+
+
+   //  ---------------------------------------------------------------------
+   //  Cancel an outstanding request. The broker drops it if it is still
+   //  queued, or tells the worker to stop if it is already running. If
+   //  the request was hedged, we cancel its duplicate as well.
+
+   void
+   cancel (std::string request_id)
+   {
+       std::map<std::string, pending>::iterator it =
+           m_pending.find (request_id);
+       if (it == m_pending.end())
+           return;             //  Already complete
+       std::string service = it->second.m_service;
+       std::string sibling = it->second.m_sibling;
+
+       zmsg msg;
+       msg.push_back ((char*)"");
+       msg.push_back ((char*)MDPC_CLIENT2);
+       msg.push_back ((char*)MDPC_CANCEL);
+       msg.push_back ((char*)service.c_str());
+       msg.push_back ((char*)request_id.c_str());
        if (m_verbose) {
-           s_console ("I: send request to '%s' service:", service.c_str());
-           request->dump ();
+           s_console ("I: cancel request %s to '%s' service",
+               request_id.c_str(), service.c_str());
        }
-       request->send (*m_client);
-       return 0;
+       msg.send (*m_client);
+       delete it->second.m_request;
+       m_pending.erase (it);
+       breaker_cancel (service);
+       //  The sibling's own link now leads nowhere, which ends this
+       if (sibling.size() > 0)
+           cancel (sibling);
    }
 
 
@@ -101,46 +225,525 @@ public:
    zmsg *
    recv ()
    {
-       //  Poll socket for a reply, with timeout
-       zmq::pollitem_t items[] = {
-           { static_cast<void*>(*m_client), 0, ZMQ_POLLIN, 0 } };
-       zmq::poll (items, 1, m_timeout);
-
-       //  If we got a reply, process it
-       if (items[0].revents & ZMQ_POLLIN) {
-           zmsg *msg = new zmsg (*m_client);
-           if (m_verbose) {
-               s_console ("I: received reply:");
-               msg->dump ();
+       std::string request_id;
+       bool more;
+       return recv (request_id, more);
+   }
+
+
+   //  ---------------------------------------------------------------------
+   //  Returns the next reply or stream chunk, or NULL if there was none.
+   //  Sets request_id to the request the reply belongs to, and more to
+   //  true if further chunks will follow. Each chunk returned hands one
+   //  unit of credit back to its worker. On timeout, cancels everything
+   //  still outstanding so the broker and workers don't waste effort on
+   //  replies nobody will read.
+
+   zmsg *
+   recv (std::string &request_id, bool &more)
+   {
+       request_id = "";
+       more = false;
+
+       s_loop_refresh ();
+       int64_t expiry = s_loop_ms () + m_timeout;
+       while (!s_interrupted) {
+           //  Poll socket for a reply, with timeout, waking early if
+           //  some request is due for hedging
+           int64_t now = s_loop_ms ();
+           int64_t timeout = expiry - now;
+           if (timeout <= 0)
+               break;
+           //  Hedge delays can be well under a msec, so we keep them in
+           //  nsecs and round the wait up, to not wake before one is due
+           int64_t hedge_at = send_hedges (s_loop_ns ());
+           if (hedge_at > 0) {
+               int64_t hedge_wait = (hedge_at - s_loop_ns () + 999999) / 1000000;
+               if (hedge_wait < timeout)
+                   timeout = hedge_wait;
            }
-           //  Don't try to handle errors, just assert noisily
-           assert (msg->parts () >= 4);
+           zmq::pollitem_t items[] = {
+               { static_cast<void*>(*m_client), 0, ZMQ_POLLIN, 0 } };
+           zmq::poll (items, 1, (long) timeout);
+           s_loop_refresh ();
+
+           //  If we got a reply, process it
+           if (items[0].revents & ZMQ_POLLIN) {
+               zmsg *msg = new zmsg (*m_client);
+               if (m_verbose) {
+                   s_console ("I: received reply:");
+                   msg->dump ();
+               }
+               //  Don't try to handle errors, just assert noisily
+               assert (msg->parts () >= 5);
 
-           assert (msg->pop_front ().length() == 0);  // empty message
+               assert (msg->pop_front ().length() == 0);  // empty message
 
-           std::basic_string<unsigned char> header = msg->pop_front();
-           assert (header.compare((unsigned char *)MDPC_CLIENT) == 0);
+               std::basic_string<unsigned char> header = msg->pop_front();
+               assert (header.compare((unsigned char *)MDPC_CLIENT2) == 0);
 
-           std::basic_string<unsigned char> service = msg->pop_front();
-           assert (service.compare((unsigned char *)service.c_str()) == 0);
+               std::string command = (char *) msg->pop_front ().c_str();
+               std::string service = (char *) msg->pop_front ().c_str();
+               request_id = (char *) msg->pop_front ().c_str();
 
-           return msg;     //  Success
+               //  Replies to requests we cancelled may still be in flight
+               std::map<std::string, pending>::iterator it =
+                   m_pending.find (request_id);
+               if (it == m_pending.end()) {
+                   delete msg;
+                   continue;
+               }
+               if (command.compare (MDPC_PARTIAL) == 0) {
+                   more = true;
+                   send_credit (service, request_id, 1);
+               }
+               else {
+                   assert (command.compare (MDPC_FINAL) == 0);
+                   if (it->second.m_traced) {
+                       std::string trace = (char *) msg->pop_front ().c_str();
+                       mdp_trace_hop (trace, MDP_HOP_CLIENT_RECV);
+                       m_last_trace = trace_report (trace);
+                       if (m_verbose)
+                           s_console ("I: trace %s: %s", request_id.c_str(),
+                               m_last_trace.c_str());
+                   }
+                   breaker_close (service);
+                   //  First reply wins; report it under the id the caller
+                   //  knows and call off the other copy, if any
+                   std::string sibling = it->second.m_sibling;
+                   std::string origin = it->second.m_origin;
+                   int64_t latency_ns = s_loop_ns () - it->second.m_sent_ns;
+                   record_latency (latency_ns);
+                   zhistogram *&histogram = m_histograms [service];
+                   if (!histogram)
+                       histogram = new zhistogram ();
+                   histogram->record (latency_ns);
+                   ZPROBE3 (mdcli_reply, service.c_str(), request_id.c_str(),
+                       latency_ns);
+                   delete it->second.m_request;
+                   m_pending.erase (it);
+                   if (sibling.size() > 0)
+                       cancel (sibling);
+                   if (origin.size() > 0)
+                       request_id = origin;
+               }
+               return msg;     //  Success
+           }
        }
        if (s_interrupted)
            std::cout << "W: interrupt received, killing client..." << std::endl;
        else
        if (m_verbose)
            s_console ("W: permanent error, abandoning request");
+       ZPROBE1 (mdcli_timeout, m_pending.size());
 
+       //  Every service we were waiting on has failed us once more; trip
+       //  the breakers before we cancel, as that calls off any probe
+       if (!s_interrupted) {
+           std::set<std::string> failed;
+           for (std::map<std::string, pending>::iterator it = m_pending.begin();
+                 it != m_pending.end(); ++it)
+               failed.insert (it->second.m_service);
+           for (std::set<std::string>::iterator it = failed.begin();
+                 it != failed.end(); ++it)
+               breaker_trip (*it);
+       }
+       while (!m_pending.empty())
+           cancel (m_pending.begin()->first);
+       request_id = "";
+       return 0;
+   }
+
+
+   //  ---------------------------------------------------------------------
+   //  Selftest, playing the broker over IPC
+
+   static int
+   test (int verbose)
+   {
+       zmq::context_t context (1);
+       zmq::socket_t broker (context, ZMQ_ROUTER);
+       broker.bind ("ipc://mdcli_selftest.ipc");
+
+       mdcli client ("ipc://mdcli_selftest.ipc", verbose);
+       client.set_hedging (50, 100);
+
+       //  Answer requests straight away until we have a hedge delay
+       for (int count = 0; count < HEDGE_MIN_SAMPLES; count++) {
+           zmsg *request = new zmsg ("Hello");
+           assert (client.send ("echo", request) == 0);
+           zmsg received (broker);
+           test_reply (broker, received);
+           zmsg *reply = client.recv ();
+           assert (reply);
+           assert (strcmp (reply->body (), "Hello") == 0);
+           delete reply;
+       }
+       assert (client.m_hedge_delay >= 0);
+
+       //  Hold the next request until its hedge has gone out
+       zmsg *request = new zmsg ("Hello");
+       assert (client.send ("echo", request) == 0);
+       zmsg original (broker);
+       std::string original_id = test_frame (original, 5);
+       s_sleep (10);
+       client.send_hedges (s_clock_ns ());
+       zmsg hedge (broker);
+       std::string hedge_id = test_frame (hedge, 5);
+       assert (hedge_id != original_id);
+       assert (client.m_pending.size () == 2);
+
+       //  Cancelling the request cancels its hedge too
+       client.cancel (original_id);
+       assert (client.m_pending.empty ());
+       std::set<std::string> cancelled;
+       for (int count = 0; count < 2; count++) {
+           zmsg cancel (broker);
+           assert (test_frame (cancel, 3).compare (MDPC_CANCEL) == 0);
+           cancelled.insert (test_frame (cancel, 5));
+       }
+       assert (cancelled.count (original_id) && cancelled.count (hedge_id));
+
+       //  A late reply to the hedge doesn't reach the caller
+       test_reply (broker, hedge);
+       client.set_timeout (100);
+       assert (client.recv () == 0);
+
+       //  Cancelling a circuit breaker's probe lets another one through
+       breaker &state = client.m_breakers ["echo"];
+       state.m_failures = BREAKER_FAILURES;
+       state.m_open_until = s_clock_ms ();
+       request = new zmsg ("Hello");
+       assert (client.send ("echo", request) == 0);
+       zmsg probe (broker);
+       client.cancel (test_frame (probe, 5));
+       request = new zmsg ("Hello");
+       assert (client.send ("echo", request) == 0);
+
+       std::cout << "OK" << std::endl;
        return 0;
    }
 
 private:
+
+   //  ---------------------------------------------------------------------
+   //  Selftest helpers: one frame of a request as the broker got it, and
+   //  a FINAL reply to that request. Requests are [client, "", MDPC02,
+   //  command, service, id, credit, body].
+
+   static std::string
+   test_frame (zmsg &request, size_t index)
+   {
+       zmsg copy (request);
+       for (size_t count = 0; count < index; count++)
+           copy.pop_front ();
+       return (char *) copy.pop_front ().c_str();
+   }
+
+   static void
+   test_reply (zmq::socket_t &broker, zmsg &request)
+   {
+       zmsg reply;
+       reply.push_back ((char*) test_frame (request, 0).c_str());
+       reply.push_back ((char*)"");
+       reply.push_back ((char*)MDPC_CLIENT2);
+       reply.push_back ((char*)MDPC_FINAL);
+       reply.push_back ((char*) test_frame (request, 4).c_str());
+       reply.push_back ((char*) test_frame (request, 5).c_str());
+       reply.push_back ((char*) test_frame (request, 7).c_str());
+       reply.send (broker);
+   }
+
+   //  ---------------------------------------------------------------------
+   //  Per-service circuit breaker. After BREAKER_FAILURES timeouts in a
+   //  row we fail requests to the service straight away for BREAKER_TIME,
+   //  then let a single probe request through; its reply closes the
+   //  circuit, its timeout opens it again. Destroys requests we refuse.
+
+   bool
+   breaker_allow (std::string service, zmsg *&request_p)
+   {
+       std::map<std::string, breaker>::iterator it = m_breakers.find (service);
+       if (it == m_breakers.end() || it->second.m_open_until == 0)
+           return true;
+       if (s_clock_ms () >= it->second.m_open_until && !it->second.m_probing) {
+           it->second.m_probing = true;
+           return true;
+       }
+       if (m_verbose)
+           s_console ("W: circuit to '%s' service open, failing fast", service.c_str());
+       delete request_p;
+       request_p = 0;
+       return false;
+   }
+
+   //  A cancelled probe tells us nothing, so let the next request probe.
+   //  While the circuit is half-open, the probe and its hedge are the only
+   //  requests to the service we can have outstanding.
+
+   void
+   breaker_cancel (std::string service)
+   {
+       std::map<std::string, breaker>::iterator it = m_breakers.find (service);
+       if (it != m_breakers.end())
+           it->second.m_probing = false;
+   }
+
+   void
+   breaker_close (std::string service)
+   {
+       std::map<std::string, breaker>::iterator it = m_breakers.find (service);
+       if (it != m_breakers.end())
+           m_breakers.erase (it);
+   }
+
+   void
+   breaker_trip (std::string service)
+   {
+       breaker &state = m_breakers [service];
+       if (++state.m_failures >= BREAKER_FAILURES || state.m_probing) {
+           if (m_verbose)
+               s_console ("W: opening circuit to '%s' service", service.c_str());
+           state.m_open_until = s_clock_ms () + BREAKER_TIME;
+           state.m_probing = false;
+       }
+   }
+
+   //  ---------------------------------------------------------------------
+   //  Send request with a fresh request id, return the id
+
+   std::string
+   send_request (std::string service, zmsg *&request_p, int credit)
+   {
+       assert (request_p);
+       zmsg *request = request_p;
+
+       std::stringstream request_id;
+       request_id << ++m_sequence;
+       std::stringstream window;
+       window << credit;
+       bool traced = m_trace_rate > 0 && m_sequence % m_trace_rate == 0;
+
+       //  Prefix request with protocol frames
+       //  Frame 0: empty (REQ emulation)
+       //  Frame 1: "MDPC02" (six bytes, extended MDP/Client)
+       //  Frame 2: REQUEST or TRACE command
+       //  Frame 3: Service name (printable string)
+       //  Frame 4: Request id (printable string)
+       //  Frame 5: Initial stream credit, 0 for a single reply
+       //  Frame 6: Trace, for TRACE command only
+       if (traced) {
+           std::string trace;
+           mdp_trace_hop (trace, MDP_HOP_CLIENT_SEND);
+           request->push_front ((char*)trace.c_str());
+       }
+       request->push_front ((char*)window.str().c_str());
+       request->push_front ((char*)request_id.str().c_str());
+       request->push_front ((char*)service.c_str());
+       request->push_front ((char*)(traced? MDPC_TRACE: MDPC_REQUEST));
+       request->push_front ((char*)MDPC_CLIENT2);
+       request->push_front ((char*)"");
+       if (m_verbose) {
+           s_console ("I: send request to '%s' service:", service.c_str());
+           request->dump ();
+       }
+
+       pending &entry = m_pending [request_id.str()];
+       entry.m_service = service;
+       entry.m_sent_ns = s_clock_ns ();
+       entry.m_sent_at = entry.m_sent_ns / 1000000;
+       entry.m_hedge_at = 0;
+       entry.m_request = 0;
+       entry.m_traced = traced;
+       //  Keep a copy of single-reply requests we may want to hedge
+       if (credit == 0 && m_hedge_percentile > 0) {
+           m_hedge_tokens += m_hedge_budget / 100.0;
+           if (m_hedge_tokens > HEDGE_BURST)
+               m_hedge_tokens = HEDGE_BURST;
+           if (m_hedge_delay >= 0) {
+               entry.m_request = new zmsg (*request);
+               entry.m_hedge_at = entry.m_sent_ns + m_hedge_delay;
+           }
+       }
+       ZPROBE3 (mdcli_send, service.c_str(), request_id.str().c_str(), credit);
+       request->send (*m_client);
+       delete request;
+       request_p = 0;
+       return request_id.str();
+   }
+
+   //  ---------------------------------------------------------------------
+   //  Send a duplicate of every request overdue for hedging, as far as
+   //  the budget allows. Times are in nsecs; returns the time the next
+   //  hedge falls due, or zero if none is scheduled.
+
+   int64_t
+   send_hedges (int64_t now_ns)
+   {
+       int64_t next_at = 0;
+       std::vector<std::string> due;
+       for (std::map<std::string, pending>::iterator it = m_pending.begin();
+             it != m_pending.end(); ++it) {
+           if (!it->second.m_request)
+               continue;       //  Not hedgeable, or already hedged
+           if (it->second.m_hedge_at <= now_ns)
+               due.push_back (it->first);
+           else
+           if (next_at == 0 || it->second.m_hedge_at < next_at)
+               next_at = it->second.m_hedge_at;
+       }
+       for (size_t i = 0; i < due.size(); i++) {
+           pending &original = m_pending [due [i]];
+           zmsg *copy = original.m_request;
+           original.m_request = 0;
+           if (m_hedge_tokens < 1) {
+               delete copy;
+               continue;       //  Out of budget, let it run
+           }
+           m_hedge_tokens -= 1;
+
+           //  Same request, new id, in place of the original's id frame
+           std::stringstream hedge_id;
+           hedge_id << ++m_sequence;
+           copy->set_part (4, (unsigned char *) hedge_id.str().c_str());
+           if (m_verbose)
+               s_console ("I: hedging request %s as %s",
+                   due [i].c_str(), hedge_id.str().c_str());
+
+           pending &hedge = m_pending [hedge_id.str()];
+           hedge.m_service = original.m_service;
+           hedge.m_sent_at = original.m_sent_at;
+           hedge.m_sent_ns = original.m_sent_ns;
+           hedge.m_traced = original.m_traced;
+           hedge.m_hedge_at = 0;
+           hedge.m_request = 0;
+           hedge.m_sibling = due [i];
+           hedge.m_origin = due [i];
+           m_pending [due [i]].m_sibling = hedge_id.str();
+           copy->send (*m_client);
+           delete copy;
+       }
+       return next_at;
+   }
+
+   //  ---------------------------------------------------------------------
+   //  Remember the latency of a completed request, in nsecs, and refresh
+   //  our hedge delay from the configured percentile every so often
+
+   void
+   record_latency (int64_t latency_ns)
+   {
+       if (m_latencies.size() < HEDGE_SAMPLES)
+           m_latencies.push_back (latency_ns);
+       else
+           m_latencies [m_latency_nbr % HEDGE_SAMPLES] = latency_ns;
+       m_latency_nbr++;
+
+       if (m_hedge_percentile > 0
+       &&  m_latencies.size() >= HEDGE_MIN_SAMPLES
+       &&  (m_hedge_delay < 0 || m_latency_nbr % 32 == 0)) {
+           std::vector<int64_t> sorted (m_latencies);
+           size_t rank = sorted.size() * m_hedge_percentile / 100;
+           std::nth_element (sorted.begin(), sorted.begin() + rank, sorted.end());
+           m_hedge_delay = sorted [rank];
+       }
+   }
+
+   //  ---------------------------------------------------------------------
+   //  Turn a trace frame into per-hop latencies, in usecs. We only ever
+   //  subtract two stamps taken by the same process, so clocks on
+   //  different hosts don't need to agree. Hops the request skipped, like
+   //  the worker for mmi requests, are left out.
+
+   static std::string
+   trace_report (std::string trace)
+   {
+       std::map<std::string, int64_t> hops;
+       std::stringstream tokens (trace);
+       std::string token;
+       while (tokens >> token) {
+           size_t colon = token.find (':');
+           if (colon != std::string::npos)
+               hops [token.substr (0, colon)] = atoll (token.c_str() + colon + 1);
+       }
+       std::stringstream report;
+       int64_t total = hops [MDP_HOP_CLIENT_RECV] - hops [MDP_HOP_CLIENT_SEND];
+       int64_t broker = hops [MDP_HOP_BROKER_OUT] - hops [MDP_HOP_BROKER_IN];
+       report << "total=" << total / 1000
+              << " client_network=" << (total - broker) / 1000;
+       if (hops.count (MDP_HOP_BROKER_DISPATCH)) {
+           int64_t round_trip = hops [MDP_HOP_BROKER_REPLY]
+                              - hops [MDP_HOP_BROKER_DISPATCH];
+           int64_t worker = hops [MDP_HOP_WORKER_OUT] - hops [MDP_HOP_WORKER_IN];
+           report << " broker_queue="
+                  << (hops [MDP_HOP_BROKER_DISPATCH] - hops [MDP_HOP_BROKER_IN]) / 1000
+                  << " worker_network=" << (round_trip - worker) / 1000
+                  << " worker=" << worker / 1000
+                  << " broker_reply="
+                  << (hops [MDP_HOP_BROKER_OUT] - hops [MDP_HOP_BROKER_REPLY]) / 1000;
+       }
+       else
+           report << " broker=" << broker / 1000;
+       return report.str();
+   }
+
+   //  ---------------------------------------------------------------------
+   //  Grant the worker on a stream more credit
+
+   void
+   send_credit (std::string service, std::string request_id, int credit)
+   {
+       std::stringstream window;
+       window << credit;
+       zmsg msg;
+       msg.push_back ((char*)"");
+       msg.push_back ((char*)MDPC_CLIENT2);
+       msg.push_back ((char*)MDPC_CREDIT);
+       msg.push_back ((char*)service.c_str());
+       msg.push_back ((char*)request_id.c_str());
+       msg.push_back ((char*)window.str().c_str());
+       msg.send (*m_client);
+   }
+
    std::string m_broker;
    zmq::context_t * m_context;
    zmq::socket_t * m_client;     //  Socket to broker
    int m_verbose;                //  Print activity to stdout
    int m_timeout;                //  Request timeout
+   int m_sequence;               //  Last request id we issued
+
+   //  This defines one request we are waiting on
+   struct pending {
+       std::string m_service;    //  Service we sent it to
+       int64_t m_sent_at;        //  When the caller sent it, msecs
+       int64_t m_sent_ns;        //  Same, in nsecs
+       int64_t m_hedge_at;       //  When to send a duplicate, nsecs
+       zmsg *m_request;          //  Copy to hedge with, if hedgeable
+       std::string m_sibling;    //  Id of the duplicate, if hedged
+       std::string m_origin;     //  Caller's id, if we are the duplicate
+       bool m_traced;            //  Reply will carry a trace frame
+   };
+   std::map<std::string, pending> m_pending;   //  Outstanding by request id
+   std::map<std::string, zhistogram*> m_histograms;  //  Latency by service, nsecs
+   int m_trace_rate;             //  Trace one request in this many, or 0
+   std::string m_last_trace;     //  Breakdown of last traced request
+
+   //  This defines the circuit breaker state of one failing service
+   struct breaker {
+       int m_failures;           //  Timeouts in a row
+       int64_t m_open_until;     //  Failing fast until, or 0 if closed
+       bool m_probing;           //  Half-open, probe request outstanding
+       breaker () : m_failures (0), m_open_until (0), m_probing (false) {}
+   };
+   std::map<std::string, breaker> m_breakers;  //  Only failing services
+
+   //  Hedging state
+   int m_hedge_percentile;       //  Hedge beyond this latency, 0 = off
+   int m_hedge_budget;           //  Max hedges as % of requests
+   double m_hedge_tokens;        //  Hedges we can afford right now
+   int64_t m_hedge_delay;        //  Current hedge delay, nsecs, -1 = unknown
+   std::vector<int64_t> m_latencies;   //  Recent reply latencies, nsecs
+   size_t m_latency_nbr;         //  Latencies recorded so far
 };
 
 #endif
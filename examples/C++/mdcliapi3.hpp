@@ -0,0 +1,486 @@
+#ifndef __MDCLIAPI3_HPP_INCLUDED__
+#define __MDCLIAPI3_HPP_INCLUDED__
+
+//  Majordomo client API that talks to several brokers at once
+//
+//  Like the Freelance flcliapi agent, this API works in two halves. The
+//  frontend object is what the application uses; the backend agent runs
+//  in a background thread and does the real work, talking to the
+//  frontend over an inproc pipe. The agent pings every broker, keeps
+//  moving averages of ping time, request time and error rate per broker,
+//  sends each request to the best broker, and fails over to the next best
+//  one if the reply is late. Once every broker has had the request, it
+//  waits on the last one until the request times out. It sleeps until the
+//  next timer is due, so an idle client does no work.
+
+#include "zmsg.hpp"
+#include "mdp.h"
+
+#include <thread>
+#include <vector>
+#include <set>
+
+//  If no broker replies within this time, abandon request
+#define GLOBAL_TIMEOUT      3000    //  msecs
+//  PING interval for brokers we think are alive
+#define PING_INTERVAL       2000    //  msecs
+//  Broker considered dead if silent for this long
+#define SERVER_TTL          6000    //  msecs
+//  Give a broker at least this long before failing over
+#define FAILOVER_MIN        500     //  msecs
+//  Fail over when a reply is this many times later than usual
+#define FAILOVER_FACTOR     4
+//  Weight of newest sample in moving averages
+#define EWMA_ALPHA          0.2
+
+//  .split backend agent
+//  The agent keeps one DEALER socket per broker, so it can choose where
+//  each request goes:
+
+class mdcli_agent {
+public:
+
+   //  ---------------------------------------------------------------------
+   //  One broker we talk to
+
+   struct server {
+       std::string m_endpoint;     //  Broker endpoint
+       zmq::socket_t *m_socket;    //  DEALER socket to broker
+       bool m_alive;               //  Has answered recently
+       double m_ping_rtt;          //  Moving average ping time, msecs
+       double m_rtt;               //  Moving average request time, msecs
+       double m_errors;            //  Moving average error rate, 0..1
+       int64_t m_ping_at;          //  Next ping at this time
+       int64_t m_expires;          //  Considered dead at this time
+       int64_t m_ping_sent;        //  When outstanding ping went, or 0
+   };
+
+   mdcli_agent (zmq::context_t &context, std::string pipe_endpoint, int verbose)
+       : m_context (context),
+         m_pipe (context, ZMQ_PAIR)
+   {
+       m_pipe.connect (pipe_endpoint.c_str());
+       m_verbose = verbose;
+       m_sequence = 0;
+       m_request = 0;
+       m_server = -1;
+       m_timeout = GLOBAL_TIMEOUT;
+   }
+
+   ~mdcli_agent ()
+   {
+       for (size_t i = 0; i < m_servers.size(); i++)
+           delete m_servers [i].m_socket;
+       delete m_request;
+   }
+
+   //  ---------------------------------------------------------------------
+   //  Agent main loop; runs until the frontend sends STOP
+
+   void
+   run ()
+   {
+       while (true) {
+           std::vector<zmq::pollitem_t> items;
+           zmq::pollitem_t pipe_item = {
+               static_cast<void*>(m_pipe), 0, ZMQ_POLLIN, 0 };
+           items.push_back (pipe_item);
+           for (size_t i = 0; i < m_servers.size(); i++) {
+               zmq::pollitem_t item = {
+                   static_cast<void*>(*m_servers [i].m_socket), 0, ZMQ_POLLIN, 0 };
+               items.push_back (item);
+           }
+           //  Sleep until the next timer is due, with no periodic tick
+           int64_t now = s_clock_ms ();
+           int64_t wakeup = next_timer ();
+           long timeout = wakeup ? (long) std::max<int64_t> (wakeup - now, 0) : -1;
+           zmq::poll (&items [0], (int) items.size(), timeout);
+
+           if (items [0].revents & ZMQ_POLLIN) {
+               if (!control_message ())
+                   break;
+           }
+           for (size_t i = 0; i < m_servers.size(); i++) {
+               if (items [i + 1].revents & ZMQ_POLLIN)
+                   server_message (i);
+           }
+           timers ();
+       }
+   }
+
+private:
+
+   //  ---------------------------------------------------------------------
+   //  Handle a command from the frontend, return false on STOP
+
+   bool
+   control_message ()
+   {
+       zmsg msg (m_pipe);
+       std::string command = (char *) msg.pop_front ().c_str();
+       if (command.compare ("CONNECT") == 0) {
+           server srv;
+           srv.m_endpoint = (char *) msg.pop_front ().c_str();
+           srv.m_socket = new zmq::socket_t (m_context, ZMQ_DEALER);
+           int linger = 0;
+           srv.m_socket->setsockopt (ZMQ_LINGER, &linger, sizeof (linger));
+           srv.m_socket->connect (srv.m_endpoint.c_str());
+           srv.m_alive = false;
+           srv.m_ping_rtt = -1;
+           srv.m_rtt = -1;
+           srv.m_errors = 0;
+           srv.m_ping_at = s_clock_ms ();      //  Ping straight away
+           srv.m_expires = s_clock_ms () + SERVER_TTL;
+           srv.m_ping_sent = 0;
+           m_servers.push_back (srv);
+           if (m_verbose)
+               s_console ("I: connecting to broker at %s...", srv.m_endpoint.c_str());
+       }
+       else
+       if (command.compare ("REQUEST") == 0) {
+           assert (!m_request);        //  Strict request-reply cycle
+           m_service = (char *) msg.pop_front ().c_str();
+           m_request = new zmsg (msg);
+           std::stringstream request_id;
+           request_id << "r" << ++m_sequence;
+           m_request_id = request_id.str();
+           m_expires = s_clock_ms () + m_timeout;
+           m_tried.clear ();
+           request_send (next_server ());
+       }
+       else
+       if (command.compare ("TIMEOUT") == 0) {
+           m_timeout = atoi ((char *) msg.pop_front ().c_str());
+       }
+       else
+       if (command.compare ("STOP") == 0) {
+           return false;
+       }
+       return true;
+   }
+
+   //  ---------------------------------------------------------------------
+   //  Best broker we haven't yet tried with the current request, or -1
+
+   int
+   next_server ()
+   {
+       int best = -1;
+       for (size_t i = 0; i < m_servers.size(); i++) {
+           if (m_tried.count (i))
+               continue;
+           if (best < 0 || score (i) < score (best))
+               best = (int) i;
+       }
+       return best;
+   }
+
+   //  ---------------------------------------------------------------------
+   //  Send current request to a broker, or give up if we have none
+
+   void
+   request_send (int best)
+   {
+       if (best < 0) {
+           request_done (0);
+           return;
+       }
+       server &srv = m_servers [best];
+       m_server = best;
+       m_tried.insert (best);
+       m_sent_at = s_clock_ms ();
+       //  Fail over once the reply is well overdue for this broker
+       int64_t patience = FAILOVER_MIN;
+       if (srv.m_rtt > 0 && srv.m_rtt * FAILOVER_FACTOR > patience)
+           patience = (int64_t) (srv.m_rtt * FAILOVER_FACTOR);
+       m_failover_at = std::min (m_sent_at + patience, m_expires);
+
+       zmsg msg (*m_request);
+       server_send (srv, MDPC_REQUEST, m_service, m_request_id, &msg);
+       if (m_verbose)
+           s_console ("I: request %s to %s", m_request_id.c_str(),
+               srv.m_endpoint.c_str());
+   }
+
+   //  ---------------------------------------------------------------------
+   //  Broker ranking, lower is better, by how fast it answers pings; the
+   //  time requests take depends more on the service than on the broker.
+   //  Brokers that look dead or haven't answered a ping yet go to the back
+   //  of the queue.
+
+   double
+   score (size_t index)
+   {
+       server &srv = m_servers [index];
+       double rtt = srv.m_ping_rtt > 0 ? srv.m_ping_rtt : GLOBAL_TIMEOUT;
+       double score = rtt * (1 + 10 * srv.m_errors);
+       if (!srv.m_alive)
+           score += 10 * GLOBAL_TIMEOUT;
+       return score;
+   }
+
+   //  ---------------------------------------------------------------------
+   //  Send a command to one broker
+
+   void
+   server_send (server &srv, const char *command, std::string service,
+       std::string request_id, zmsg *msg)
+   {
+       msg->push_front ((char*)"0");           //  No streaming
+       msg->push_front ((char*)request_id.c_str());
+       msg->push_front ((char*)service.c_str());
+       msg->push_front ((char*)command);
+       msg->push_front ((char*)MDPC_CLIENT2);
+       msg->push_front ((char*)"");
+       msg->send (*srv.m_socket);
+   }
+
+   //  ---------------------------------------------------------------------
+   //  Handle a reply from a broker. Any reply proves the broker alive;
+   //  replies to pings and requests feed its ping and request averages.
+
+   void
+   server_message (size_t index)
+   {
+       server &srv = m_servers [index];
+       zmsg msg (*srv.m_socket);
+       if (msg.parts () < 5)
+           return;
+       msg.pop_front ();                       //  Empty delimiter
+       msg.pop_front ();                       //  MDPC02
+       msg.pop_front ();                       //  FINAL
+       msg.pop_front ();                       //  Service
+       std::string request_id = (char *) msg.pop_front ().c_str();
+
+       int64_t now = s_clock_ms ();
+       if (!srv.m_alive && m_verbose)
+           s_console ("I: broker %s is alive", srv.m_endpoint.c_str());
+       srv.m_alive = true;
+       srv.m_expires = now + SERVER_TTL;
+
+       if (request_id.compare ("ping") == 0) {
+           if (srv.m_ping_sent) {
+               sample (srv, srv.m_ping_rtt, now - srv.m_ping_sent, false);
+               srv.m_ping_sent = 0;
+           }
+       }
+       else
+       if (m_request && request_id == m_request_id
+       &&  (int) index == m_server) {
+           sample (srv, srv.m_rtt, now - m_sent_at, false);
+           request_done (&msg);
+       }
+       //  Else it's a reply we already failed over from, ignore it
+   }
+
+   //  ---------------------------------------------------------------------
+   //  Fold one observation into a broker's error rate and, unless it
+   //  was an error, into one of its round-trip averages
+
+   void
+   sample (server &srv, double &average, int64_t rtt, bool error)
+   {
+       if (!error) {
+           if (average < 0)
+               average = (double) rtt;
+           else
+               average += EWMA_ALPHA * (rtt - average);
+       }
+       srv.m_errors += EWMA_ALPHA * ((error ? 1.0 : 0.0) - srv.m_errors);
+   }
+
+   //  ---------------------------------------------------------------------
+   //  Pass reply to frontend, or FAILED if reply is null
+
+   void
+   request_done (zmsg *reply)
+   {
+       if (reply) {
+           reply->push_front ((char*)"OK");
+           reply->send (m_pipe);
+       }
+       else
+           zmsg ("FAILED", m_pipe);
+       delete m_request;
+       m_request = 0;
+       m_server = -1;
+   }
+
+   //  ---------------------------------------------------------------------
+   //  Time of the next timer due, or zero if none
+
+   int64_t
+   next_timer ()
+   {
+       int64_t next = 0;
+       for (size_t i = 0; i < m_servers.size(); i++) {
+           int64_t at = m_servers [i].m_alive
+               ? std::min (m_servers [i].m_ping_at, m_servers [i].m_expires)
+               : m_servers [i].m_ping_at;
+           if (next == 0 || at < next)
+               next = at;
+       }
+       if (m_request && (next == 0 || m_failover_at < next))
+           next = m_failover_at;
+       return next;
+   }
+
+   //  ---------------------------------------------------------------------
+   //  Fire timers that are due: failover, pings, and broker expiry
+
+   void
+   timers ()
+   {
+       int64_t now = s_clock_ms ();
+       if (m_request && now >= m_failover_at) {
+           server &srv = m_servers [m_server];
+           int next = now < m_expires ? next_server () : -1;
+           if (next < 0 && now < m_expires) {
+               //  Every broker has had it; wait on this one till we expire
+               m_failover_at = m_expires;
+           }
+           else {
+               if (m_verbose)
+                   s_console ("W: no reply from %s, %s", srv.m_endpoint.c_str(),
+                       next < 0 ? "giving up" : "failing over");
+               sample (srv, srv.m_rtt, 0, true);
+               //  Tell the slow broker to drop the request
+               zmsg cancel;
+               server_send (srv, MDPC_CANCEL, m_service, m_request_id, &cancel);
+               request_send (next);
+           }
+       }
+       for (size_t i = 0; i < m_servers.size(); i++) {
+           server &srv = m_servers [i];
+           if (now >= srv.m_ping_at) {
+               //  A ping still outstanding counts against the broker
+               if (srv.m_ping_sent)
+                   sample (srv, srv.m_ping_rtt, 0, true);
+               zmsg ping ("mmi.service");
+               server_send (srv, MDPC_REQUEST, "mmi.service", "ping", &ping);
+               srv.m_ping_sent = now;
+               srv.m_ping_at = now + PING_INTERVAL;
+           }
+           if (srv.m_alive && now >= srv.m_expires) {
+               if (m_verbose)
+                   s_console ("W: broker %s has gone silent", srv.m_endpoint.c_str());
+               srv.m_alive = false;
+           }
+       }
+   }
+
+   zmq::context_t &m_context;
+   zmq::socket_t m_pipe;               //  Pipe back to frontend
+   int m_verbose;                      //  Print activity to stdout
+   std::vector<server> m_servers;      //  Brokers we know about
+   int m_sequence;                     //  Last request number
+
+   //  Request in progress, if any
+   zmsg *m_request;                    //  Request body
+   std::string m_service;              //  Service requested
+   std::string m_request_id;           //  Id we sent it under
+   int m_timeout;                      //  Request timeout, msecs
+   int64_t m_expires;                  //  Give up at this time
+   int64_t m_sent_at;                  //  Sent to current broker at
+   int64_t m_failover_at;              //  Try next broker at this time
+   int m_server;                       //  Current broker, -1 if none
+   std::set<size_t> m_tried;           //  Brokers already tried
+};
+
+//  .split frontend
+//  The frontend object our application works with:
+
+class mdcli {
+public:
+
+   //  ---------------------------------------------------------------------
+   //  Constructor, starts the agent thread
+
+   mdcli (int verbose)
+   {
+       s_version_assert (4, 0);
+       s_catch_signals ();
+
+       m_context = new zmq::context_t (1);
+       m_pipe = new zmq::socket_t (*m_context, ZMQ_PAIR);
+       std::stringstream endpoint;
+       endpoint << "inproc://mdcli-agent-" << this;
+       m_pipe->bind (endpoint.str().c_str());
+
+       m_agent = new mdcli_agent (*m_context, endpoint.str(), verbose);
+       m_thread = new std::thread (&mdcli_agent::run, m_agent);
+       set_timeout (GLOBAL_TIMEOUT);
+   }
+
+   //  ---------------------------------------------------------------------
+   //  Destructor, stops the agent thread
+
+   virtual
+   ~mdcli ()
+   {
+       zmsg msg ("STOP", *m_pipe);
+       m_thread->join ();
+       delete m_thread;
+       delete m_agent;
+       delete m_pipe;
+       delete m_context;
+   }
+
+   //  ---------------------------------------------------------------------
+   //  Connect to one more broker
+
+   void
+   connect (std::string endpoint)
+   {
+       zmsg msg;
+       msg.push_back ((char*)"CONNECT");
+       msg.push_back ((char*)endpoint.c_str());
+       msg.send (*m_pipe);
+   }
+
+   //  ---------------------------------------------------------------------
+   //  Set request timeout, covering all failover attempts
+
+   void
+   set_timeout (int timeout)
+   {
+       std::stringstream value;
+       value << timeout;
+       zmsg msg;
+       msg.push_back ((char*)"TIMEOUT");
+       msg.push_back ((char*)value.str().c_str());
+       msg.send (*m_pipe);
+   }
+
+   //  ---------------------------------------------------------------------
+   //  Send request to the best broker and wait for the reply. Returns
+   //  the reply, or NULL if no broker answered in time. Takes ownership
+   //  of request message and destroys it when sent.
+
+   zmsg *
+   send (std::string service, zmsg *&request_p)
+   {
+       assert (request_p);
+       request_p->push_front ((char*)service.c_str());
+       request_p->push_front ((char*)"REQUEST");
+       request_p->send (*m_pipe);
+       delete request_p;
+       request_p = 0;
+
+       zmsg *reply = new zmsg (*m_pipe);
+       std::string status = (char *) reply->pop_front ().c_str();
+       if (status.compare ("OK") != 0) {
+           delete reply;
+           reply = 0;
+       }
+       return reply;
+   }
+
+private:
+   zmq::context_t *m_context;
+   zmq::socket_t *m_pipe;          //  Pipe through to agent
+   mdcli_agent *m_agent;           //  Agent, runs in m_thread
+   std::thread *m_thread;
+};
+
+#endif
@@ -12,6 +12,7 @@ int main (int argc, char *argv [])
 {
     int verbose = (argc > 1 && strcmp (argv [1], "-v") == 0);
     mdcli session ("tcp://localhost:5555", verbose);
+    session.set_tracing (1000);     //  Sample one request in 1000
 
     int count;
     for (count = 0; count < 100000; count++) {
@@ -27,5 +28,10 @@ int main (int argc, char *argv [])
         }
     }
     std::cout << count << " replies received" << std::endl;
+    const zhistogram *latency = session.latency ("echo");
+    if (latency)
+        std::cout << "latency usecs: " << latency->summary (1000) << std::endl;
+    if (session.last_trace ().size ())
+        std::cout << "last trace usecs: " << session.last_trace () << std::endl;
     return 0;
 }
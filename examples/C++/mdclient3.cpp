@@ -0,0 +1,36 @@
+//
+//  Majordomo Protocol client example - several brokers
+//  Uses the mdcli API in mdcliapi3.hpp, which picks the fastest broker
+//  for each request and fails over to the others
+//
+//  Lets us 'build mdclient3' and 'build all'
+//
+#include "mdcliapi3.hpp"
+
+int main (int argc, char *argv [])
+{
+    if (argc == 1) {
+        std::cout << "syntax: " << argv [0] << " [-v] endpoint ..." << std::endl;
+        return 0;
+    }
+    int verbose = (strcmp (argv [1], "-v") == 0);
+    mdcli session (verbose);
+    for (int argn = verbose ? 2 : 1; argn < argc; argn++)
+        session.connect (argv [argn]);
+
+    int64_t start = s_clock_ms ();
+    int count;
+    for (count = 0; count < 10000 && !s_interrupted; count++) {
+        zmsg *request = new zmsg ("Hello world");
+        zmsg *reply = session.send ("echo", request);
+        if (reply) {
+            delete reply;
+        } else {
+            std::cout << "E: no broker answered, aborting" << std::endl;
+            break;
+        }
+    }
+    std::cout << count << " requests/replies processed in "
+              << (s_clock_ms () - start) << " msecs" << std::endl;
+    return 0;
+}
@@ -0,0 +1,362 @@
+//
+//  Majordomo load generator
+//
+//  Starts a population of simulated clients and workers against a running
+//  broker and steps through a list of request rates, printing throughput,
+//  latency percentiles and, given its pid, the broker's CPU use at each.
+//
+//  Clients are open-loop: requests go out on a schedule (Poisson or
+//  constant arrivals) whether or not earlier ones were answered, and
+//  latency counts from when each request was due, not from when we got
+//  round to sending it. A client that waits for each reply before sending
+//  the next would slow down with the broker and hide exactly the queueing
+//  we are looking for. lag_max says how far we fell behind schedule;
+//  if that grows, the generator is the bottleneck, not the broker.
+//
+//  Workers use the mdwrk API and take a random service time per request.
+//  With -x they crash now and then, like the Paranoid Pirate worker, and
+//  come back after a second.
+//
+//  Run clients and workers in separate processes with -c 0 or -w 0.
+//
+//  Syntax: mdloadgen [-b broker] [-c clients] [-w workers] [-s services]
+//                    [-r rates] [-a poisson|constant] [-d seconds]
+//                    [-t const:usecs|exp:usecs|uniform:usecs:usecs]
+//                    [-x crash chance] [-z size] [-T timeout] [-p broker pid]
+//
+#include "mdwrkapi.hpp"
+
+#include <map>
+#include <vector>
+#include <thread>
+#include <random>
+#include <chrono>
+#include <fstream>
+#include <cmath>
+
+#if (!defined (WIN32))
+#   include <unistd.h>
+#endif
+
+//  Load generator settings, shared by all threads
+typedef struct {
+    std::string broker;
+    int clients;
+    int workers;
+    int services;
+    bool poisson;               //  Poisson arrivals, else constant
+    int seconds;                //  Per rate
+    std::string service_time;   //  Distribution and parameters, in usecs
+    int crash_chance;           //  Worker crashes 1 in this many requests
+    size_t size;                //  Request body
+    int timeout;                //  msecs before we count a request lost
+} config_t;
+
+//  What one client measured at one rate
+typedef struct {
+    zhistogram latency;         //  nsecs, from when each request was due
+    uint64_t sent;
+    uint64_t replies;
+    uint64_t timeouts;
+    int64_t lag_max;            //  nsecs behind schedule
+} tally_t;
+
+static std::string
+s_service_name (int service)
+{
+    std::stringstream name;
+    name << "load." << service;
+    return name.str ();
+}
+
+//  ---------------------------------------------------------------------
+//  Simulated worker
+
+static void
+worker_task (config_t *config, int index)
+{
+    std::mt19937_64 random (index * 7919 + s_clock_ns ());
+    std::uniform_real_distribution<double> uniform (0, 1);
+    std::string service = s_service_name (index % config->services);
+
+    //  Service time distribution, "const:500", "exp:500", "uniform:100:900"
+    std::string kind = config->service_time.substr (0, config->service_time.find (':'));
+    double first = 0, second = 0;
+    size_t colon = config->service_time.find (':');
+    if (colon != std::string::npos) {
+        first = atof (config->service_time.c_str () + colon + 1);
+        colon = config->service_time.find (':', colon + 1);
+        if (colon != std::string::npos)
+            second = atof (config->service_time.c_str () + colon + 1);
+    }
+
+    mdwrk *session = new mdwrk (config->broker, service, 0);
+    zmsg *reply = 0;
+    int cycles = 0;
+    while (true) {
+        zmsg *request = session->recv (reply);
+        if (request == 0)
+            break;              //  Interrupted, or we're done
+
+        cycles++;
+        if (config->crash_chance && cycles > 3
+        &&  uniform (random) * config->crash_chance < 1) {
+            s_console ("I: (worker %d) simulating a crash", index);
+            delete request;
+            delete session;
+            s_sleep (1000);
+            session = new mdwrk (config->broker, service, 0);
+            continue;
+        }
+        double usecs = kind == "exp"? -first * log (1 - uniform (random)):
+                       kind == "uniform"? first + (second - first) * uniform (random):
+                       first;
+        if (usecs >= 1)
+            std::this_thread::sleep_for (std::chrono::microseconds ((int64_t) usecs));
+        reply = request;        //  Echo is complex... :-)
+    }
+    delete session;
+}
+
+//  ---------------------------------------------------------------------
+//  Simulated client: sends requests on schedule for the given time, then
+//  waits for the stragglers
+
+static void
+client_task (config_t *config, int index, double rate, tally_t *tally)
+{
+    std::mt19937_64 random (index * 104729 + s_clock_ns ());
+    std::exponential_distribution<double> gap (rate / 1e9);
+    std::uniform_int_distribution<int> pick (0, config->services - 1);
+
+    zmq::context_t context (1);
+    zmq::socket_t client (context, ZMQ_DEALER);
+    int linger = 0;
+    client.setsockopt (ZMQ_LINGER, &linger, sizeof (linger));
+    s_set_id (client);          //  zmsg can't route libzmq's binary ids
+    client.connect (config->broker.c_str ());
+
+    //  Request ids and when each request was due, oldest first
+    std::map<uint64_t, int64_t> pending;
+    uint64_t sequence = 0;
+    std::string body (config->size, 'x');
+
+    int64_t started = s_clock_ns ();
+    int64_t stop_at = started + (int64_t) config->seconds * 1000000000;
+    int64_t give_up_at = stop_at + (int64_t) config->timeout * 1000000;
+    //  Spread constant arrivals over the clients, not all at once
+    int64_t due = started + (int64_t) (config->poisson? gap (random):
+                                       index * 1e9 / rate / config->clients);
+    while (!s_interrupted) {
+        int64_t now = s_clock_ns ();
+        if (now >= give_up_at || (now >= stop_at && pending.empty ()))
+            break;
+
+        //  Send everything that's due; if we fell behind, catch up
+        while (due <= now && due < stop_at) {
+            std::stringstream request_id;
+            request_id << ++sequence;
+            std::string service = s_service_name (pick (random));
+            zmsg request (body.c_str ());
+            request.push_front ((char*)"0");
+            request.push_front ((char*)request_id.str ().c_str ());
+            request.push_front ((char*)service.c_str ());
+            request.push_front ((char*)MDPC_REQUEST);
+            request.push_front ((char*)MDPC_CLIENT2);
+            request.push_front ((char*)"");
+            request.send (client);
+            pending [sequence] = due;
+            tally->sent++;
+            if (now - due > tally->lag_max)
+                tally->lag_max = now - due;
+            due += (int64_t) (config->poisson? gap (random): 1e9 / rate);
+        }
+
+        //  Wait for a reply until the next request is due. Poll only
+        //  counts whole msecs; under one, we take a quick look for replies
+        //  and then sleep off the rest, so we neither spin nor send late.
+        int64_t wait = (due < stop_at? due: give_up_at) - s_clock_ns ();
+        long timeout = wait > 0? (long) (wait / 1000000): 0;
+        zmq::pollitem_t items [] = {
+            { static_cast<void*>(client), 0, ZMQ_POLLIN, 0 } };
+        try {
+            zmq::poll (items, 1, timeout);
+        }
+        catch (zmq::error_t &e) {
+            continue;           //  Interrupted by a signal
+        }
+        now = s_clock_ns ();
+        if (items [0].revents & ZMQ_POLLIN) {
+            //  Reply is ["", MDPC02, FINAL, service, id, body]
+            zmsg reply (client);
+            if (reply.parts () >= 5) {
+                reply.pop_front ();
+                reply.pop_front ();
+                std::string command = (char *) reply.pop_front ().c_str ();
+                reply.pop_front ();
+                uint64_t request_id = strtoull ((char *) reply.pop_front ().c_str (), NULL, 10);
+                std::map<uint64_t, int64_t>::iterator it = pending.find (request_id);
+                if (it != pending.end () && command.compare (MDPC_FINAL) == 0) {
+                    tally->latency.record (now - it->second);
+                    tally->replies++;
+                    pending.erase (it);
+                }
+            }
+        }
+        else
+        if (timeout == 0 && wait > 0)
+            std::this_thread::sleep_for (std::chrono::nanoseconds (wait));
+        //  Requests we've waited too long for are lost
+        while (!pending.empty ()
+        &&     now - pending.begin ()->second > (int64_t) config->timeout * 1000000) {
+            tally->timeouts++;
+            pending.erase (pending.begin ());
+        }
+    }
+    tally->timeouts += pending.size ();
+}
+
+//  ---------------------------------------------------------------------
+//  CPU time used by a process so far, in secs, or -1 if we can't tell
+
+static double
+s_cpu_seconds (int pid)
+{
+#if defined (__linux__)
+    std::stringstream path;
+    path << "/proc/" << pid << "/stat";
+    std::ifstream stat (path.str ().c_str ());
+    std::string line;
+    if (!pid || !std::getline (stat, line))
+        return -1;
+    //  Fields after the command name, which may hold spaces; utime and
+    //  stime are the 14th and 15th fields counting from pid
+    std::stringstream fields (line.substr (line.rfind (')') + 2));
+    std::string field;
+    uint64_t ticks = 0;
+    for (int index = 3; index <= 15 && fields >> field; index++)
+        if (index >= 14)
+            ticks += strtoull (field.c_str (), NULL, 10);
+    return (double) ticks / sysconf (_SC_CLK_TCK);
+#else
+    return -1;
+#endif
+}
+
+int main (int argc, char *argv [])
+{
+    config_t config;
+    config.broker = "tcp://localhost:5555";
+    config.clients = 10;
+    config.workers = 10;
+    config.services = 1;
+    config.poisson = true;
+    config.seconds = 10;
+    config.service_time = "const:0";
+    config.crash_chance = 0;
+    config.size = 64;
+    config.timeout = 2500;
+    std::string rates = "1000";
+    int broker_pid = 0;
+
+    for (int argn = 1; argn + 1 < argc; argn += 2) {
+        std::string option = argv [argn];
+        std::string value = argv [argn + 1];
+        if (option == "-b") config.broker = value;
+        else if (option == "-c") config.clients = atoi (value.c_str ());
+        else if (option == "-w") config.workers = atoi (value.c_str ());
+        else if (option == "-s") config.services = atoi (value.c_str ());
+        else if (option == "-r") rates = value;
+        else if (option == "-a") config.poisson = value == "poisson";
+        else if (option == "-d") config.seconds = atoi (value.c_str ());
+        else if (option == "-t") config.service_time = value;
+        else if (option == "-x") config.crash_chance = atoi (value.c_str ());
+        else if (option == "-z") config.size = atoi (value.c_str ());
+        else if (option == "-T") config.timeout = atoi (value.c_str ());
+        else if (option == "-p") broker_pid = atoi (value.c_str ());
+        else {
+            std::cout << "E: unknown option " << option << std::endl;
+            return 1;
+        }
+    }
+    if (argc % 2 == 0 || config.services < 1 || config.clients < 0
+    ||  config.workers < 0 || config.seconds < 1) {
+        std::cout << "syntax: mdloadgen [-b broker] [-c clients] [-w workers]"
+                  << " [-s services] [-r rates] [-a poisson|constant]"
+                  << " [-d seconds] [-t const:usecs|exp:usecs|uniform:usecs:usecs]"
+                  << " [-x crash chance] [-z size] [-T timeout] [-p broker pid]"
+                  << std::endl;
+        return 1;
+    }
+    s_catch_signals ();
+
+    std::vector<std::thread *> workers;
+    for (int worker = 0; worker < config.workers; worker++)
+        workers.push_back (new std::thread (worker_task, &config, worker));
+
+    if (config.clients == 0) {
+        //  Workers only, until interrupted
+        std::cout << "I: " << config.workers << " workers on "
+                  << config.services << " services, Ctrl-C to stop" << std::endl;
+    }
+    else {
+        s_sleep (1000);         //  Let workers register with the broker
+        std::stringstream list (rates);
+        std::string item;
+        while (!s_interrupted && std::getline (list, item, ',')) {
+            double rate = atof (item.c_str ());
+            if (rate <= 0)
+                continue;
+
+            std::vector<tally_t *> tallies;
+            std::vector<std::thread *> clients;
+            double cpu_before = s_cpu_seconds (broker_pid);
+            int64_t started = s_clock_ns ();
+            for (int client = 0; client < config.clients; client++) {
+                tally_t *tally = new tally_t;
+                tally->sent = tally->replies = tally->timeouts = 0;
+                tally->lag_max = 0;
+                tallies.push_back (tally);
+                clients.push_back (new std::thread (client_task, &config, client,
+                                                    rate / config.clients, tally));
+            }
+            zhistogram latency;
+            uint64_t sent = 0, replies = 0, timeouts = 0;
+            int64_t lag_max = 0;
+            for (int client = 0; client < config.clients; client++) {
+                clients [client]->join ();
+                delete clients [client];
+                latency.merge (tallies [client]->latency);
+                sent += tallies [client]->sent;
+                replies += tallies [client]->replies;
+                timeouts += tallies [client]->timeouts;
+                if (tallies [client]->lag_max > lag_max)
+                    lag_max = tallies [client]->lag_max;
+                delete tallies [client];
+            }
+            double elapsed = (s_clock_ns () - started) / 1e9;
+            double cpu_after = s_cpu_seconds (broker_pid);
+
+            std::cout << "rate=" << (uint64_t) rate
+                      << " sent=" << sent
+                      << " replies=" << replies
+                      << " timeouts=" << timeouts
+                      << " throughput=" << (uint64_t) (replies / config.seconds) << "/s"
+                      << " p50=" << latency.percentile (50) / 1000 << "us"
+                      << " p99=" << latency.percentile (99) / 1000 << "us"
+                      << " p999=" << latency.percentile (99.9) / 1000 << "us"
+                      << " max=" << latency.max () / 1000 << "us"
+                      << " lag_max=" << lag_max / 1000 << "us";
+            if (cpu_before >= 0 && cpu_after >= 0)
+                std::cout << " broker_cpu=" << (int) ((cpu_after - cpu_before)
+                                                      * 100 / elapsed) << "%";
+            std::cout << std::endl;
+        }
+        s_interrupted = 1;      //  Tells our workers to stop
+    }
+    for (size_t worker = 0; worker < workers.size (); worker++) {
+        workers [worker]->join ();
+        delete workers [worker];
+    }
+    return 0;
+}
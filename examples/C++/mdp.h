@@ -5,9 +5,46 @@
 #ifndef __MDP_H_INCLUDED__
 #define __MDP_H_INCLUDED__
 
+#include "zhelpers.hpp"
+
 //  This is the version of MDP/Client we implement
 #define MDPC_CLIENT         "MDPC01"
 
+//  This is the extended MDP/Client, where every message carries a
+//  command and a client-assigned request id, so replies can be streamed
+#define MDPC_CLIENT2        "MDPC02"
+
+//  MDP/Client commands, as strings (MDPC02 only)
+#define MDPC_REQUEST        "\001"
+#define MDPC_PARTIAL        "\002"
+#define MDPC_FINAL          "\003"
+#define MDPC_CREDIT         "\004"
+#define MDPC_CANCEL         "\005"
+#define MDPC_TRACE          "\006"     //  REQUEST with a trace frame
+
+//  A traced request carries one extra frame, after the credit frame on
+//  the way in and after the request id on the way out. Each hop appends
+//  " <hop>:<nsecs>" to it, using its own monotonic clock, so only times
+//  taken by the same hop can be subtracted from each other. The worker
+//  gets the trace inside the envelope, as [client][trace][""][body].
+#define MDP_HOP_CLIENT_SEND     "cs"
+#define MDP_HOP_BROKER_IN       "bi"    //  Request reached broker
+#define MDP_HOP_BROKER_DISPATCH "bd"    //  Request given to worker
+#define MDP_HOP_WORKER_IN       "wi"
+#define MDP_HOP_WORKER_OUT      "wo"
+#define MDP_HOP_BROKER_REPLY    "br"    //  Reply reached broker
+#define MDP_HOP_BROKER_OUT      "bo"
+#define MDP_HOP_CLIENT_RECV     "cr"
+
+//  Append one hop, stamped now, to a trace frame
+static void
+mdp_trace_hop (std::string &trace, const char *hop)
+{
+    std::stringstream stamp;
+    stamp << " " << hop << ":" << s_clock_ns ();
+    trace += stamp.str ();
+}
+
 //  This is the version of MDP/Worker we implement
 #define MDPW_WORKER         "MDPW01"
 
@@ -17,10 +54,19 @@
 #define MDPW_REPLY          "\003"
 #define MDPW_HEARTBEAT      "\004"
 #define MDPW_DISCONNECT     "\005"
+#define MDPW_STREAM         "\006"
+#define MDPW_PARTIAL        "\007"
+#define MDPW_CREDIT         "\010"
+#define MDPW_CANCEL         "\011"
+
+static char *mdpc_commands [] = {
+    NULL, (char*)"REQUEST", (char*)"PARTIAL", (char*)"FINAL", (char*)"CREDIT", (char*)"CANCEL",
+    (char*)"TRACE"
+};
 
 static char *mdps_commands [] = {
-    NULL, (char*)"READY", (char*)"REQUEST", (char*)"REPLY", (char*)"HEARTBEAT", (char*)"DISCONNECT"
+    NULL, (char*)"READY", (char*)"REQUEST", (char*)"REPLY", (char*)"HEARTBEAT", (char*)"DISCONNECT",
+    (char*)"STREAM", (char*)"PARTIAL", (char*)"CREDIT", (char*)"CANCEL"
 };
 
 #endif
-
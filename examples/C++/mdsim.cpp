@@ -0,0 +1,390 @@
+//
+//  Majordomo broker simulator
+//
+//  Runs the real broker logic from mdbroker.hpp against simulated clients
+//  and workers, in virtual time and without sockets, so we can see how the
+//  broker copes with 100,000 workers or millions of requests on a laptop.
+//  Events go through a single queue in time order, and every random choice
+//  comes from one seeded generator, so a run is repeatable: same options,
+//  same seed, same virtual results.
+//
+//  The broker itself runs for real, and we time every call into it. That
+//  real time is what to watch: a per-message cost that grows with the
+//  number of workers or the queue depth is an algorithm problem, and will
+//  show up here long before production.
+//
+//  Syntax: mdsim [-w workers] [-c clients] [-s services] [-r rate]
+//                [-d seconds] [-t usecs] [-l usecs] [-x crash chance]
+//                [-S seed] [-v]
+//
+#include "mdbroker.hpp"
+
+#include <queue>
+#include <random>
+#include <unordered_map>
+
+//  Event types
+enum {
+    EVENT_BROKER,               //  Message arrives at broker
+    EVENT_WORKER,               //  Message arrives at worker
+    EVENT_CLIENT,               //  Message arrives at client
+    EVENT_WORKER_START,         //  Worker connects and says READY
+    EVENT_WORKER_DONE,          //  Worker finished its request
+    EVENT_WORKER_HEARTBEAT,
+    EVENT_ARRIVAL,              //  Some client sends a new request
+    EVENT_HEARTBEAT,            //  Broker heartbeat
+    EVENT_REPORT                //  Progress report, once per second
+};
+
+typedef struct {
+    int64_t at;                 //  Virtual nsecs
+    uint64_t sequence;          //  Breaks ties in order of scheduling
+    int type;
+    int target;                 //  Worker or client index
+    zmsg *msg;
+} event_t;
+
+struct later {
+    bool operator () (const event_t &left, const event_t &right) const {
+        return left.at > right.at
+           || (left.at == right.at && left.sequence > right.sequence);
+    }
+};
+
+//  One simulated worker; a crash ends its identity, and it comes back
+//  under a new one
+typedef struct {
+    std::string identity;
+    int service;
+    int generation;
+    bool alive;
+    zmsg *reply;                //  Reply envelope and body, while busy
+} sim_worker_t;
+
+class simulator : public broker_io {
+public:
+    simulator (int workers, int services, uint64_t seed)
+        : m_random (seed)
+    {
+        m_now = 0;
+        m_sequence = 0;
+        m_workers.resize (workers);
+        for (int index = 0; index < workers; index++) {
+            m_workers [index].service = index % services;
+            m_workers [index].generation = 0;
+            m_workers [index].alive = false;
+            m_workers [index].reply = 0;
+        }
+    }
+
+    //  ---------------------------------------------------------------------
+    //  broker_io: virtual clock, and messages become events
+
+    int64_t clock () {
+        return m_now / 1000000;
+    }
+    int64_t clock_ns () {
+        return m_now;
+    }
+    void send (zmsg &msg) {
+        std::string identity = msg.address ();
+        if (identity [0] == 'w') {
+            //  We don't need heartbeats to tell our workers are alive
+            if (msg.parts () == 4 && strcmp (msg.body (), MDPW_HEARTBEAT) == 0) {
+                msg.clear ();
+                return;
+            }
+            schedule (m_latency, EVENT_WORKER, atoi (identity.c_str () + 1), new zmsg (msg));
+        }
+        else
+            schedule (m_latency, EVENT_CLIENT, atoi (identity.c_str () + 1), new zmsg (msg));
+        msg.clear ();
+    }
+
+    void schedule (int64_t delay, int type, int target = 0, zmsg *msg = 0)
+    {
+        event_t event;
+        event.at = m_now + delay;
+        event.sequence = m_sequence++;
+        event.type = type;
+        event.target = target;
+        event.msg = msg;
+        m_events.push (event);
+    }
+
+    std::priority_queue<event_t, std::vector<event_t>, later> m_events;
+    std::vector<sim_worker_t> m_workers;
+    std::mt19937_64 m_random;
+    int64_t m_now;              //  Virtual nsecs
+    int64_t m_latency;          //  Network delay each way, nsecs
+    uint64_t m_sequence;
+};
+
+//  Build a message as the broker would receive it from identity
+static zmsg *
+s_message (std::string identity, const char *header, const char *command)
+{
+    zmsg *msg = new zmsg ();
+    msg->push_back ((char *) identity.c_str ());
+    msg->push_back ((char *) "");
+    msg->push_back ((char *) header);
+    msg->push_back ((char *) command);
+    return msg;
+}
+
+static std::string
+s_service_name (int service)
+{
+    std::stringstream name;
+    name << "sim." << service;
+    return name.str ();
+}
+
+int main (int argc, char *argv [])
+{
+    int workers = 1000;
+    int clients = 100;
+    int services = 1;
+    double rate = 10000;        //  Requests/sec, virtual
+    int seconds = 10;
+    double service_usecs = 1000;
+    double latency_usecs = 50;
+    int crash_chance = 0;
+    uint64_t seed = 1;
+    int verbose = 0;
+    for (int argn = 1; argn < argc; argn++) {
+        std::string option = argv [argn];
+        if (option == "-v") {
+            verbose = 1;
+            continue;
+        }
+        if (argn + 1 == argc) {
+            std::cout << "syntax: mdsim [-w workers] [-c clients] [-s services]"
+                      << " [-r rate] [-d seconds] [-t usecs] [-l usecs]"
+                      << " [-x crash chance] [-S seed] [-v]" << std::endl;
+            return 1;
+        }
+        std::string value = argv [++argn];
+        if (option == "-w") workers = atoi (value.c_str ());
+        else if (option == "-c") clients = atoi (value.c_str ());
+        else if (option == "-s") services = atoi (value.c_str ());
+        else if (option == "-r") rate = atof (value.c_str ());
+        else if (option == "-d") seconds = atoi (value.c_str ());
+        else if (option == "-t") service_usecs = atof (value.c_str ());
+        else if (option == "-l") latency_usecs = atof (value.c_str ());
+        else if (option == "-x") crash_chance = atoi (value.c_str ());
+        else if (option == "-S") seed = strtoull (value.c_str (), NULL, 10);
+        else {
+            std::cout << "E: unknown option " << option << std::endl;
+            return 1;
+        }
+    }
+    assert (workers > 0 && clients > 0 && services > 0 && rate > 0);
+
+    simulator sim (workers, services, seed);
+    sim.m_latency = (int64_t) (latency_usecs * 1000);
+    broker brk (verbose, &sim);
+
+    std::exponential_distribution<double> arrival (rate / 1e9);
+    std::exponential_distribution<double> service_time (1 / (service_usecs * 1000));
+    std::uniform_real_distribution<double> uniform (0, 1);
+
+    //  Workers connect over the first second, not all at once
+    for (int index = 0; index < workers; index++)
+        sim.schedule ((int64_t) (uniform (sim.m_random) * 1e9), EVENT_WORKER_START, index);
+    sim.schedule ((int64_t) 1e9, EVENT_ARRIVAL);
+    sim.schedule ((int64_t) HEARTBEAT_INTERVAL * 1000000, EVENT_HEARTBEAT);
+    sim.schedule ((int64_t) 1e9, EVENT_REPORT);
+    int64_t arrivals_end = (int64_t) (seconds + 1) * 1000000000;
+    int64_t end = arrivals_end + (int64_t) HEARTBEAT_EXPIRY * 1000000;
+
+    std::unordered_map<uint64_t, int64_t> pending;  //  Request id, sent at
+    uint64_t requests = 0;
+    uint64_t replies = 0;
+    uint64_t crashes = 0;
+    zhistogram latency;         //  Virtual nsecs, client to client
+    zhistogram process_time;    //  Real nsecs per broker call
+    zhistogram heartbeat_time;
+    int64_t real_started = s_clock_ns ();
+    int64_t real_in_broker = 0;
+    int64_t real_this_second = 0;
+    uint64_t calls_this_second = 0;
+    std::string body (64, 'x');
+
+    while (!sim.m_events.empty () && sim.m_events.top ().at < end && !s_interrupted) {
+        event_t event = sim.m_events.top ();
+        sim.m_events.pop ();
+        sim.m_now = event.at;
+
+        if (event.type == EVENT_BROKER) {
+            int64_t started = s_clock_ns ();
+            brk.process (event.msg);
+            int64_t spent = s_clock_ns () - started;
+            process_time.record (spent);
+            real_in_broker += spent;
+            real_this_second += spent;
+            calls_this_second++;
+        }
+        else
+        if (event.type == EVENT_HEARTBEAT) {
+            int64_t started = s_clock_ns ();
+            brk.heartbeat ();
+            int64_t spent = s_clock_ns () - started;
+            heartbeat_time.record (spent);
+            real_in_broker += spent;
+            real_this_second += spent;
+            calls_this_second++;
+            sim.schedule ((int64_t) HEARTBEAT_INTERVAL * 1000000, EVENT_HEARTBEAT);
+        }
+        else
+        if (event.type == EVENT_WORKER_START) {
+            sim_worker_t &worker = sim.m_workers [event.target];
+            std::stringstream identity;
+            identity << "w" << event.target << "." << worker.generation;
+            worker.identity = identity.str ();
+            worker.alive = true;
+            zmsg *ready = s_message (worker.identity, MDPW_WORKER, MDPW_READY);
+            ready->push_back ((char *) s_service_name (worker.service).c_str ());
+            sim.schedule (sim.m_latency, EVENT_BROKER, 0, ready);
+            sim.schedule ((int64_t) HEARTBEAT_INTERVAL * 1000000,
+                          EVENT_WORKER_HEARTBEAT, event.target);
+        }
+        else
+        if (event.type == EVENT_WORKER_HEARTBEAT) {
+            sim_worker_t &worker = sim.m_workers [event.target];
+            if (worker.alive) {
+                sim.schedule (sim.m_latency, EVENT_BROKER, 0,
+                    s_message (worker.identity, MDPW_WORKER, MDPW_HEARTBEAT));
+                sim.schedule ((int64_t) HEARTBEAT_INTERVAL * 1000000,
+                              EVENT_WORKER_HEARTBEAT, event.target);
+            }
+        }
+        else
+        if (event.type == EVENT_WORKER) {
+            sim_worker_t &worker = sim.m_workers [event.target];
+            zmsg *msg = event.msg;
+            std::string identity = (char *) msg->pop_front ().c_str ();
+            msg->pop_front ();          //  Empty delimiter
+            msg->pop_front ();          //  MDPW01
+            std::string command = (char *) msg->pop_front ().c_str ();
+            if (!worker.alive || identity != worker.identity)
+                delete msg;             //  For a worker that crashed
+            else
+            if (command.compare (MDPW_REQUEST) == 0) {
+                //  Keep [client][""][body] for the reply
+                if (crash_chance && uniform (sim.m_random) * crash_chance < 1) {
+                    crashes++;
+                    worker.alive = false;
+                    worker.generation++;
+                    sim.schedule ((int64_t) 10 * 1000000000, EVENT_WORKER_START,
+                                  event.target);
+                    delete msg;
+                }
+                else {
+                    worker.reply = msg;
+                    sim.schedule ((int64_t) service_time (sim.m_random),
+                                  EVENT_WORKER_DONE, event.target);
+                }
+            }
+            else
+            if (command.compare (MDPW_DISCONNECT) == 0) {
+                worker.alive = false;
+                worker.generation++;
+                sim.schedule ((int64_t) HEARTBEAT_INTERVAL * 1000000,
+                              EVENT_WORKER_START, event.target);
+                delete msg;
+            }
+            else
+                delete msg;             //  Nothing else matters to us
+        }
+        else
+        if (event.type == EVENT_WORKER_DONE) {
+            sim_worker_t &worker = sim.m_workers [event.target];
+            if (worker.alive && worker.reply) {
+                zmsg *reply = worker.reply;
+                reply->push_front ((char *) MDPW_REPLY);
+                reply->push_front ((char *) MDPW_WORKER);
+                reply->push_front ((char *) "");
+                reply->push_front ((char *) worker.identity.c_str ());
+                worker.reply = 0;
+                sim.schedule (sim.m_latency, EVENT_BROKER, 0, reply);
+            }
+        }
+        else
+        if (event.type == EVENT_ARRIVAL) {
+            if (sim.m_now < arrivals_end) {
+                std::stringstream client;
+                client << "c" << (int) (uniform (sim.m_random) * clients);
+                std::stringstream request_id;
+                request_id << ++requests;
+                zmsg *request = s_message (client.str (), MDPC_CLIENT2, MDPC_REQUEST);
+                request->push_back ((char *) s_service_name (
+                    (int) (uniform (sim.m_random) * services)).c_str ());
+                request->push_back ((char *) request_id.str ().c_str ());
+                request->push_back ((char *) "0");
+                request->push_back ((char *) body.c_str ());
+                pending [requests] = sim.m_now;
+                sim.schedule (sim.m_latency, EVENT_BROKER, 0, request);
+                sim.schedule ((int64_t) arrival (sim.m_random), EVENT_ARRIVAL);
+            }
+        }
+        else
+        if (event.type == EVENT_CLIENT) {
+            //  [client][""][MDPC02][command][service][id][body]
+            zmsg *msg = event.msg;
+            if (msg->parts () >= 6) {
+                msg->pop_front ();
+                msg->pop_front ();
+                msg->pop_front ();
+                std::string command = (char *) msg->pop_front ().c_str ();
+                msg->pop_front ();
+                uint64_t request_id = strtoull ((char *) msg->pop_front ().c_str (), NULL, 10);
+                std::unordered_map<uint64_t, int64_t>::iterator it = pending.find (request_id);
+                if (it != pending.end () && command.compare (MDPC_FINAL) == 0) {
+                    latency.record (sim.m_now - it->second);
+                    replies++;
+                    pending.erase (it);
+                }
+            }
+            delete msg;
+        }
+        else
+        if (event.type == EVENT_REPORT) {
+            std::cout << "t=" << sim.m_now / 1000000000 << "s"
+                      << " requests=" << requests
+                      << " replies=" << replies
+                      << " pending=" << pending.size ()
+                      << " broker_calls=" << calls_this_second
+                      << " broker_ms=" << real_this_second / 1000000
+                      << " ns_per_call=" << (calls_this_second
+                          ? real_this_second / (int64_t) calls_this_second: 0)
+                      << std::endl;
+            real_this_second = 0;
+            calls_this_second = 0;
+            sim.schedule ((int64_t) 1e9, EVENT_REPORT);
+        }
+    }
+    //  Drop whatever is still in flight
+    while (!sim.m_events.empty ()) {
+        delete sim.m_events.top ().msg;
+        sim.m_events.pop ();
+    }
+    for (size_t index = 0; index < sim.m_workers.size (); index++)
+        delete sim.m_workers [index].reply;
+
+    double real_seconds = (s_clock_ns () - real_started) / 1e9;
+    std::cout << "I: simulated " << end / 1000000000 << "s with " << workers
+              << " workers, " << clients << " clients, " << services
+              << " services in " << real_seconds << "s" << std::endl;
+    std::cout << "I: requests=" << requests << " replies=" << replies
+              << " lost=" << pending.size () << " crashes=" << crashes << std::endl;
+    std::cout << "I: virtual latency " << latency.summary (1000) << " (usecs)"
+              << std::endl;
+    std::cout << "I: broker process " << process_time.summary ()
+              << " (real nsecs)" << std::endl;
+    std::cout << "I: broker heartbeat " << heartbeat_time.summary ()
+              << " (real nsecs)" << std::endl;
+    std::cout << "I: broker share of real time "
+              << (int) (real_in_broker / 1e7 / real_seconds) << "%" << std::endl;
+    return 0;
+}
@@ -3,6 +3,8 @@
 
 #include "zmsg.hpp"
 #include "mdp.h"
+#include "zhistogram.hpp"
+#include "zlog.hpp"
 
 //  Reliability parameters
 #define HEARTBEAT_LIVENESS  3       //  3-5 is reasonable
@@ -24,6 +26,10 @@ public:
         m_context = new zmq::context_t (1);
         m_worker = 0;
         m_expect_reply = false;
+        m_credit = 0;
+        m_streaming = false;
+        m_cancelled = false;
+        m_received_ns = 0;
         m_verbose = verbose;
         m_heartbeat = 2500;     //  msecs
         m_reconnect = 2500;     //  msecs
@@ -59,9 +65,8 @@ public:
         msg->push_front ((char*)"");
 
         if (m_verbose) {
-            s_console ("I: sending %s to broker",
+            ZLOG_BLOCK (msg->describe (), "I: sending %s to broker",
                 mdps_commands [(int) *command]);
-            msg->dump ();
         }
         msg->send (*m_worker);
         delete msg;
@@ -72,6 +77,8 @@ public:
 
     void connect_to_broker ()
     {
+        //  A new session has no stream to continue
+        m_streaming = false;
         if (m_worker) {
             delete m_worker;
         }
@@ -88,7 +95,7 @@ public:
 
         //  If liveness hits zero, queue is considered disconnected
         m_liveness = HEARTBEAT_LIVENESS;
-        m_heartbeat_at = s_clock () + m_heartbeat;
+        m_heartbeat_at = s_clock_ms () + m_heartbeat;
     }
 
 
@@ -113,33 +120,61 @@ public:
 
     //  ---------------------------------------------------------------------
     //  Send reply, if any, to broker and wait for next request.
+    //  A handler whose request was cancelled may pass a null reply.
 
     zmsg *
     recv (zmsg *&reply_p)
     {
         //  Format and send the reply if we were provided one
         zmsg *reply = reply_p;
-        assert (reply || !m_expect_reply);
+        assert (reply || !m_expect_reply || m_cancelled);
+        //  The handler ran since we last looked at the clock
+        s_loop_refresh ();
+        if (m_received_ns) {
+            int64_t handler_ns = s_loop_ns () - m_received_ns;
+            m_handler_time.record (handler_ns);
+            ZPROBE2 (mdwrk_reply, m_service.c_str(), handler_ns);
+            m_received_ns = 0;
+        }
+        if (!reply && m_cancelled && m_reply_to.size() != 0) {
+            //  Broker needs a reply to know we are free again
+            reply = new zmsg ("");
+        }
         if (reply) {
-            assert (m_reply_to.size()!=0);
-            reply->wrap (m_reply_to.c_str(), "");
-            m_reply_to = "";
-            send_to_broker ((char*)MDPW_REPLY, "", reply);
-            delete reply_p;
+            assert (m_reply_to.size()!=0 || m_cancelled);
+            //  Without a return address the request died with the old
+            //  broker session, and there is nobody to reply to
+            if (m_reply_to.size() != 0) {
+                if (m_trace.size() > 0) {
+                    //  Trace goes back between client address and body
+                    mdp_trace_hop (m_trace, MDP_HOP_WORKER_OUT);
+                    reply->wrap (m_trace.c_str(), "");
+                    reply->push_front ((char*)m_reply_to.c_str());
+                }
+                else
+                    reply->wrap (m_reply_to.c_str(), "");
+                send_to_broker ((char*)MDPW_REPLY, "", reply);
+            }
+            delete reply;
             reply_p = 0;
         }
+        m_reply_to = "";
+        m_trace = "";
         m_expect_reply = true;
+        m_streaming = false;
+        m_cancelled = false;
+        m_credit = 0;
 
         while (!s_interrupted) {
             zmq::pollitem_t items[] = {
                 { static_cast<void*>(*m_worker),  0, ZMQ_POLLIN, 0 } };
             zmq::poll (items, 1, m_heartbeat);
+            s_loop_refresh ();
 
             if (items[0].revents & ZMQ_POLLIN) {
                 zmsg *msg = new zmsg(*m_worker);
                 if (m_verbose) {
-                    s_console ("I: received message from broker:");
-                    msg->dump ();
+                    ZLOG_BLOCK (msg->describe (), "I: received message from broker:");
                 }
                 m_liveness = HEARTBEAT_LIVENESS;
 
@@ -159,9 +194,24 @@ public:
                 if (command.compare (MDPW_REQUEST) == 0) {
                     //  We should pop and save as many addresses as there are
                     //  up to a null part, but for now, just save one...
-                    m_reply_to = msg->unwrap ();
+                    unwrap_request (msg);
+                    m_received_ns = s_loop_ns ();
+                    ZPROBE2 (mdwrk_request, m_service.c_str(), 0);
                     return msg;     //  We have a request to process
                 }
+                else if (command.compare (MDPW_STREAM) == 0) {
+                    //  Streamed request, starts with our initial credit
+                    m_credit = atoi ((char*) msg->pop_front ().c_str());
+                    m_streaming = true;
+                    unwrap_request (msg);
+                    m_received_ns = s_loop_ns ();
+                    ZPROBE2 (mdwrk_request, m_service.c_str(), m_credit);
+                    return msg;     //  We have a request to process
+                }
+                else if (command.compare (MDPW_CREDIT) == 0
+                     ||  command.compare (MDPW_CANCEL) == 0) {
+                    //  Late control for a request we already finished
+                }
                 else if (command.compare (MDPW_HEARTBEAT) == 0) {
                     //  Do nothing for heartbeats
                 }
@@ -169,9 +219,12 @@ public:
                     connect_to_broker ();
                 }
                 else {
-                    s_console ("E: invalid input message (%d)",
-                          (int) *(command.c_str()));
-                    msg->dump ();
+                    if (m_verbose)
+                        ZLOG_BLOCK (msg->describe (), "E: invalid input message (%d)",
+                                (int) *(command.c_str()));
+                    else
+                        ZLOG_LIMITED ("E: invalid input message (%d)",
+                                (int) *(command.c_str()));
                 }
                 delete msg;
             }
@@ -184,7 +237,7 @@ public:
                 connect_to_broker ();
             }
             //  Send HEARTBEAT if it's time
-            if (s_clock () >= m_heartbeat_at) {
+            if (s_loop_ms () >= m_heartbeat_at) {
                 send_to_broker ((char*)MDPW_HEARTBEAT, "", NULL);
                 m_heartbeat_at += m_heartbeat;
             }
@@ -194,7 +247,162 @@ public:
         return NULL;
     }
 
+    //  ---------------------------------------------------------------------
+    //  Send one chunk of a streamed reply to the broker. Blocks while the
+    //  client has granted us no credit. The final chunk goes back via
+    //  recv() as usual, which ends the stream. Takes ownership of chunk.
+    //  Returns false if the request was cancelled, we lost the broker or
+    //  were interrupted, and the rest of the stream should be abandoned.
+
+    bool
+    send_partial (zmsg *&chunk_p)
+    {
+        assert (chunk_p);
+        assert (m_streaming);
+        bool rc = wait_for_credit ();
+        if (rc) {
+            chunk_p->wrap (m_reply_to.c_str(), "");
+            send_to_broker ((char*)MDPW_PARTIAL, "", chunk_p);
+            m_credit--;
+        }
+        delete chunk_p;
+        chunk_p = 0;
+        return rc;
+    }
+
+    //  ---------------------------------------------------------------------
+    //  True if the current request is a streamed one
+
+    bool
+    streaming ()
+    {
+        return m_streaming;
+    }
+
+    //  ---------------------------------------------------------------------
+    //  True if the client cancelled the current request. Long-running
+    //  handlers should check this now and then, and give up early by
+    //  calling recv() without a reply. Does not block.
+
+    bool
+    cancelled ()
+    {
+        while (!m_cancelled && poll_broker (0))
+            ;
+        return m_cancelled;
+    }
+
+    //  ---------------------------------------------------------------------
+    //  Time our caller spent handling requests, from receiving each one
+    //  to handing back its reply, in nsecs
+
+    const zhistogram &
+    handler_time ()
+    {
+        return m_handler_time;
+    }
+
 private:
+
+    //  ---------------------------------------------------------------------
+    //  Pop and save the client envelope of a request, and its trace frame
+    //  if it has one, which sits between the address and the delimiter
+
+    void
+    unwrap_request (zmsg *msg)
+    {
+        m_reply_to = (char*) msg->pop_front ().c_str();
+        if (msg->address () && *msg->address () != 0) {
+            m_trace = (char*) msg->pop_front ().c_str();
+            mdp_trace_hop (m_trace, MDP_HOP_WORKER_IN);
+        }
+        msg->pop_front ();          //  Empty delimiter
+    }
+
+    //  ---------------------------------------------------------------------
+    //  Wait until the client grants us stream credit, keeping up the
+    //  heartbeat with the broker meanwhile.
+
+    bool
+    wait_for_credit ()
+    {
+        while (m_credit == 0 && m_streaming && !m_cancelled && !s_interrupted)
+            poll_broker (m_heartbeat);
+
+        return m_credit > 0 && m_streaming && !m_cancelled && !s_interrupted;
+    }
+
+    //  ---------------------------------------------------------------------
+    //  Handle broker traffic while a request is in progress: credit and
+    //  cancellation for the current request, and heartbeating. Waits up
+    //  to timeout msecs, returns true if a message arrived.
+
+    bool
+    poll_broker (int timeout)
+    {
+        zmq::pollitem_t items[] = {
+            { static_cast<void*>(*m_worker),  0, ZMQ_POLLIN, 0 } };
+        zmq::poll (items, 1, timeout);
+        s_loop_refresh ();
+
+        bool received = (items[0].revents & ZMQ_POLLIN) != 0;
+        if (received) {
+            zmsg *msg = new zmsg(*m_worker);
+            if (m_verbose) {
+                ZLOG_BLOCK (msg->describe (), "I: received message from broker:");
+            }
+            m_liveness = HEARTBEAT_LIVENESS;
+            assert (msg->parts () >= 3);
+            msg->pop_front ();          //  Empty delimiter
+            msg->pop_front ();          //  Protocol header
+
+            std::string command = (char*) msg->pop_front ().c_str();
+            if (command.compare (MDPW_CREDIT) == 0) {
+                m_credit += atoi ((char*) msg->pop_front ().c_str());
+            }
+            else if (command.compare (MDPW_CANCEL) == 0) {
+                m_cancelled = true;
+            }
+            else if (command.compare (MDPW_DISCONNECT) == 0) {
+                abandon_request ();
+            }
+            else if (command.compare (MDPW_HEARTBEAT) != 0) {
+                if (m_verbose)
+                    ZLOG_BLOCK (msg->describe (), "E: invalid input message (%d)",
+                            (int) *(command.c_str()));
+                else
+                    ZLOG_LIMITED ("E: invalid input message (%d)",
+                            (int) *(command.c_str()));
+            }
+            delete msg;
+        }
+        else
+        if (timeout > 0 && --m_liveness == 0) {
+            if (m_verbose) {
+                s_console ("W: disconnected from broker - retrying...");
+            }
+            s_sleep (m_reconnect);
+            abandon_request ();
+        }
+        if (s_loop_ms () >= m_heartbeat_at) {
+            send_to_broker ((char*)MDPW_HEARTBEAT, "", NULL);
+            m_heartbeat_at += m_heartbeat;
+        }
+        return received;
+    }
+
+    //  ---------------------------------------------------------------------
+    //  Reconnect in the middle of a request; the new broker session knows
+    //  nothing about it, so treat it as cancelled
+
+    void
+    abandon_request ()
+    {
+        connect_to_broker ();
+        m_cancelled = true;
+        m_reply_to = "";
+    }
+
     std::string m_broker;
     std::string m_service;
     zmq::context_t *m_context;
@@ -209,9 +417,15 @@ private:
 
     //  Internal state
     bool m_expect_reply;           //  Zero only at start
+    bool m_streaming;              //  Current request wants a stream
+    bool m_cancelled;              //  Current request was cancelled
+    int m_credit;                  //  Chunks we may send before waiting
+    int64_t m_received_ns;         //  When we got the current request
+    zhistogram m_handler_time;     //  Request to reply, nsecs
 
     //  Return address, if any
     std::string m_reply_to;
+    std::string m_trace;           //  Trace frame, if request is traced
 };
 
 #endif
@@ -0,0 +1,49 @@
+//
+//  MMI statistics query example
+//  Prints per-service, or with -w per-worker, statistics from the broker.
+//  With -h prints the raw latency histograms instead, and with -r the
+//  broker's flight recorder of recent messages. With -p prints the
+//  broker loop profile, if the broker was built with -DZPROFILE.
+//
+//  Lets us 'build mmistats' and 'build all'
+//
+#include "mdcliapi.hpp"
+
+int main (int argc, char *argv [])
+{
+    int argn = 1;
+    int verbose = (argn < argc && strcmp (argv [argn], "-v") == 0);
+    if (verbose)
+        argn++;
+    int workers = (argn < argc && strcmp (argv [argn], "-w") == 0);
+    if (workers)
+        argn++;
+    int histogram = (argn < argc && strcmp (argv [argn], "-h") == 0);
+    if (histogram)
+        argn++;
+    int recorder = (argn < argc && strcmp (argv [argn], "-r") == 0);
+    if (recorder)
+        argn++;
+    int profile = (argn < argc && strcmp (argv [argn], "-p") == 0);
+    if (profile)
+        argn++;
+    mdcli session ("tcp://localhost:5555", verbose);
+
+    //  Empty body asks for all services
+    zmsg *request = new zmsg (argn < argc ? argv [argn] : "");
+    zmsg *reply = session.send (workers? "mmi.stats.workers":
+                                histogram? "mmi.stats.histogram":
+                                recorder? "mmi.recorder":
+                                profile? "mmi.profile": "mmi.stats", request);
+    if (reply) {
+        std::string code = (char *) reply->pop_front ().c_str();
+        if (code.compare ("200") != 0)
+            std::cout << "E: broker said " << code << std::endl;
+        while (reply->parts ())
+            std::cout << (char *) reply->pop_front ().c_str() << std::endl;
+        delete reply;
+    }
+    else
+        std::cout << "E: no response from broker, make sure it's running" << std::endl;
+    return 0;
+}
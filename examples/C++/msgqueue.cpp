@@ -6,6 +6,7 @@
 
 
 #include "zhelpers.hpp"
+#include "zmetrics.hpp"
 
 int main (int argc, char *argv[])
 {
@@ -19,9 +20,14 @@ int main (int argc, char *argv[])
     zmq::socket_t backend (context, ZMQ_DEALER);
     backend.bind("tcp://*:5560");
 
+    //  Count traffic from the proxy's capture socket, and serve metrics
+    zmetrics metrics;
+    zcapture capture (context, metrics);
+    metrics.serve ("tcp://*:9559");
+
     //  Start the proxy
     zmq::proxy(static_cast<void*>(frontend),
                static_cast<void*>(backend),
-               nullptr);
+               capture.socket ());
     return 0;
 }
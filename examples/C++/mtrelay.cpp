@@ -2,6 +2,9 @@
 //  Multithreaded relay in C++
 //
 // Olivier Chamoux <olivier.chamoux@fr.thalesgroup.com>
+//
+//  ringrelay does the same over lock-free rings, for pipelines where
+//  inproc sockets cost too much
 
 
 #include "zhelpers.hpp"
@@ -2,35 +2,26 @@
     Multithreaded Hello World server in C
 */
 
-#include <pthread.h>
 #include <unistd.h>
 #include <cassert>
 #include <string>
 #include <iostream>
 #include <zmq.hpp>
+#include "zmetrics.hpp"
+#include "zaffinity.hpp"
+#include "zpool.hpp"
 
-void *worker_routine (void *arg)
+//  Runs on a worker thread, one request at a time per thread
+static void
+worker_routine (zmsg &request, zpool_worker &worker)
 {
-    zmq::context_t *context = (zmq::context_t *) arg;
-
-    zmq::socket_t socket (*context, ZMQ_REP);
-    socket.connect ("inproc://workers");
-
-    while (true) {
-        //  Wait for next request from client
-        zmq::message_t request;
-        socket.recv (&request);
-        std::cout << "Received request: [" << (char*) request.data() << "]" << std::endl;
-
-        //  Do some 'work'
-        sleep (1);
-
-        //  Send reply back to client
-        zmq::message_t reply (6);
-        memcpy ((void *) reply.data (), "World", 6);
-        socket.send (reply);
-    }
-    return (NULL);
+    std::cout << "Received request: [" << request.body () << "]" << std::endl;
+
+    //  Do some 'work'
+    sleep (1);
+
+    //  Send reply back to client
+    worker.reply ("World");
 }
 
 
@@ -38,20 +29,24 @@ int main ()
 {
     //  Prepare our context and sockets
     zmq::context_t context (1);
+    zaffinity::global ().configure (context);
     zmq::socket_t clients (context, ZMQ_ROUTER);
     clients.bind ("tcp://*:5555");
-    zmq::socket_t workers (context, ZMQ_DEALER);
-    workers.bind ("inproc://workers");
-
-    //  Launch pool of worker threads
-    for (int thread_nbr = 0; thread_nbr != 5; thread_nbr++) {
-        pthread_t worker;
-        pthread_create (&worker, NULL, worker_routine, (void *) &context);
-    }
-    //  Connect work threads to client threads via a queue
-    zmq::proxy (static_cast<void*>(clients),
-                static_cast<void*>(workers),
-                nullptr);
+
+    //  Launch pool of worker threads, which grows while requests wait
+    //  and shrinks when they are idle
+    zpool pool (context, worker_routine, 2, 16);
+
+    //  Serve the pool's metrics, on a port of our own so we can run
+    //  beside mdbroker (9555) and ppqueue (9557)
+    zmetrics metrics;
+    pool.add_metrics (metrics, "");
+    metrics.serve ("tcp://*:9556");
+
+    //  Deal requests out to worker threads until Ctrl-C, then finish
+    //  the ones we have
+    s_catch_signals ();
+    pool.run (clients);
+    std::cout << "I: " << pool.report () << std::endl;
     return 0;
 }
-    
@@ -4,6 +4,10 @@
 //     Andreas Hoelzlwimmer <andreas.hoelzlwimmer@fh-hagenberg.at>
 //
 #include "zmsg.hpp"
+#include "zmetrics.hpp"
+#include "zmonitor.hpp"
+#include "zlog.hpp"
+#include "zloop.hpp"
 
 #include <stdint.h>
 #include <vector>
@@ -34,7 +38,7 @@ s_worker_append (std::vector<worker_t> &queue, std::string &identity)
     if (!found) {
         worker_t worker;
         worker.identity = identity;
-        worker.expiry = s_clock() + HEARTBEAT_INTERVAL * HEARTBEAT_LIVENESS;
+        worker.expiry = s_loop_ms () + HEARTBEAT_INTERVAL * HEARTBEAT_LIVENESS;
         queue.push_back(worker);
     }
 }
@@ -58,7 +62,7 @@ s_worker_refresh (std::vector<worker_t> &queue, std::string &identity)
     bool found = false;
     for (std::vector<worker_t>::iterator it = queue.begin(); it < queue.end(); it++) {
         if (it->identity.compare(identity) == 0) {
-           it->expiry = s_clock ()
+           it->expiry = s_loop_ms ()
                  + HEARTBEAT_INTERVAL * HEARTBEAT_LIVENESS;
            found = true;
            break;
@@ -83,7 +87,7 @@ s_worker_dequeue (std::vector<worker_t> &queue)
 static void
 s_queue_purge (std::vector<worker_t> &queue)
 {
-    int64_t clock = s_clock();
+    int64_t clock = s_loop_ms ();
     for (std::vector<worker_t>::iterator it = queue.begin(); it < queue.end(); it++) {
         if (clock > it->expiry) {
            it = queue.erase(it)-1;
@@ -91,81 +95,133 @@ s_queue_purge (std::vector<worker_t> &queue)
     }
 }
 
-int main (void)
+//  Syntax: ppqueue [-s spin usecs] [-c cpu]
+
+int main (int argc, char *argv [])
 {
     s_version_assert (4, 0);
 
+    //  Optionally busy-poll, and pin ourselves to a CPU, for latency
+    zspin spin;
+    int cpu = -1;
+    //  Metrics port is our own, so we can run beside mdbroker's 9555
+    const char *metrics_endpoint = "tcp://*:9557";
+    for (int argn = 1; argn < argc; argn++) {
+        if (argn + 1 < argc && strcmp (argv [argn], "-s") == 0)
+            spin.set_budget (atoi (argv [++argn]));
+        else
+        if (argn + 1 < argc && strcmp (argv [argn], "-c") == 0)
+            cpu = atoi (argv [++argn]);
+        else
+        if (argn + 1 < argc && strcmp (argv [argn], "-m") == 0)
+            metrics_endpoint = argv [++argn];
+        else {
+            printf ("syntax: ppqueue [-s spin usecs] [-c cpu] [-m metrics endpoint]\n");
+            return 0;
+        }
+    }
+
     //  Prepare our context and sockets
     zmq::context_t context(1);
     zmq::socket_t frontend(context, ZMQ_ROUTER);
     zmq::socket_t backend (context, ZMQ_ROUTER);
+
+    //  Metrics, served from a side thread, including connections from
+    //  clients and workers; start monitoring before we bind
+    zmetrics metrics;
+    zmonitor frontend_monitor (context, frontend, "frontend", metrics);
+    zmonitor backend_monitor (context, backend, "backend", metrics);
+
     frontend.bind("tcp://*:5555");    //  For clients
     backend.bind ("tcp://*:5556");    //  For workers
 
     //  Queue of available workers
     std::vector<worker_t> queue;
 
-    //  Send out heartbeats at regular intervals
-    int64_t heartbeat_at = s_clock () + HEARTBEAT_INTERVAL;
-
-    while (1) {
-        zmq::pollitem_t items [] = {
-            { static_cast<void*>(backend), 0, ZMQ_POLLIN, 0 },
-            { static_cast<void*>(frontend), 0, ZMQ_POLLIN, 0 }
-        };
-        //  Poll frontend only if we have available workers
-        if (queue.size()) {
-            zmq::poll (items, 2, HEARTBEAT_INTERVAL);
-        } else {
-            zmq::poll (items, 1, HEARTBEAT_INTERVAL);
-        }
-
+    zcounter requests, replies, heartbeats, expired;
+    zgauge workers;
+    metrics.add ("ppq_requests_total", "Requests routed to workers", "", &requests);
+    metrics.add ("ppq_replies_total", "Replies routed to clients", "", &replies);
+    metrics.add ("ppq_heartbeats_total", "Heartbeats from workers", "", &heartbeats);
+    metrics.add ("ppq_workers_expired_total", "Workers that stopped heartbeating",
+                 "", &expired);
+    metrics.add ("ppq_workers_ready", "Workers waiting for a request", "", &workers);
+    spin.add_metrics (metrics, "");
+    metrics.serve (metrics_endpoint);
+
+    //  Poll frontend only if we have available workers
+    zloop loop;
+    loop.set_spin (&spin);
+    loop.reader (backend, [&] () {
         //  Handle worker activity on backend
-        if (items [0].revents & ZMQ_POLLIN) {
-            zmsg msg (backend);
-            std::string identity(msg.unwrap ());
-
-            //  Return reply to client if it's not a control message
-            if (msg.parts () == 1) {
-                if (strcmp (msg.address (), "READY") == 0) {
-                    s_worker_delete (queue, identity);
-                    s_worker_append (queue, identity);
-                }
-                else {
-                   if (strcmp (msg.address (), "HEARTBEAT") == 0) {
-                       s_worker_refresh (queue, identity);
-                   } else {
-                       std::cout << "E: invalid message from " << identity << std::endl;
-                       msg.dump ();
-                   }
-                }
+        zmsg msg (backend);
+        std::string identity(msg.unwrap ());
+
+        //  Return reply to client if it's not a control message
+        if (msg.parts () == 1) {
+            if (strcmp (msg.address (), "READY") == 0) {
+                s_worker_delete (queue, identity);
+                s_worker_append (queue, identity);
             }
             else {
-                msg.send (frontend);
-                s_worker_append (queue, identity);
+               if (strcmp (msg.address (), "HEARTBEAT") == 0) {
+                   s_worker_refresh (queue, identity);
+                   heartbeats++;
+               } else {
+                   ZLOG_LIMITED ("E: invalid message from %s", identity.c_str());
+               }
             }
         }
-        if (items [1].revents & ZMQ_POLLIN) {
-            //  Now get next client request, route to next worker
-            zmsg msg (frontend);
-            std::string identity = std::string(s_worker_dequeue (queue));
-            msg.push_front((char*)identity.c_str());
-            msg.send (backend);
+        else {
+            msg.send (frontend);
+            s_worker_append (queue, identity);
+            replies++;
+            ZPROBE1 (ppq_reply, queue.size());
         }
-
-        //  Send heartbeats to idle workers if it's time
-        if (s_clock () > heartbeat_at) {
-            for (std::vector<worker_t>::iterator it = queue.begin(); it < queue.end(); it++) {
-                zmsg msg ("HEARTBEAT");
-                msg.wrap (it->identity.c_str(), NULL);
-                msg.send (backend);
-            }
-            heartbeat_at = s_clock () + HEARTBEAT_INTERVAL;
+        workers.set (queue.size());
+        loop.reader_enable (frontend, queue.size() > 0);
+        return 0;
+    });
+    loop.reader (frontend, [&] () {
+        //  Now get next client request, route to next worker
+        zmsg msg (frontend);
+        std::string identity = std::string(s_worker_dequeue (queue));
+        msg.push_front((char*)identity.c_str());
+        msg.send (backend);
+        requests++;
+        ZPROBE1 (ppq_request, queue.size());
+        workers.set (queue.size());
+        loop.reader_enable (frontend, queue.size() > 0);
+        return 0;
+    });
+    loop.reader_enable (frontend, false);
+
+    //  Send heartbeats to idle workers, and purge expired ones, at a
+    //  steady rate; expiry is good to a heartbeat interval
+    loop.timer (HEARTBEAT_INTERVAL, 0, [&] () {
+        for (std::vector<worker_t>::iterator it = queue.begin(); it < queue.end(); it++) {
+            zmsg msg ("HEARTBEAT");
+            msg.wrap (it->identity.c_str(), NULL);
+            msg.send (backend);
         }
+        size_t ready = queue.size();
         s_queue_purge(queue);
-    }
+        expired.inc (ready - queue.size());
+        if (ready > queue.size()) {
+            ZPROBE2 (ppq_purge, ready - queue.size(), queue.size());
+        }
+        workers.set (queue.size());
+        loop.reader_enable (frontend, queue.size() > 0);
+        return 0;
+    });
+    //  Pin only now, so that threads we started don't inherit it
+    if (cpu >= 0 && zspin::pin (cpu) == -1)
+        std::cout << "W: can't pin queue to CPU " << cpu << std::endl;
+    loop.start ();
+
     //  We never exit the main loop
     //  But pretend to do the right shutdown anyhow
     queue.clear();
+    metrics.stop ();
     return 0;
 }
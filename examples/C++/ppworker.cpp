@@ -50,7 +50,7 @@ int main (void)
     size_t interval = INTERVAL_INIT;
 
     //  Send out heartbeats at regular intervals
-    int64_t heartbeat_at = s_clock () + HEARTBEAT_INTERVAL;
+    int64_t heartbeat_at = s_clock_ms () + HEARTBEAT_INTERVAL;
 
     int cycles = 0;
     while (1) {
@@ -110,8 +110,8 @@ int main (void)
         }
 
         //  Send heartbeat to queue if it's time
-        if (s_clock () > heartbeat_at) {
-            heartbeat_at = s_clock () + HEARTBEAT_INTERVAL;
+        if (s_clock_ms () > heartbeat_at) {
+            heartbeat_at = s_clock_ms () + HEARTBEAT_INTERVAL;
             std::cout << "I: (" << identity << ") worker heartbeat" << std::endl;
             s_send (*worker, "HEARTBEAT");
         }
@@ -0,0 +1,219 @@
+//
+//  Multithreaded relay over ring channels
+//
+//  Like mtrelay, steps in one process pass work down a pipeline, but over
+//  zring channels rather than inproc sockets. Sources take messages from
+//  pools of their own and pass pointers to the relay over one ring that
+//  all of them write to; the relay passes them on to the sink, and the
+//  sink gives each message back to its source on a ring going the other
+//  way. Nothing is allocated or copied per message.
+//
+//  The relay waits on its ring and on a control socket in one zmq::poll,
+//  as it would on two sockets. Compare the rate and latency with
+//  tripbench -p oneway -t inproc.
+//
+//  Syntax: ringrelay [-p sources] [-n messages] [-b batch]
+//  Messages are per source; batch is how many a step moves at a time.
+//
+#include "zhelpers.hpp"
+#include "zhistogram.hpp"
+#include "zaffinity.hpp"
+#include "zring.hpp"
+
+#include <thread>
+#include <vector>
+
+#define POOL_SIZE       1024        //  Messages per source
+#define RING_SIZE       4096        //  Pointers per ring
+
+typedef struct {
+    int source;
+    int64_t sent;                   //  s_clock_ns() when sent
+    char body [48];
+} item_t;
+
+typedef struct {
+    int index;
+    int messages;
+    int batch;
+    zring_mpsc<item_t *> *output;   //  To the relay
+    zring_spsc<item_t *> *returns;  //  From the sink
+} source_t;
+
+//  Wait until a ring has input
+static void
+s_wait_for (int fd)
+{
+    zmq::pollitem_t items [] = { { 0, fd, ZMQ_POLLIN, 0 } };
+    try {
+        zmq::poll (items, 1, -1);
+    }
+    catch (zmq::error_t &e) {}
+}
+
+//  ---------------------------------------------------------------------
+//  Source: send messages from our pool, reusing each when it comes back
+
+static void
+source_task (source_t *source)
+{
+    zaffinity::global ().pin_next ();
+    item_t *pool = (item_t *) zaffinity::alloc (POOL_SIZE * sizeof (item_t));
+    std::vector<item_t *> free_items;
+    for (int index = 0; index < POOL_SIZE; index++)
+        free_items.push_back (&pool [index]);
+
+    std::vector<item_t *> batch (source->batch);
+    int sent = 0;
+    while (sent < source->messages) {
+        //  Take back what the sink is done with, or wait for it
+        size_t back = source->returns->recv_batch (&batch [0], batch.size ());
+        free_items.insert (free_items.end (), batch.begin (), batch.begin () + back);
+        if (free_items.empty ()) {
+            s_wait_for (source->returns->fd ());
+            continue;
+        }
+        size_t count = std::min (free_items.size (), batch.size ());
+        count = std::min (count, (size_t) (source->messages - sent));
+        int64_t now = s_clock_ns ();
+        for (size_t index = 0; index < count; index++) {
+            item_t *item = free_items [free_items.size () - 1 - index];
+            item->source = source->index;
+            item->sent = now;
+            snprintf (item->body, sizeof (item->body), "%d-%d", source->index, sent + (int) index);
+            batch [index] = item;
+        }
+        size_t accepted = source->output->send_batch (&batch [0], count);
+        free_items.resize (free_items.size () - accepted);
+        sent += (int) accepted;
+        if (accepted < count)
+            std::this_thread::yield ();     //  Relay is behind
+    }
+    //  The sink still reads our messages until it gives them back
+    while (free_items.size () < POOL_SIZE) {
+        size_t back = source->returns->recv_batch (&batch [0], batch.size ());
+        free_items.insert (free_items.end (), batch.begin (), batch.begin () + back);
+        if (back == 0)
+            s_wait_for (source->returns->fd ());
+    }
+    zaffinity::release (pool, POOL_SIZE * sizeof (item_t));
+}
+
+//  ---------------------------------------------------------------------
+//  Relay: pass messages on until told to stop
+
+static void
+relay_task (zmq::context_t *context, zring_mpsc<item_t *> *input,
+            zring_spsc<item_t *> *output, int batch_size)
+{
+    zaffinity::global ().pin_next ();
+    zmq::socket_t control (*context, ZMQ_PAIR);
+    control.connect ("inproc://control");
+
+    std::vector<item_t *> batch (batch_size);
+    zmq::pollitem_t items [] = {
+        { static_cast<void*>(control), 0, ZMQ_POLLIN, 0 },
+        { 0, input->fd (), ZMQ_POLLIN, 0 } };
+    while (true) {
+        //  Drain the ring before we poll, so we never sleep on input
+        size_t count;
+        while ((count = input->recv_batch (&batch [0], batch.size ())) > 0) {
+            size_t passed = 0;
+            while (passed < count) {
+                passed += output->send_batch (&batch [passed], count - passed);
+                if (passed < count)
+                    std::this_thread::yield ();
+            }
+        }
+        try {
+            zmq::poll (items, 2, -1);
+        }
+        catch (zmq::error_t &e) {}
+        if (items [0].revents & ZMQ_POLLIN) {
+            s_recv (control);
+            break;
+        }
+    }
+}
+
+int main (int argc, char *argv [])
+{
+    int sources = 2;
+    int messages = 1000000;
+    int batch_size = 32;
+    for (int argn = 1; argn < argc; argn++) {
+        if (argn + 1 < argc && strcmp (argv [argn], "-p") == 0)
+            sources = atoi (argv [++argn]);
+        else
+        if (argn + 1 < argc && strcmp (argv [argn], "-n") == 0)
+            messages = atoi (argv [++argn]);
+        else
+        if (argn + 1 < argc && strcmp (argv [argn], "-b") == 0)
+            batch_size = atoi (argv [++argn]);
+        else {
+            printf ("syntax: ringrelay [-p sources] [-n messages] [-b batch]\n");
+            return 0;
+        }
+    }
+    if (sources < 1 || messages < 1 || batch_size < 1) {
+        std::cout << "E: sources, messages and batch must be positive" << std::endl;
+        return 1;
+    }
+    zmq::context_t context (1);
+    zmq::socket_t control (context, ZMQ_PAIR);
+    control.bind ("inproc://control");
+
+    zring_mpsc<item_t *> relay_input (RING_SIZE);
+    zring_spsc<item_t *> sink_input (RING_SIZE);
+    std::vector<zring_spsc<item_t *> *> returns;
+    std::vector<source_t> settings (sources);
+    for (int index = 0; index < sources; index++) {
+        returns.push_back (new zring_spsc<item_t *> (POOL_SIZE));
+        settings [index].index = index;
+        settings [index].messages = messages;
+        settings [index].batch = batch_size;
+        settings [index].output = &relay_input;
+        settings [index].returns = returns [index];
+    }
+    int64_t started = s_clock_ns ();
+    std::thread relay (relay_task, &context, &relay_input, &sink_input, batch_size);
+    std::vector<std::thread *> threads;
+    for (int index = 0; index < sources; index++)
+        threads.push_back (new std::thread (source_task, &settings [index]));
+
+    //  We're the sink: measure each message and give it back
+    zaffinity::global ().pin_next ();
+    zhistogram latency;
+    std::vector<item_t *> batch (batch_size);
+    int64_t expected = (int64_t) messages * sources;
+    int64_t received = 0;
+    while (received < expected) {
+        size_t count = sink_input.recv_batch (&batch [0], batch.size ());
+        if (count == 0) {
+            s_wait_for (sink_input.fd ());
+            continue;
+        }
+        int64_t now = s_clock_ns ();
+        for (size_t index = 0; index < count; index++) {
+            item_t *item = batch [index];
+            latency.record (now - item->sent);
+            //  Pool rings hold the whole pool, so this can't fail
+            returns [item->source]->send (item);
+        }
+        received += count;
+    }
+    double seconds = (s_clock_ns () - started) / 1e9;
+    s_send (control, "STOP");
+    relay.join ();
+    for (int index = 0; index < sources; index++) {
+        threads [index]->join ();
+        delete threads [index];
+        delete returns [index];
+    }
+    std::cout << "I: " << received << " messages in " << seconds << "s, "
+              << (int64_t) (received / seconds) << " msg/s" << std::endl;
+    std::cout << "I: latency p50=" << latency.percentile (50) / 1000.0 << "us"
+              << " p99=" << latency.percentile (99) / 1000.0 << "us"
+              << " max=" << latency.max () / 1000.0 << "us" << std::endl;
+    return 0;
+}
@@ -62,7 +62,7 @@ int main() {
 
 
     //  Run for five seconds and then tell workers to end
-    int64_t end_time = s_clock() + 5000;
+    int64_t end_time = s_clock_ms () + 5000;
     int workers_fired = 0;
     while (1) {
         //  Next message gives us least recently used worker
@@ -76,7 +76,7 @@ int main() {
         s_sendmore(broker, "");
 
         //  Encourage workers until it's time to fire them
-        if (s_clock() < end_time)
+        if (s_clock_ms () < end_time)
             s_send(broker, "Work harder");
         else {
             s_send(broker, "Fired!");
@@ -30,7 +30,7 @@ subscriber (void *args) {
         assert ((ss >> clock));
 
         // Suicide snail logic
-        if (s_clock () - clock > MAX_ALLOWED_DELAY) {
+        if (s_clock_ms () - clock > MAX_ALLOWED_DELAY) {
             std::cerr << "E: subscriber cannot keep up, aborting" << std::endl;
             break;
         }
@@ -58,7 +58,7 @@ publisher (void *args) {
     while (1) {
         // Send current clock (msecs) to subscribers
         ss.str("");
-        ss << s_clock();
+        ss << s_clock_ms ();
         s_send (publisher, ss.str());
 
         s_sleep(1);
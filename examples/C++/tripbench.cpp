@@ -0,0 +1,566 @@
+//
+//  Messaging benchmark, grown out of tripping.cpp
+//
+//  Runs round-trip and one-way tests over a sweep of transports, message
+//  sizes, pipeline depths and thread counts, and reports throughput and
+//  latency percentiles from a nanosecond clock. Each test gets a fresh
+//  context, with every side on its own thread.
+//
+//      sync        N clients, each waits for its echo before sending again
+//      pipeline    N clients, each keeps up to depth requests in flight
+//      oneway      N PUSH senders into one PULL receiver
+//      fanout      one XPUB publisher to N subscribers
+//
+//  Placement comes from the environment, as zaffinity.hpp describes; each
+//  measuring thread keeps its histogram in memory on its own node.
+//
+//  One-way latency comes from a send time stamped into the first 8 bytes
+//  of each message, so it needs messages of at least 8 bytes. Fanout may
+//  drop messages at the high-water mark, as PUB sockets do; the results
+//  say how many.
+//
+//  Syntax: tripbench [-p patterns] [-t transports] [-s sizes] [-d depths]
+//                    [-n threads] [-c count] [-j file.json] [-o file.csv]
+//  Lists are comma-separated; count is messages per thread.
+//
+#include "zhelpers.hpp"
+#include "zhistogram.hpp"
+#include "zaffinity.hpp"
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <fstream>
+
+//  One test in the sweep
+typedef struct {
+    std::string pattern;
+    std::string transport;
+    size_t size;                //  Bytes per message
+    int depth;                  //  Requests in flight, for pipeline
+    int threads;                //  Clients, senders or subscribers
+    int count;                  //  Messages per thread
+} run_t;
+
+//  What one thread measured
+typedef struct {
+    zhistogram latency;         //  nsecs, round-trip or one-way
+    uint64_t messages;
+    int64_t started;            //  s_clock_ns()
+    int64_t finished;
+} slot_t;
+
+//  What a test measured, over all threads
+typedef struct {
+    run_t run;
+    uint64_t messages;
+    uint64_t lost;              //  Dropped by fanout
+    double seconds;
+    uint64_t p50, p90, p99, p999, max;
+} result_t;
+
+//  A thread measures into a slot of its own, on its own node, and hands
+//  the results back to the shared slot when it's done
+static void
+s_slot_return (slot_t *shared, slot_t *slot)
+{
+    shared->latency.merge (slot->latency);
+    shared->messages = slot->messages;
+    shared->started = slot->started;
+    shared->finished = slot->finished;
+    zaffinity::destroy_local (slot);
+}
+
+static std::string
+s_endpoint (std::string transport)
+{
+    if (transport == "inproc")
+        return "inproc://tripbench";
+    if (transport == "ipc")
+        return "ipc://tripbench.ipc";
+    return "tcp://127.0.0.1:5555";
+}
+
+//  Stamp the send time into a message, if there is room
+static void
+s_stamp (zmq::message_t &message)
+{
+    if (message.size () >= sizeof (int64_t)) {
+        int64_t now = s_clock_ns ();
+        memcpy (message.data (), &now, sizeof (now));
+    }
+}
+
+//  Record how long ago a message was stamped
+static void
+s_record_stamp (zmq::message_t &message, slot_t *slot, int64_t now)
+{
+    if (message.size () >= sizeof (int64_t)) {
+        int64_t stamped;
+        memcpy (&stamped, message.data (), sizeof (stamped));
+        slot->latency.record (now - stamped);
+    }
+}
+
+//  ---------------------------------------------------------------------
+//  Round trips: clients send to an echo server, which sends each
+//  message straight back
+
+static void
+echo_task (zmq::socket_t *server, std::atomic<bool> *stop)
+{
+    while (!stop->load ()) {
+        zmq::pollitem_t items [] = {
+            { static_cast<void*>(*server), 0, ZMQ_POLLIN, 0 } };
+        zmq::poll (items, 1, 100);
+        if (items [0].revents & ZMQ_POLLIN) {
+            zmq::message_t identity;
+            zmq::message_t body;
+            server->recv (&identity);
+            server->recv (&body);
+            server->send (identity, ZMQ_SNDMORE);
+            server->send (body);
+        }
+    }
+}
+
+static void
+client_task (zmq::context_t *context, std::string endpoint, run_t run, slot_t *shared)
+{
+    zaffinity::global ().pin_next ();
+    slot_t *slot = zaffinity::make_local<slot_t> ();
+    zmq::socket_t client (*context, ZMQ_DEALER);
+    int linger = 0;
+    client.setsockopt (ZMQ_LINGER, &linger, sizeof (linger));
+    client.connect (endpoint.c_str ());
+
+    //  Warm up, which also waits for the connection
+    int warmup = run.count / 10 < 1000? run.count / 10 + 1: 1000;
+    for (int request = 0; request < warmup; request++) {
+        zmq::message_t message (run.size);
+        client.send (message);
+        client.recv (&message);
+    }
+    slot->started = s_clock_ns ();
+    if (run.pattern == "sync") {
+        for (int request = 0; request < run.count; request++) {
+            zmq::message_t message (run.size);
+            int64_t sent = s_clock_ns ();
+            client.send (message);
+            client.recv (&message);
+            slot->latency.record (s_clock_ns () - sent);
+        }
+    }
+    else {
+        //  Replies come back in order, so we only need the send times
+        std::deque<int64_t> in_flight;
+        int sent = 0;
+        int received = 0;
+        while (received < run.count) {
+            while (sent < run.count && (int) in_flight.size () < run.depth) {
+                zmq::message_t message (run.size);
+                in_flight.push_back (s_clock_ns ());
+                client.send (message);
+                sent++;
+            }
+            zmq::message_t message;
+            client.recv (&message);
+            slot->latency.record (s_clock_ns () - in_flight.front ());
+            in_flight.pop_front ();
+            received++;
+        }
+    }
+    slot->finished = s_clock_ns ();
+    slot->messages = run.count;
+    s_slot_return (shared, slot);
+}
+
+static void
+s_round_trip (zmq::context_t &context, zmq::socket_t &bound, run_t run,
+              std::vector<slot_t *> &slots)
+{
+    std::string endpoint = s_endpoint (run.transport);
+    std::atomic<bool> stop (false);
+    std::thread echo (echo_task, &bound, &stop);
+    std::vector<std::thread *> clients;
+    for (int client = 0; client < run.threads; client++)
+        clients.push_back (new std::thread (client_task, &context, endpoint,
+                                            run, slots [client]));
+    for (size_t client = 0; client < clients.size (); client++) {
+        clients [client]->join ();
+        delete clients [client];
+    }
+    stop.store (true);
+    echo.join ();
+}
+
+//  ---------------------------------------------------------------------
+//  One way: senders say hello with an empty message, then wait for the
+//  receiver to see all of them before they start
+
+static void
+sender_task (zmq::context_t *context, std::string endpoint, run_t run,
+             std::atomic<bool> *go)
+{
+    zaffinity::global ().pin_next ();
+    zmq::socket_t sender (*context, ZMQ_PUSH);
+    int linger = 0;
+    sender.setsockopt (ZMQ_LINGER, &linger, sizeof (linger));
+    sender.connect (endpoint.c_str ());
+    zmq::message_t hello;
+    sender.send (hello);
+    while (!go->load ())
+        std::this_thread::yield ();
+    for (int count = 0; count < run.count; count++) {
+        zmq::message_t message (run.size);
+        s_stamp (message);
+        sender.send (message);
+    }
+    //  PUSH has no reply to wait for, so stay until the receiver is done
+    while (go->load ())
+        std::this_thread::yield ();
+}
+
+static void
+s_oneway (zmq::context_t &context, zmq::socket_t &receiver, run_t run,
+          std::vector<slot_t *> &slots)
+{
+    std::string endpoint = s_endpoint (run.transport);
+    std::atomic<bool> go (false);
+    std::vector<std::thread *> senders;
+    for (int sender = 0; sender < run.threads; sender++)
+        senders.push_back (new std::thread (sender_task, &context, endpoint,
+                                            run, &go));
+    for (int hellos = 0; hellos < run.threads; hellos++) {
+        zmq::message_t hello;
+        receiver.recv (&hello);
+    }
+    slot_t *slot = slots [0];
+    slot->started = s_clock_ns ();
+    go.store (true);
+    uint64_t expected = (uint64_t) run.count * run.threads;
+    for (slot->messages = 0; slot->messages < expected; slot->messages++) {
+        zmq::message_t message;
+        receiver.recv (&message);
+        s_record_stamp (message, slot, s_clock_ns ());
+    }
+    slot->finished = s_clock_ns ();
+    go.store (false);
+    for (size_t sender = 0; sender < senders.size (); sender++) {
+        senders [sender]->join ();
+        delete senders [sender];
+    }
+}
+
+//  ---------------------------------------------------------------------
+//  Fan-out: the publisher waits for every subscription, publishes, and
+//  then sends an empty message until every subscriber has seen one
+
+static void
+subscriber_task (zmq::context_t *context, std::string endpoint, slot_t *shared,
+                 std::atomic<int> *done)
+{
+    zaffinity::global ().pin_next ();
+    slot_t *slot = zaffinity::make_local<slot_t> ();
+    zmq::socket_t subscriber (*context, ZMQ_SUB);
+    int linger = 0;
+    subscriber.setsockopt (ZMQ_LINGER, &linger, sizeof (linger));
+    subscriber.setsockopt (ZMQ_SUBSCRIBE, "", 0);
+    subscriber.connect (endpoint.c_str ());
+    while (true) {
+        zmq::message_t message;
+        subscriber.recv (&message);
+        if (message.size () == 0)
+            break;
+        int64_t now = s_clock_ns ();
+        s_record_stamp (message, slot, now);
+        slot->finished = now;
+        slot->messages++;
+    }
+    s_slot_return (shared, slot);
+    (*done)++;
+}
+
+static void
+s_fanout (zmq::context_t &context, zmq::socket_t &publisher, run_t run,
+          std::vector<slot_t *> &slots)
+{
+    std::string endpoint = s_endpoint (run.transport);
+    std::atomic<int> done (0);
+    std::vector<std::thread *> subscribers;
+    for (int subscriber = 0; subscriber < run.threads; subscriber++)
+        subscribers.push_back (new std::thread (subscriber_task, &context,
+                                                endpoint, slots [subscriber], &done));
+    for (int subscriptions = 0; subscriptions < run.threads; subscriptions++) {
+        zmq::message_t subscription;
+        publisher.recv (&subscription);
+    }
+    int64_t started = s_clock_ns ();
+    for (int count = 0; count < run.count; count++) {
+        zmq::message_t message (run.size);
+        s_stamp (message);
+        publisher.send (message);
+    }
+    while (done.load () < run.threads) {
+        zmq::message_t end;
+        publisher.send (end);
+        s_sleep (10);
+    }
+    for (size_t subscriber = 0; subscriber < subscribers.size (); subscriber++) {
+        subscribers [subscriber]->join ();
+        delete subscribers [subscriber];
+        slots [subscriber]->started = started;
+    }
+}
+
+//  ---------------------------------------------------------------------
+//  Run one test and collect its results, or return false if we could
+//  not bind to the transport
+
+static bool
+s_run (run_t run, result_t &result)
+{
+    zmq::context_t context (1);
+    zaffinity::global ().configure (context);
+    int type = run.pattern == "oneway"? ZMQ_PULL:
+               run.pattern == "fanout"? ZMQ_XPUB: ZMQ_ROUTER;
+    zmq::socket_t bound (context, type);
+    int linger = 0;
+    bound.setsockopt (ZMQ_LINGER, &linger, sizeof (linger));
+    if (type == ZMQ_XPUB) {
+        int verbose = 1;        //  We count every subscription
+        bound.setsockopt (ZMQ_XPUB_VERBOSE, &verbose, sizeof (verbose));
+    }
+    try {
+        bound.bind (s_endpoint (run.transport).c_str ());
+    }
+    catch (zmq::error_t &e) {
+        std::cout << "E: cannot bind " << s_endpoint (run.transport)
+                  << ": " << e.what () << std::endl;
+        return false;
+    }
+    std::vector<slot_t *> slots;
+    for (int thread = 0; thread < run.threads; thread++) {
+        slot_t *slot = new slot_t;
+        slot->messages = 0;
+        slot->started = 0;
+        slot->finished = 0;
+        slots.push_back (slot);
+    }
+    if (run.pattern == "oneway")
+        s_oneway (context, bound, run, slots);
+    else
+    if (run.pattern == "fanout")
+        s_fanout (context, bound, run, slots);
+    else
+        s_round_trip (context, bound, run, slots);
+
+    zhistogram latency;
+    int64_t started = 0;
+    int64_t finished = 0;
+    result.run = run;
+    result.messages = 0;
+    for (size_t thread = 0; thread < slots.size (); thread++) {
+        slot_t *slot = slots [thread];
+        latency.merge (slot->latency);
+        result.messages += slot->messages;
+        if (slot->started && (!started || slot->started < started))
+            started = slot->started;
+        if (slot->finished > finished)
+            finished = slot->finished;
+        delete slot;
+    }
+    result.lost = run.pattern == "fanout"?
+        (uint64_t) run.count * run.threads - result.messages: 0;
+    result.seconds = finished > started? (finished - started) / 1e9: 0;
+    result.p50 = latency.percentile (50);
+    result.p90 = latency.percentile (90);
+    result.p99 = latency.percentile (99);
+    result.p999 = latency.percentile (99.9);
+    result.max = latency.max ();
+    return true;
+}
+
+static double
+s_rate (const result_t &result)
+{
+    return result.seconds > 0? result.messages / result.seconds: 0;
+}
+
+static double
+s_megabytes (const result_t &result)
+{
+    return s_rate (result) * result.run.size / 1000000;
+}
+
+//  ---------------------------------------------------------------------
+//  Output, as text, JSON and CSV
+
+static void
+s_print (const result_t &result)
+{
+    std::cout << result.run.pattern << " " << result.run.transport
+              << " size=" << result.run.size
+              << " depth=" << result.run.depth
+              << " threads=" << result.run.threads
+              << ": " << (uint64_t) s_rate (result) << " msg/s "
+              << std::fixed << std::setprecision (1) << s_megabytes (result) << " MB/s"
+              << " p50=" << result.p50 / 1000 << "us"
+              << " p99=" << result.p99 / 1000 << "us"
+              << " p999=" << result.p999 / 1000 << "us";
+    if (result.lost)
+        std::cout << " lost=" << result.lost;
+    std::cout << std::endl;
+}
+
+static void
+s_write_json (std::string filename, std::vector<result_t> &results)
+{
+    std::ofstream out (filename.c_str ());
+    out << "[\n";
+    for (size_t index = 0; index < results.size (); index++) {
+        result_t &result = results [index];
+        out << "  {\"pattern\": \"" << result.run.pattern << "\""
+            << ", \"transport\": \"" << result.run.transport << "\""
+            << ", \"size\": " << result.run.size
+            << ", \"depth\": " << result.run.depth
+            << ", \"threads\": " << result.run.threads
+            << ", \"messages\": " << result.messages
+            << ", \"lost\": " << result.lost
+            << ", \"seconds\": " << result.seconds
+            << ", \"msgs_per_sec\": " << s_rate (result)
+            << ", \"mb_per_sec\": " << s_megabytes (result)
+            << ", \"p50_ns\": " << result.p50
+            << ", \"p90_ns\": " << result.p90
+            << ", \"p99_ns\": " << result.p99
+            << ", \"p999_ns\": " << result.p999
+            << ", \"max_ns\": " << result.max
+            << "}" << (index + 1 < results.size ()? ",": "") << "\n";
+    }
+    out << "]\n";
+}
+
+static void
+s_write_csv (std::string filename, std::vector<result_t> &results)
+{
+    std::ofstream out (filename.c_str ());
+    out << "pattern,transport,size,depth,threads,messages,lost,seconds,"
+        << "msgs_per_sec,mb_per_sec,p50_ns,p90_ns,p99_ns,p999_ns,max_ns\n";
+    for (size_t index = 0; index < results.size (); index++) {
+        result_t &result = results [index];
+        out << result.run.pattern << "," << result.run.transport << ","
+            << result.run.size << "," << result.run.depth << ","
+            << result.run.threads << "," << result.messages << ","
+            << result.lost << "," << result.seconds << ","
+            << s_rate (result) << "," << s_megabytes (result) << ","
+            << result.p50 << "," << result.p90 << "," << result.p99 << ","
+            << result.p999 << "," << result.max << "\n";
+    }
+}
+
+static std::vector<std::string>
+s_split (std::string list)
+{
+    std::vector<std::string> items;
+    std::stringstream stream (list);
+    std::string item;
+    while (std::getline (stream, item, ','))
+        if (item.size ())
+            items.push_back (item);
+    return items;
+}
+
+static std::vector<int>
+s_split_numbers (std::string list)
+{
+    std::vector<std::string> items = s_split (list);
+    std::vector<int> numbers;
+    for (size_t index = 0; index < items.size (); index++)
+        numbers.push_back (atoi (items [index].c_str ()));
+    return numbers;
+}
+
+int main (int argc, char *argv [])
+{
+    s_version_assert (4, 0);
+
+    std::string patterns = "sync,pipeline,oneway,fanout";
+    std::string transports = "inproc,ipc,tcp";
+    std::string sizes = "64,1024,65536";
+    std::string depths = "16,256";
+    std::string threads = "1,4";
+    int count = 20000;
+    std::string json;
+    std::string csv;
+    for (int argn = 1; argn + 1 < argc; argn += 2) {
+        std::string option = argv [argn];
+        std::string value = argv [argn + 1];
+        if (option == "-p") patterns = value;
+        else if (option == "-t") transports = value;
+        else if (option == "-s") sizes = value;
+        else if (option == "-d") depths = value;
+        else if (option == "-n") threads = value;
+        else if (option == "-c") count = atoi (value.c_str ());
+        else if (option == "-j") json = value;
+        else if (option == "-o") csv = value;
+        else {
+            std::cout << "E: unknown option " << option << std::endl;
+            return 1;
+        }
+    }
+    if (argc % 2 == 0) {
+        std::cout << "syntax: tripbench [-p patterns] [-t transports] [-s sizes]"
+                  << " [-d depths] [-n threads] [-c count] [-j file] [-o file]"
+                  << std::endl;
+        return 1;
+    }
+
+    //  Build the sweep; depth only matters when pipelining
+    std::vector<run_t> runs;
+    std::vector<std::string> pattern_list = s_split (patterns);
+    std::vector<std::string> transport_list = s_split (transports);
+    std::vector<int> size_list = s_split_numbers (sizes);
+    std::vector<int> depth_list = s_split_numbers (depths);
+    std::vector<int> thread_list = s_split_numbers (threads);
+    for (size_t pattern = 0; pattern < pattern_list.size (); pattern++)
+    for (size_t transport = 0; transport < transport_list.size (); transport++)
+    for (size_t size = 0; size < size_list.size (); size++)
+    for (size_t thread = 0; thread < thread_list.size (); thread++)
+    for (size_t depth = 0; depth < depth_list.size (); depth++) {
+        run_t run;
+        run.pattern = pattern_list [pattern];
+        run.transport = transport_list [transport];
+        run.size = size_list [size];
+        run.threads = thread_list [thread];
+        run.depth = run.pattern == "pipeline"? depth_list [depth]: 1;
+        run.count = count;
+        if (run.pattern != "sync" && run.pattern != "pipeline"
+        &&  run.pattern != "oneway" && run.pattern != "fanout") {
+            std::cout << "E: unknown pattern " << run.pattern << std::endl;
+            return 1;
+        }
+        if (run.size < 1 || run.threads < 1 || run.depth < 1 || run.count < 1) {
+            std::cout << "E: sizes, depths, threads and count must be positive"
+                      << std::endl;
+            return 1;
+        }
+        runs.push_back (run);
+        if (run.pattern != "pipeline")
+            break;              //  Only one run per depth sweep
+    }
+
+    std::cout << "I: placement " << zaffinity::global ().report () << std::endl;
+    std::vector<result_t> results;
+    for (size_t index = 0; index < runs.size (); index++) {
+        result_t result;
+        if (s_run (runs [index], result)) {
+            s_print (result);
+            results.push_back (result);
+        }
+    }
+    if (json.size ())
+        s_write_json (json, results);
+    if (csv.size ())
+        s_write_csv (csv, results);
+    return 0;
+}
@@ -24,16 +24,16 @@ client_task (void *args)
     int64_t start;
 
     std::cout << "Synchronous round-trip test..." << std::endl;
-    start = s_clock ();
+    start = s_clock_ms ();
     for (requests = 0; requests < 10000; requests++) {
         zmsg msg ("HELLO");
         msg.send (client);
         msg.recv (client);
     }
-    std::cout << (1000 * 10000) / (int) (s_clock () - start) << " calls/second" << std::endl;
+    std::cout << (1000 * 10000) / (int) (s_clock_ms () - start) << " calls/second" << std::endl;
 
     std::cout << "Asynchronous round-trip test..." << std::endl;
-    start = s_clock ();
+    start = s_clock_ms ();
     for (requests = 0; requests < 100000; requests++) {
         zmsg msg ("HELLO");
         msg.send (client);
@@ -41,7 +41,7 @@ client_task (void *args)
     for (requests = 0; requests < 100000; requests++) {
         zmsg msg (client);
     }
-    std::cout << (1000 * 100000) / (int) (s_clock () - start) << " calls/second" << std::endl;
+    std::cout << (1000 * 100000) / (int) (s_clock_ms () - start) << " calls/second" << std::endl;
 
     return 0;
 }
@@ -0,0 +1,302 @@
+#ifndef __ZAFFINITY_HPP_INCLUDED__
+#define __ZAFFINITY_HPP_INCLUDED__
+
+//  Thread and memory placement: context I/O threads, application threads,
+//  and per-thread memory
+//
+//  Left alone, the OS moves threads between CPUs and, on a host with
+//  several NUMA nodes, between nodes, away from the memory and the I/O
+//  threads they work with. Placement comes from the environment, so any
+//  program can be placed without new options:
+//
+//      ZAFFINITY_NODE=0            Use CPUs on this NUMA node, unless
+//                                  the lists below say otherwise
+//      ZAFFINITY_IO_THREADS=2      I/O threads per context
+//      ZAFFINITY_IO_CPUS=0-1       CPUs for I/O threads
+//      ZAFFINITY_IO_POLICY=fifo    Scheduling policy for I/O threads:
+//                                  other, fifo or rr
+//      ZAFFINITY_IO_PRIORITY=50    Priority, for fifo and rr
+//      ZAFFINITY_APP_CPUS=2-15     CPUs for application threads
+//
+//  CPU lists are as in /sys: "0-3,8,10-11". With just a node, I/O threads
+//  share the node's first CPUs and application threads get the rest.
+//
+//      zaffinity &placement = zaffinity::global ();
+//      placement.configure (context);      //  Before the first socket
+//      placement.pin_next ();              //  In each application thread
+//
+//  Memory for a thread's own use should come from its node. Linux puts a
+//  page on the node of the thread that first touches it, so alloc() maps
+//  fresh pages and touches them from the calling thread: allocate after
+//  pinning, from the thread that will use the memory.
+//
+//  Pinning, NUMA and I/O thread affinity are Linux only; elsewhere these
+//  calls do nothing.
+
+#include "zhelpers.hpp"
+
+#include <vector>
+#include <atomic>
+#include <fstream>
+#include <new>
+
+#if defined (__linux__)
+#   include <pthread.h>
+#   include <sched.h>
+#   include <sys/mman.h>
+#endif
+
+class zaffinity {
+public:
+
+    //  Placement for this process, read from the environment once
+    static zaffinity &global ()
+    {
+        static zaffinity placement;
+        return placement;
+    }
+
+    zaffinity ()
+    {
+        m_next.store (0);
+        m_io_threads = s_env_int ("ZAFFINITY_IO_THREADS", 0);
+        m_io_cpus = parse_cpus (s_env ("ZAFFINITY_IO_CPUS"));
+        m_app_cpus = parse_cpus (s_env ("ZAFFINITY_APP_CPUS"));
+        m_io_policy = policy_of (s_env ("ZAFFINITY_IO_POLICY"));
+        m_io_priority = s_env_int ("ZAFFINITY_IO_PRIORITY", -1);
+
+        int node = s_env_int ("ZAFFINITY_NODE", -1);
+        if (node >= 0) {
+            std::vector<int> cpus = node_cpus (node);
+            size_t shared = m_io_threads > 0? (size_t) m_io_threads: 1;
+            if (m_io_cpus.empty () && m_app_cpus.empty () && cpus.size () > shared) {
+                m_io_cpus.assign (cpus.begin (), cpus.begin () + shared);
+                m_app_cpus.assign (cpus.begin () + shared, cpus.end ());
+            }
+            else {
+                if (m_io_cpus.empty ())
+                    m_io_cpus = cpus;
+                if (m_app_cpus.empty ())
+                    m_app_cpus = cpus;
+            }
+        }
+    }
+
+    //  ---------------------------------------------------------------------
+    //  Set a context's I/O threads; the context starts them with its first
+    //  socket, so call this before that. Returns 0, or -1 if libzmq turned
+    //  down a setting.
+
+    int
+    configure (zmq::context_t &context)
+    {
+        void *handle = static_cast<void*>(context);
+        int rc = 0;
+        if (m_io_threads > 0)
+            rc |= zmq_ctx_set (handle, ZMQ_IO_THREADS, m_io_threads);
+#if defined (ZMQ_THREAD_AFFINITY_CPU_ADD)
+        for (size_t index = 0; index < m_io_cpus.size (); index++)
+            rc |= zmq_ctx_set (handle, ZMQ_THREAD_AFFINITY_CPU_ADD, m_io_cpus [index]);
+#endif
+#if defined (ZMQ_THREAD_SCHED_POLICY)
+        if (m_io_policy >= 0)
+            rc |= zmq_ctx_set (handle, ZMQ_THREAD_SCHED_POLICY, m_io_policy);
+        if (m_io_priority >= 0)
+            rc |= zmq_ctx_set (handle, ZMQ_THREAD_PRIORITY, m_io_priority);
+#endif
+        return rc == 0? 0: -1;
+    }
+
+    //  ---------------------------------------------------------------------
+    //  Pin the calling thread to the next application CPU, dealing them
+    //  out in turn. Returns the CPU, or -1 if we have none to give.
+
+    int
+    pin_next ()
+    {
+        if (m_app_cpus.empty ())
+            return -1;
+        int cpu = m_app_cpus [m_next.fetch_add (1) % m_app_cpus.size ()];
+        return pin_cpu (cpu) == 0? cpu: -1;
+    }
+
+    //  Pin the calling thread to one CPU; returns 0, or -1 if we can't
+    static int
+    pin_cpu (int cpu)
+    {
+#if defined (__linux__)
+        cpu_set_t set;
+        CPU_ZERO (&set);
+        CPU_SET (cpu, &set);
+        return pthread_setaffinity_np (pthread_self (), sizeof (set), &set) == 0? 0: -1;
+#else
+        return -1;
+#endif
+    }
+
+    //  ---------------------------------------------------------------------
+    //  Zeroed memory on the calling thread's node; free with release()
+
+    static void *
+    alloc (size_t size)
+    {
+#if defined (__linux__)
+        void *memory = mmap (NULL, size, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED)
+            throw std::bad_alloc ();
+        //  First touch places each page
+        long page = sysconf (_SC_PAGESIZE);
+        for (size_t offset = 0; offset < size; offset += page)
+            ((volatile char *) memory) [offset] = 0;
+        return memory;
+#else
+        void *memory = calloc (1, size);
+        if (!memory)
+            throw std::bad_alloc ();
+        return memory;
+#endif
+    }
+
+    static void
+    release (void *memory, size_t size)
+    {
+#if defined (__linux__)
+        munmap (memory, size);
+#else
+        free (memory);
+#endif
+    }
+
+    //  Construct an object in memory on the calling thread's node
+    template <typename T>
+    static T *
+    make_local ()
+    {
+        return new (alloc (sizeof (T))) T ();
+    }
+
+    template <typename T>
+    static void
+    destroy_local (T *object)
+    {
+        object->~T ();
+        release (object, sizeof (T));
+    }
+
+    //  ---------------------------------------------------------------------
+    //  NUMA node a CPU belongs to, or -1 if we can't tell
+
+    static int
+    node_of_cpu (int cpu)
+    {
+        for (int node = 0; node_exists (node); node++) {
+            std::vector<int> cpus = node_cpus (node);
+            for (size_t index = 0; index < cpus.size (); index++)
+                if (cpus [index] == cpu)
+                    return node;
+        }
+        return -1;
+    }
+
+    //  CPUs on a NUMA node, empty if we can't tell
+    static std::vector<int>
+    node_cpus (int node)
+    {
+        std::stringstream path;
+        path << "/sys/devices/system/node/node" << node << "/cpulist";
+        std::ifstream file (path.str ().c_str ());
+        std::string list;
+        std::getline (file, list);
+        return parse_cpus (list);
+    }
+
+    //  Parse a CPU list such as "0-3,8,10-11"
+    static std::vector<int>
+    parse_cpus (std::string list)
+    {
+        std::vector<int> cpus;
+        std::stringstream items (list);
+        std::string item;
+        while (std::getline (items, item, ',')) {
+            if (item.empty ())
+                continue;
+            int first = atoi (item.c_str ());
+            size_t dash = item.find ('-');
+            int last = dash == std::string::npos? first: atoi (item.c_str () + dash + 1);
+            for (int cpu = first; cpu <= last; cpu++)
+                cpus.push_back (cpu);
+        }
+        return cpus;
+    }
+
+    //  One line saying where things go, for a startup message
+    std::string
+    report () const
+    {
+        std::stringstream out;
+        out << "io_threads=" << (m_io_threads > 0? m_io_threads: 1)
+            << " io_cpus=" << cpu_list (m_io_cpus)
+            << " app_cpus=" << cpu_list (m_app_cpus);
+        return out.str ();
+    }
+
+private:
+    static std::string
+    s_env (const char *name)
+    {
+        const char *value = getenv (name);
+        return value? value: "";
+    }
+
+    static int
+    s_env_int (const char *name, int fallback)
+    {
+        const char *value = getenv (name);
+        return value && *value? atoi (value): fallback;
+    }
+
+    static bool
+    node_exists (int node)
+    {
+        std::stringstream path;
+        path << "/sys/devices/system/node/node" << node << "/cpulist";
+        std::ifstream file (path.str ().c_str ());
+        return file.good ();
+    }
+
+    //  Scheduling policy by name, or -1 to leave it alone
+    static int
+    policy_of (std::string name)
+    {
+#if defined (__linux__)
+        if (name == "other")
+            return SCHED_OTHER;
+        if (name == "fifo")
+            return SCHED_FIFO;
+        if (name == "rr")
+            return SCHED_RR;
+#endif
+        return -1;
+    }
+
+    static std::string
+    cpu_list (const std::vector<int> &cpus)
+    {
+        if (cpus.empty ())
+            return "any";
+        std::stringstream out;
+        for (size_t index = 0; index < cpus.size (); index++)
+            out << (index? ",": "") << cpus [index];
+        return out.str ();
+    }
+
+    int m_io_threads;                   //  0 leaves the context's own
+    std::vector<int> m_io_cpus;
+    std::vector<int> m_app_cpus;
+    int m_io_policy;                    //  -1 leaves it alone
+    int m_io_priority;
+    std::atomic<unsigned> m_next;       //  Next application CPU to deal
+};
+
+#endif
@@ -0,0 +1,179 @@
+#ifndef __ZCO_HPP_INCLUDED__
+#define __ZCO_HPP_INCLUDED__
+
+//  Coroutines over zloop, for C++20
+//
+//  A flow is a coroutine that returns zco_flow. It starts at once, runs
+//  to its first co_await, and from then on is resumed by the loop. All
+//  flows share the loop's thread, so a thousand of them cost a coroutine
+//  frame each, not a thread each. A flow can wait for a message, with or
+//  without a timeout, or for time to pass:
+//
+//      zco_socket reader (loop, socket);
+//      zmsg *reply = co_await reader.recv (2500);  //  Null if timed out
+//      co_await zco_sleep (loop, 1000);
+//
+//  A zco_socket reads one socket for the flows on its loop; flows that
+//  wait on the same socket get messages in the order they started to
+//  wait. Send on the socket as usual: ZeroMQ queues outgoing messages, so
+//  there is nothing to wait for. Destroy a zco_socket only when no flow
+//  is waiting on it, which a flow can do straight after its recv returns.
+//
+//  The loop stops once the last flow on its thread has ended.
+//
+//  Needs a compiler with coroutines, e.g. -std=c++20. Without them this
+//  header defines nothing; test for ZCO_ENABLED.
+
+#include "zloop.hpp"
+#include "zmsg.hpp"
+
+#if defined (__cpp_impl_coroutine)
+#define ZCO_ENABLED
+
+#include <coroutine>
+#include <deque>
+#include <algorithm>
+
+//  Number of flows running on this thread
+static thread_local int s_zco_flows = 0;
+
+//  What our loop handlers return: carry on while there are flows left
+static int
+s_zco_status (void)
+{
+    return s_zco_flows > 0? 0: -1;
+}
+
+//  Return type of a flow. Flows run detached and free themselves when
+//  they end, so there is nothing to hold on to.
+struct zco_flow {
+    struct promise_type {
+        promise_type () { s_zco_flows++; }
+        ~promise_type () { s_zco_flows--; }
+        zco_flow get_return_object () { return zco_flow (); }
+        std::suspend_never initial_suspend () noexcept { return {}; }
+        std::suspend_never final_suspend () noexcept { return {}; }
+        void return_void () {}
+        void unhandled_exception () { std::terminate (); }
+    };
+};
+
+//  Awaitable that resumes the flow after msecs
+class zco_sleep {
+public:
+    zco_sleep (zloop &loop, int64_t msecs) : m_loop (loop), m_msecs (msecs) {}
+
+    bool await_ready () { return false; }
+    void await_suspend (std::coroutine_handle<> handle) {
+        m_loop.timer (m_msecs, 1, [handle] () {
+            handle.resume ();
+            return s_zco_status ();
+        });
+    }
+    void await_resume () {}
+
+private:
+    zloop &m_loop;
+    int64_t m_msecs;
+};
+
+class zco_socket {
+public:
+
+    //  ---------------------------------------------------------------------
+    //  Read socket on loop, for flows that wait on it
+
+    zco_socket (zloop &loop, zmq::socket_t &socket) : m_loop (loop), m_socket (socket)
+    {
+        m_loop.reader (m_socket, [this] () { return deliver (); }, 64);
+        m_loop.reader_enable (m_socket, false);
+    }
+
+    ~zco_socket ()
+    {
+        assert (m_waiters.empty ());
+        m_loop.reader_end (m_socket);
+    }
+
+    //  Awaitable for the next message on the socket. The flow owns the
+    //  message it gets, or gets null if timeout msecs passed first.
+    class recv_awaiter {
+    public:
+        recv_awaiter (zco_socket &owner, int64_t timeout)
+            : m_owner (owner), m_timeout (timeout), m_msg (0), m_timer (0) {}
+
+        //  If a message is waiting and no flow is before us, take it now
+        bool await_ready () {
+            if (!m_owner.m_waiters.empty ())
+                return false;
+            int events = 0;
+            size_t size = sizeof (events);
+            m_owner.m_socket.getsockopt (ZMQ_EVENTS, &events, &size);
+            if (events & ZMQ_POLLIN)
+                m_msg = new zmsg (m_owner.m_socket);
+            return m_msg != 0;
+        }
+        void await_suspend (std::coroutine_handle<> handle) {
+            m_handle = handle;
+            m_owner.m_waiters.push_back (this);
+            m_owner.m_loop.reader_enable (m_owner.m_socket, true);
+            if (m_timeout >= 0)
+                m_timer = m_owner.m_loop.timer (m_timeout, 1, [this] () {
+                    return m_owner.expire (this);
+                });
+        }
+        zmsg *await_resume () {
+            return m_msg;
+        }
+
+    private:
+        friend class zco_socket;
+        zco_socket &m_owner;
+        int64_t m_timeout;
+        zmsg *m_msg;
+        int m_timer;                    //  Timeout timer, or 0
+        std::coroutine_handle<> m_handle;
+    };
+
+    recv_awaiter recv (int64_t timeout = -1) {
+        return recv_awaiter (*this, timeout);
+    }
+
+private:
+    //  Socket has input: give the next message to the first flow waiting.
+    //  Resuming the flow may destroy us, so we touch nothing afterwards.
+    int deliver ()
+    {
+        if (m_waiters.empty ()) {
+            m_loop.reader_enable (m_socket, false);
+            return 0;
+        }
+        recv_awaiter *waiter = m_waiters.front ();
+        m_waiters.pop_front ();
+        if (m_waiters.empty ())
+            m_loop.reader_enable (m_socket, false);
+        if (waiter->m_timer)
+            m_loop.timer_end (waiter->m_timer);
+        waiter->m_msg = new zmsg (m_socket);
+        waiter->m_handle.resume ();
+        return s_zco_status ();
+    }
+
+    //  A flow's timeout came first
+    int expire (recv_awaiter *waiter)
+    {
+        m_waiters.erase (std::find (m_waiters.begin (), m_waiters.end (), waiter));
+        if (m_waiters.empty ())
+            m_loop.reader_enable (m_socket, false);
+        waiter->m_timer = 0;
+        waiter->m_handle.resume ();
+        return s_zco_status ();
+    }
+
+    zloop &m_loop;
+    zmq::socket_t &m_socket;
+    std::deque<recv_awaiter *> m_waiters;   //  Flows waiting, oldest first
+};
+
+#endif
+#endif
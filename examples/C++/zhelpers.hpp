@@ -220,6 +220,57 @@ s_clock (void)
 #endif
 }
 
+//  Return monotonic clock as nanoseconds, for measuring intervals
+//  This clock does not jump with the wall clock; its zero is arbitrary
+static int64_t
+s_clock_ns (void)
+{
+#if (defined (WIN32))
+    LARGE_INTEGER count, frequency;
+    QueryPerformanceCounter (&count);
+    QueryPerformanceFrequency (&frequency);
+    return (int64_t) (count.QuadPart / frequency.QuadPart * 1000000000
+         + count.QuadPart % frequency.QuadPart * 1000000000 / frequency.QuadPart);
+#else
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+//  Return monotonic clock as milliseconds, for heartbeats and timeouts
+//  Use s_clock() only where you need the time of day
+static int64_t
+s_clock_ms (void)
+{
+    return s_clock_ns () / 1000000;
+}
+
+//  Loop time: an event loop calls s_loop_refresh() once each time it wakes
+//  up, then reads s_loop_ns() or s_loop_ms() as often as it likes. This
+//  costs one clock read per wake-up rather than several per message, and
+//  all code in one pass sees the same "now". Each thread has its own.
+static thread_local int64_t s_loop_time_ns = 0;
+
+static int64_t
+s_loop_refresh (void)
+{
+    s_loop_time_ns = s_clock_ns ();
+    return s_loop_time_ns;
+}
+
+static int64_t
+s_loop_ns (void)
+{
+    return s_loop_time_ns;
+}
+
+static int64_t
+s_loop_ms (void)
+{
+    return s_loop_time_ns / 1000000;
+}
+
 //  Sleep for a number of milliseconds
 static void
 s_sleep (int msecs)
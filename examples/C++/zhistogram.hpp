@@ -0,0 +1,218 @@
+#ifndef __ZHISTOGRAM_HPP_INCLUDED__
+#define __ZHISTOGRAM_HPP_INCLUDED__
+
+//  Log-bucketed latency histogram, in the style of HdrHistogram
+//
+//  Values (normally nanoseconds) go into buckets whose width grows with
+//  the value, so every value is recorded to within 1/32 (about 3%) of
+//  its true size, from 1ns to hours, in a fixed 15KB table. Recording is
+//  a couple of relaxed atomic increments and never locks, so any number
+//  of threads can record into one histogram while another reads it.
+//  Histograms from different threads merge by adding bucket counts.
+
+#include <atomic>
+#include <string>
+#include <sstream>
+#include <ostream>
+#include <iostream>
+#include <stdint.h>
+#include <assert.h>
+
+class zhistogram {
+public:
+    enum {
+        SUB_BITS = 5,                       //  32 sub-buckets per power of 2
+        SUB_COUNT = 1 << SUB_BITS,
+        BUCKETS = (64 - SUB_BITS + 1) * SUB_COUNT
+    };
+
+    zhistogram () {
+        reset ();
+    }
+
+    //  --------------------------------------------------------------------------
+    //  Record one value; safe to call from any thread
+
+    void record (uint64_t value) {
+        m_counts [bucket_of (value)].fetch_add (1, std::memory_order_relaxed);
+        m_total.fetch_add (1, std::memory_order_relaxed);
+        uint64_t max = m_max.load (std::memory_order_relaxed);
+        while (value > max
+        &&    !m_max.compare_exchange_weak (max, value, std::memory_order_relaxed))
+            ;
+    }
+
+    //  --------------------------------------------------------------------------
+    //  Add another histogram's counts into this one
+
+    void merge (const zhistogram &other) {
+        for (int index = 0; index < BUCKETS; index++) {
+            uint64_t count = other.m_counts [index].load (std::memory_order_relaxed);
+            if (count)
+                m_counts [index].fetch_add (count, std::memory_order_relaxed);
+        }
+        m_total.fetch_add (other.count (), std::memory_order_relaxed);
+        uint64_t other_max = other.max ();
+        uint64_t max = m_max.load (std::memory_order_relaxed);
+        while (other_max > max
+        &&    !m_max.compare_exchange_weak (max, other_max, std::memory_order_relaxed))
+            ;
+    }
+
+    void reset () {
+        for (int index = 0; index < BUCKETS; index++)
+            m_counts [index].store (0, std::memory_order_relaxed);
+        m_total.store (0, std::memory_order_relaxed);
+        m_max.store (0, std::memory_order_relaxed);
+    }
+
+    uint64_t count () const {
+        return m_total.load (std::memory_order_relaxed);
+    }
+
+    uint64_t max () const {
+        return m_max.load (std::memory_order_relaxed);
+    }
+
+    //  --------------------------------------------------------------------------
+    //  Value at given percentile (0..100), as the upper edge of the bucket
+    //  it falls in. Returns 0 for an empty histogram.
+
+    uint64_t percentile (double percent) const {
+        uint64_t total = count ();
+        if (total == 0)
+            return 0;
+        uint64_t rank = (uint64_t) (percent / 100.0 * total + 0.5);
+        if (rank < 1)
+            rank = 1;
+        uint64_t seen = 0;
+        for (int index = 0; index < BUCKETS; index++) {
+            seen += m_counts [index].load (std::memory_order_relaxed);
+            if (seen >= rank) {
+                uint64_t value = highest_in (index);
+                return value < max () ? value : max ();
+            }
+        }
+        return max ();
+    }
+
+    //  Count in one bucket, for exporters that lay out their own buckets
+    uint64_t count_in (int index) const {
+        return m_counts [index].load (std::memory_order_relaxed);
+    }
+
+    //  --------------------------------------------------------------------------
+    //  One-line summary, values divided by scale (1000 gives usecs for
+    //  a histogram of nanoseconds)
+
+    std::string summary (uint64_t scale = 1) const {
+        std::stringstream line;
+        line << "count=" << count ()
+             << " p50=" << percentile (50) / scale
+             << " p99=" << percentile (99) / scale
+             << " p999=" << percentile (99.9) / scale
+             << " max=" << max () / scale;
+        return line.str ();
+    }
+
+    //  --------------------------------------------------------------------------
+    //  Export non-empty buckets, one "upper_edge count" pair per line, so
+    //  other tools can rebuild or merge the distribution
+
+    void export_buckets (std::ostream &out) const {
+        for (int index = 0; index < BUCKETS; index++) {
+            uint64_t count = m_counts [index].load (std::memory_order_relaxed);
+            if (count)
+                out << highest_in (index) << " " << count << "\n";
+        }
+    }
+
+    //  --------------------------------------------------------------------------
+    //  Bucket arithmetic. Values below SUB_COUNT get a bucket each; above
+    //  that, each power of two is split into SUB_COUNT equal buckets.
+
+    static int bucket_of (uint64_t value) {
+        if (value < SUB_COUNT)
+            return (int) value;
+        int msb = msb_of (value);
+        int sub = (int) (value >> (msb - SUB_BITS)) & (SUB_COUNT - 1);
+        return (msb - SUB_BITS + 1) * SUB_COUNT + sub;
+    }
+
+    static uint64_t lowest_in (int index) {
+        if (index < SUB_COUNT)
+            return index;
+        int msb = index / SUB_COUNT + SUB_BITS - 1;
+        uint64_t sub = index % SUB_COUNT;
+        return (SUB_COUNT + sub) << (msb - SUB_BITS);
+    }
+
+    static uint64_t highest_in (int index) {
+        if (index < SUB_COUNT)
+            return index;
+        int msb = index / SUB_COUNT + SUB_BITS - 1;
+        return lowest_in (index) + ((uint64_t) 1 << (msb - SUB_BITS)) - 1;
+    }
+
+    static int
+    test (int verbose)
+    {
+        //  Buckets are contiguous and every value lands in its own
+        assert (bucket_of (0) == 0);
+        assert (bucket_of (31) == 31);
+        assert (bucket_of (32) == 32);
+        for (int index = 1; index < BUCKETS - 1; index++)
+            assert (lowest_in (index) == highest_in (index - 1) + 1);
+        for (uint64_t value = 1; value < 1000000; value = value * 3 + 1) {
+            int index = bucket_of (value);
+            assert (lowest_in (index) <= value && value <= highest_in (index));
+        }
+        assert (bucket_of (UINT64_MAX) == BUCKETS - 1);
+
+        //  Percentiles are accurate to a bucket width
+        zhistogram histogram;
+        for (uint64_t value = 1; value <= 100000; value++)
+            histogram.record (value);
+        assert (histogram.count () == 100000);
+        assert (histogram.max () == 100000);
+        uint64_t p50 = histogram.percentile (50);
+        assert (p50 >= 50000 && p50 < 50000 + 50000 / SUB_COUNT + 1);
+        uint64_t p99 = histogram.percentile (99);
+        assert (p99 >= 99000 && p99 < 99000 + 99000 / SUB_COUNT + 1);
+        assert (histogram.percentile (100) == 100000);
+
+        //  Merging adds counts
+        zhistogram other;
+        other.record (1000000);
+        histogram.merge (other);
+        assert (histogram.count () == 100001);
+        assert (histogram.max () == 1000000);
+
+        if (verbose)
+            std::cout << histogram.summary () << std::endl;
+        histogram.reset ();
+        assert (histogram.count () == 0);
+        assert (histogram.percentile (50) == 0);
+
+        std::cout << "OK" << std::endl;
+        return 0;
+    }
+
+private:
+    static int msb_of (uint64_t value) {
+#if defined (__GNUC__)
+        return 63 - __builtin_clzll (value);
+#else
+        int msb = 0;
+        while (value >>= 1)
+            msb++;
+        return msb;
+#endif
+    }
+
+    std::atomic<uint64_t> m_counts [BUCKETS];
+    std::atomic<uint64_t> m_total;
+    std::atomic<uint64_t> m_max;
+};
+
+#endif
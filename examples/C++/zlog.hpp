@@ -0,0 +1,510 @@
+#ifndef __ZLOG_HPP_INCLUDED__
+#define __ZLOG_HPP_INCLUDED__
+
+//  Asynchronous logging for hot paths
+//
+//  s_console formats and prints on the caller's thread, so a broker with
+//  a slow terminal stalls just when it is busiest. ZLOG only copies a
+//  record - the format string's address, a timestamp and the arguments in
+//  binary - into a ring owned by the calling thread, and a writer thread
+//  formats and prints it. After a thread's first record nothing allocates
+//  or locks on the caller's side.
+//
+//      ZLOG ("W: worker %s slow, %d msecs", identity.c_str (), msecs);
+//
+//  Formats must be string literals, as we keep only the pointer, and may
+//  not use * for width or precision. Arguments are numbers, strings and
+//  pointers; strings are copied, and cut short if the record fills up.
+//  When a ring is full we drop records, and say how many later.
+//
+//  ZLOG_LIMITED lets a call site through at most ZLOG_BURST times a second,
+//  for error paths that a bad peer can hit at will; the next record let
+//  through says how many were suppressed. ZLOG_SAMPLED logs only one call
+//  in n, for messages that are expected to repeat. Plain ZLOG logs every
+//  call, as verbose tracing should.
+//
+//  ZLOG_BLOCK logs a line followed by a block of text, such as a message
+//  dump, which the writer prints together, in order with other records.
+//  The caller builds the text, so keep it for verbose paths.
+
+#include "zhelpers.hpp"
+
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <type_traits>
+
+#define ZLOG_RING       1024        //  Records per thread, a power of two
+#define ZLOG_PAYLOAD    100         //  Bytes of arguments per record
+#define ZLOG_BURST      10          //  Records per call site per second
+#define ZLOG_IDLE       10          //  Writer sleeps this long when idle, msecs
+#define ZLOG_LINE       1024        //  Longest line we print
+
+//  Log from a call site
+#define ZLOG(...) do { \
+    static zlog_site zlog_site_ (1, false); \
+    zlog::global ().log (zlog_site_, 0, __VA_ARGS__); \
+} while (0)
+
+//  Log from a call site, rate limited
+#define ZLOG_LIMITED(...) do { \
+    static zlog_site zlog_site_ (1, true); \
+    zlog::global ().log (zlog_site_, 0, __VA_ARGS__); \
+} while (0)
+
+//  Log one call in n from a call site
+#define ZLOG_SAMPLED(n, ...) do { \
+    static zlog_site zlog_site_ (n, false); \
+    zlog::global ().log (zlog_site_, 0, __VA_ARGS__); \
+} while (0)
+
+//  Log a line and then a block of text
+#define ZLOG_BLOCK(text, ...) do { \
+    static zlog_site zlog_site_ (1, false); \
+    std::string zlog_text_ (text); \
+    zlog::global ().log (zlog_site_, &zlog_text_, __VA_ARGS__); \
+} while (0)
+
+//  State for one call site, shared by all threads that log from it
+class zlog_site {
+public:
+    zlog_site (int sample, bool limited) : m_sample (sample), m_limited (limited),
+        m_calls (0), m_second (0), m_count (0), m_suppressed (0) {}
+
+    //  Should this call be logged? Races between threads only blur the
+    //  limit a little.
+    bool admit (int64_t now)
+    {
+        if (m_sample > 1 && m_calls.fetch_add (1, std::memory_order_relaxed) % m_sample)
+            return false;
+        if (!m_limited)
+            return true;
+        int64_t second = now / 1000000000;
+        if (m_second.load (std::memory_order_relaxed) != second) {
+            m_second.store (second, std::memory_order_relaxed);
+            m_count.store (0, std::memory_order_relaxed);
+        }
+        if (m_count.fetch_add (1, std::memory_order_relaxed) >= ZLOG_BURST) {
+            m_suppressed.fetch_add (1, std::memory_order_relaxed);
+            return false;
+        }
+        return true;
+    }
+
+    //  Number of records suppressed since we last asked
+    int suppressed ()
+    {
+        return m_suppressed.exchange (0, std::memory_order_relaxed);
+    }
+
+private:
+    int m_sample;
+    bool m_limited;                     //  At most ZLOG_BURST a second
+    std::atomic<uint64_t> m_calls;
+    std::atomic<int64_t> m_second;      //  Second we are counting in
+    std::atomic<int> m_count;           //  Records in that second
+    std::atomic<int> m_suppressed;
+};
+
+//  One log record, as the caller left it. Each argument in the payload is
+//  a type byte followed by the value: 'i' and 'u' for 64-bit integers, 'f'
+//  for a double, 'p' for a pointer, 's' for a null-terminated string.
+typedef struct {
+    const char *format;
+    int64_t time;                       //  s_clock_ns() when logged
+    int suppressed;                     //  Records this site suppressed before
+    int size;                           //  Bytes of payload used
+    std::string *block;                 //  Text to print after the line, or null
+    char payload [ZLOG_PAYLOAD];
+} zlog_record_t;
+
+//  Single producer, single consumer ring of records
+class zlog_ring {
+public:
+    zlog_ring () : m_dropped (0), m_closed (false), m_head (0), m_tail (0) {}
+
+    //  Producer: next free record, or null if the ring is full
+    zlog_record_t *claim ()
+    {
+        uint64_t head = m_head.load (std::memory_order_relaxed);
+        if (head - m_tail.load (std::memory_order_acquire) >= ZLOG_RING) {
+            m_dropped.fetch_add (1, std::memory_order_relaxed);
+            return 0;
+        }
+        return &m_records [head & (ZLOG_RING - 1)];
+    }
+    //  Producer: publish the record claim() returned
+    void commit ()
+    {
+        m_head.store (m_head.load (std::memory_order_relaxed) + 1,
+                      std::memory_order_release);
+    }
+    //  Consumer: oldest record, or null if the ring is empty
+    zlog_record_t *peek ()
+    {
+        uint64_t tail = m_tail.load (std::memory_order_relaxed);
+        if (tail == m_head.load (std::memory_order_acquire))
+            return 0;
+        return &m_records [tail & (ZLOG_RING - 1)];
+    }
+    //  Consumer: release the record peek() returned
+    void pop ()
+    {
+        m_tail.store (m_tail.load (std::memory_order_relaxed) + 1,
+                      std::memory_order_release);
+    }
+
+    std::atomic<uint64_t> m_dropped;    //  Records lost to a full ring
+    std::atomic<bool> m_closed;         //  Producer thread has ended
+
+private:
+    //  Producer and consumer each get a cache line to themselves
+    char m_pad1 [64];
+    std::atomic<uint64_t> m_head;
+    char m_pad2 [64];
+    std::atomic<uint64_t> m_tail;
+    char m_pad3 [64];
+    zlog_record_t m_records [ZLOG_RING];
+};
+
+class zlog {
+public:
+
+    //  ---------------------------------------------------------------------
+    //  The process-wide logger, started on first use. It drains all rings
+    //  when it is destroyed at exit.
+
+    static zlog &global ()
+    {
+        static zlog logger;
+        return logger;
+    }
+
+    zlog ()
+    {
+        //  Records carry monotonic time; we print it as time of day
+        m_offset = s_clock () * 1000000 - s_clock_ns ();
+        m_stamped = 0;
+        m_stop.store (false);
+        m_thread = new std::thread (&zlog::write_records, this);
+    }
+
+    ~zlog ()
+    {
+        m_stop.store (true);
+        m_thread->join ();
+        delete m_thread;
+        for (size_t index = 0; index < m_rings.size (); index++)
+            delete m_rings [index];
+    }
+
+    //  ---------------------------------------------------------------------
+    //  Log a record if the site admits it; use ZLOG rather than this.
+    //  We take the block's text, if any, without copying it.
+
+    template <typename... Args>
+    void log (zlog_site &site, std::string *block, const char *format,
+              const Args &... args)
+    {
+        int64_t now = s_clock_ns ();
+        if (!site.admit (now))
+            return;
+        zlog_ring *ring = thread_ring ();
+        zlog_record_t *record = ring->claim ();
+        if (!record)
+            return;
+        record->format = format;
+        record->time = now;
+        record->suppressed = site.suppressed ();
+        record->size = 0;
+        record->block = 0;
+        if (block) {
+            record->block = new std::string ();
+            record->block->swap (*block);
+        }
+        pack (*record, args...);
+        ring->commit ();
+    }
+
+private:
+    //  Marks the thread's ring closed when the thread ends, so the writer
+    //  can free it once drained
+    struct ring_owner {
+        zlog_ring *m_ring;
+        ring_owner () : m_ring (0) {}
+        ~ring_owner () {
+            if (m_ring)
+                m_ring->m_closed.store (true, std::memory_order_release);
+        }
+    };
+
+    zlog_ring *thread_ring ()
+    {
+        static thread_local ring_owner owner;
+        if (!owner.m_ring) {
+            owner.m_ring = new zlog_ring ();
+            std::lock_guard<std::mutex> lock (m_mutex);
+            m_rings.push_back (owner.m_ring);
+        }
+        return owner.m_ring;
+    }
+
+    //  ---------------------------------------------------------------------
+    //  Packing arguments into a record
+
+    static void pack (zlog_record_t &record) {}
+
+    template <typename T, typename... Rest>
+    static void pack (zlog_record_t &record, const T &value, const Rest &... rest)
+    {
+        put (record, value);
+        pack (record, rest...);
+    }
+
+    static void put_value (zlog_record_t &record, char type, const void *value, int size)
+    {
+        if (record.size + 1 + size > ZLOG_PAYLOAD)
+            return;                     //  Prints as <?>
+        record.payload [record.size] = type;
+        memcpy (record.payload + record.size + 1, value, size);
+        record.size += 1 + size;
+    }
+
+    template <typename T>
+    static void put (zlog_record_t &record, T value)
+    {
+        static_assert (std::is_integral<T>::value || std::is_enum<T>::value,
+                       "ZLOG takes numbers, strings and pointers");
+        int64_t number = (int64_t) value;
+        put_value (record, std::is_signed<T>::value? 'i': 'u', &number, sizeof (number));
+    }
+    template <typename T>
+    static void put (zlog_record_t &record, T *value)
+    {
+        put_value (record, 'p', &value, sizeof (value));
+    }
+    static void put (zlog_record_t &record, double value)
+    {
+        put_value (record, 'f', &value, sizeof (value));
+    }
+    static void put (zlog_record_t &record, float value)
+    {
+        put (record, (double) value);
+    }
+    static void put (zlog_record_t &record, const char *value)
+    {
+        int room = ZLOG_PAYLOAD - record.size - 2;
+        if (room < 0)
+            return;
+        int length = (int) strlen (value);
+        if (length > room)
+            length = room;
+        record.payload [record.size] = 's';
+        memcpy (record.payload + record.size + 1, value, length);
+        record.payload [record.size + 1 + length] = 0;
+        record.size += length + 2;
+    }
+    static void put (zlog_record_t &record, char *value)
+    {
+        put (record, (const char *) value);
+    }
+    static void put (zlog_record_t &record, const std::string &value)
+    {
+        put (record, value.c_str ());
+    }
+
+    //  ---------------------------------------------------------------------
+    //  Writer thread: drain every ring, then sleep a little if there was
+    //  nothing to do. Rings of threads that have ended go once empty.
+
+    void write_records ()
+    {
+        while (true) {
+            bool stopping = m_stop.load ();
+            int written = 0;
+            std::vector<zlog_ring *> rings;
+            {
+                std::lock_guard<std::mutex> lock (m_mutex);
+                rings = m_rings;
+            }
+            for (size_t index = 0; index < rings.size (); index++) {
+                zlog_ring *ring = rings [index];
+                bool closed = ring->m_closed.load (std::memory_order_acquire);
+                zlog_record_t *record;
+                while ((record = ring->peek ()) != 0) {
+                    write_record (*record);
+                    ring->pop ();
+                    written++;
+                }
+                uint64_t dropped = ring->m_dropped.exchange (0);
+                if (dropped)
+                    fprintf (stdout, "%sW: log ring full, dropped %llu records\n",
+                             stamp (s_clock_ns ()), (unsigned long long) dropped);
+                if (closed)
+                    release (ring);
+            }
+            if (written == 0) {
+                if (stopping)
+                    break;
+                fflush (stdout);
+                s_sleep (ZLOG_IDLE);
+            }
+        }
+        fflush (stdout);
+    }
+
+    void release (zlog_ring *ring)
+    {
+        std::lock_guard<std::mutex> lock (m_mutex);
+        for (size_t index = 0; index < m_rings.size (); index++)
+            if (m_rings [index] == ring) {
+                m_rings.erase (m_rings.begin () + index);
+                break;
+            }
+        delete ring;
+    }
+
+    //  Time of day, as s_console prints it; we reformat once a second
+    const char *stamp (int64_t time)
+    {
+        time_t seconds = (time_t) ((time + m_offset) / 1000000000);
+        if (seconds != m_stamped) {
+            struct tm local;
+#if (defined (WIN32))
+            localtime_s (&local, &seconds);
+#else
+            localtime_r (&seconds, &local);
+#endif
+            strftime (m_stamp, sizeof (m_stamp), "%y-%m-%d %H:%M:%S ", &local);
+            m_stamped = seconds;
+        }
+        return m_stamp;
+    }
+
+    void write_record (zlog_record_t &record)
+    {
+        char line [ZLOG_LINE];
+        int used = snprintf (line, sizeof (line), "%s", stamp (record.time));
+        const char *argument = record.payload;
+        const char *end = record.payload + record.size;
+
+        for (const char *scan = record.format; *scan && used < ZLOG_LINE - 1; scan++) {
+            if (*scan != '%') {
+                line [used++] = *scan;
+                continue;
+            }
+            if (scan [1] == '%') {
+                line [used++] = '%';
+                scan++;
+                continue;
+            }
+            //  Keep flags, width and precision; we supply the length
+            char spec [32] = "%";
+            int length = 1;
+            scan++;
+            while (*scan && strchr ("-+ #0123456789.", *scan) && length < 24)
+                spec [length++] = *scan++;
+            while (*scan && strchr ("hlLqjzt", *scan))
+                scan++;
+            if (!*scan)
+                break;
+            used += format (argument, end, spec, length, *scan,
+                            line + used, ZLOG_LINE - used);
+        }
+        if (record.suppressed && used < ZLOG_LINE - 1)
+            used += snprintf (line + used, ZLOG_LINE - used,
+                              " (%d similar suppressed)", record.suppressed);
+        if (used > ZLOG_LINE - 1)
+            used = ZLOG_LINE - 1;
+        line [used++] = '\n';
+        fwrite (line, 1, used, stdout);
+        if (record.block) {
+            fwrite (record.block->data (), 1, record.block->size (), stdout);
+            delete record.block;
+            record.block = 0;
+        }
+    }
+
+    //  Format one argument by its conversion, if the types agree, else in
+    //  a default form. Returns the number of characters written.
+    static int format (const char *&argument, const char *end, char *spec, int length,
+                       char conversion, char *buffer, int size)
+    {
+        int rc;
+        if (argument >= end)
+            rc = snprintf (buffer, size, "<?>");
+        else {
+            char type = *argument++;
+            bool integral = strchr ("diouxXc", conversion) != 0;
+            bool floating = strchr ("feEgGaA", conversion) != 0;
+            if (type == 'i' || type == 'u') {
+                int64_t value;
+                memcpy (&value, argument, sizeof (value));
+                argument += sizeof (value);
+                if (integral) {
+                    spec [length++] = 'l';
+                    spec [length++] = 'l';
+                    spec [length++] = conversion;
+                    spec [length] = 0;
+                    if (type == 'i')
+                        rc = snprintf (buffer, size, spec, (long long) value);
+                    else
+                        rc = snprintf (buffer, size, spec, (unsigned long long) value);
+                }
+                else
+                if (floating) {
+                    spec [length++] = conversion;
+                    spec [length] = 0;
+                    rc = snprintf (buffer, size, spec, (double) value);
+                }
+                else
+                    rc = snprintf (buffer, size, "%lld", (long long) value);
+            }
+            else
+            if (type == 'f') {
+                double value;
+                memcpy (&value, argument, sizeof (value));
+                argument += sizeof (value);
+                if (floating) {
+                    spec [length++] = conversion;
+                    spec [length] = 0;
+                    rc = snprintf (buffer, size, spec, value);
+                }
+                else
+                    rc = snprintf (buffer, size, "%g", value);
+            }
+            else
+            if (type == 'p') {
+                void *value;
+                memcpy (&value, argument, sizeof (value));
+                argument += sizeof (value);
+                rc = snprintf (buffer, size, "%p", value);
+            }
+            else {
+                const char *value = argument;
+                argument += strlen (value) + 1;
+                if (conversion == 's') {
+                    spec [length++] = 's';
+                    spec [length] = 0;
+                    rc = snprintf (buffer, size, spec, value);
+                }
+                else
+                    rc = snprintf (buffer, size, "%s", value);
+            }
+        }
+        if (rc < 0)
+            rc = 0;
+        return rc < size? rc: size - 1;
+    }
+
+    std::mutex m_mutex;                 //  Guards the list of rings
+    std::vector<zlog_ring *> m_rings;
+    std::atomic<bool> m_stop;
+    std::thread *m_thread;
+    int64_t m_offset;                   //  Time of day less monotonic time, nsecs
+    time_t m_stamped;                   //  Second m_stamp shows
+    char m_stamp [32];
+};
+
+#endif
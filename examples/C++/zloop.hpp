@@ -0,0 +1,504 @@
+#ifndef __ZLOOP_HPP_INCLUDED__
+#define __ZLOOP_HPP_INCLUDED__
+
+//  Reactor with socket and fd readers and timers, after CZMQ's zloop
+//
+//  Register readers and timers, then start() polls and calls handlers
+//  until one returns -1 or we are interrupted. Poll items are rebuilt
+//  only when readers come or go. Timers sit in a hierarchical wheel with
+//  a tick of one msec, so adding, cancelling and firing a timer costs the
+//  same however many there are, and the loop sleeps until the next timer
+//  is due rather than waking on a fixed tick. Repeating timers keep a
+//  fixed rate, so a heartbeat does not drift by the time spent in its
+//  handler, and skip runs they missed rather than bunching up.
+//
+//  ZeroMQ signals input once per batch, so a socket reader may take up
+//  to batch messages per wake-up: after its handler runs we check the
+//  socket's ZMQ_EVENTS and call it again while there is more input. The
+//  handler should read one message per call.
+//
+//  The loop refreshes the loop time (s_loop_ms, s_loop_ns) each time it
+//  wakes up, so handlers can use that instead of reading the clock.
+//
+//  Give the loop a zspin to busy-poll before it blocks, see zspin.hpp.
+
+#include "zhelpers.hpp"
+#include "zspin.hpp"
+
+#include <functional>
+#include <vector>
+#include <map>
+
+//  Handlers return 0 to carry on, or -1 to stop the loop
+typedef std::function<int ()> zloop_handler;
+
+class zloop {
+public:
+
+    zloop ()
+    {
+        for (int slot = 0; slot < SLOTS; slot++)
+            m_slots [slot].m_next = m_slots [slot].m_prev = &m_slots [slot];
+        memset (m_bits, 0, sizeof (m_bits));
+        m_tick = s_loop_refresh () / 1000000;
+        m_now = m_tick;
+        m_firing = false;
+        m_current = 0;
+        m_last_id = 0;
+        m_dirty = true;
+        m_spin = 0;
+    }
+
+    ~zloop ()
+    {
+        while (!m_timers.empty ()) {
+            delete m_timers.begin ()->second;
+            m_timers.erase (m_timers.begin ());
+        }
+        for (size_t index = 0; index < m_readers.size (); index++)
+            delete m_readers [index];
+    }
+
+    //  ---------------------------------------------------------------------
+    //  Call handler when socket has input, up to batch times per wake-up
+
+    void
+    reader (zmq::socket_t &socket, zloop_handler handler, int batch = 1)
+    {
+        add_reader (static_cast<void*>(socket), 0, handler, batch);
+    }
+
+    //  Call handler when a file descriptor has input
+    void
+    reader_fd (int fd, zloop_handler handler)
+    {
+        add_reader (NULL, fd, handler, 1);
+    }
+
+    //  Stop reading socket
+    void
+    reader_end (zmq::socket_t &socket)
+    {
+        for (size_t index = 0; index < m_readers.size (); index++)
+            if (m_readers [index]->m_socket == static_cast<void*>(socket)) {
+                m_readers [index]->m_removed = true;
+                m_dirty = true;
+            }
+    }
+
+    //  Stop or resume polling socket, without giving up the reader; cheap
+    //  enough to call for every message
+    void
+    reader_enable (zmq::socket_t &socket, bool enabled)
+    {
+        for (size_t index = 0; index < m_readers.size (); index++)
+            if (m_readers [index]->m_socket == static_cast<void*>(socket)) {
+                m_readers [index]->m_enabled = enabled;
+                if (!m_dirty)
+                    m_items [index].events = enabled? ZMQ_POLLIN: 0;
+            }
+    }
+
+    //  Poll through spin, which the caller keeps, or plainly if null
+    void
+    set_spin (zspin *spin)
+    {
+        m_spin = spin;
+    }
+
+    //  ---------------------------------------------------------------------
+    //  Call handler after delay msecs, times times or forever if times is
+    //  zero. Returns an id for timer_end().
+
+    int
+    timer (int64_t delay, size_t times, zloop_handler handler)
+    {
+        timer_entry *created = new timer_entry ();
+        created->m_id = ++m_last_id;
+        created->m_delay = delay;
+        created->m_times = times;
+        created->m_expires = s_loop_ms () + delay;
+        created->m_handler = handler;
+        created->m_cancelled = false;
+        created->m_slot = -1;
+        m_timers [created->m_id] = created;
+        wheel_add (created);
+        return created->m_id;
+    }
+
+    //  Cancel a timer; a handler may cancel its own timer
+    void
+    timer_end (int id)
+    {
+        std::map<int, timer_entry*>::iterator it = m_timers.find (id);
+        if (it == m_timers.end ())
+            return;
+        timer_entry *timer = it->second;
+        if (timer == m_current)
+            timer->m_cancelled = true;
+        else {
+            unlink (timer);
+            m_timers.erase (it);
+            delete timer;
+        }
+    }
+
+    //  ---------------------------------------------------------------------
+    //  Run until a handler returns -1, which we return, or until we are
+    //  interrupted or have nothing left to wait for, when we return 0.
+
+    int
+    start ()
+    {
+        int rc = 0;
+        while (rc == 0 && !s_interrupted) {
+            if (m_dirty)
+                rebuild ();
+            long timeout = -1;
+            int64_t deadline = next_deadline ();
+            if (deadline >= 0)
+                timeout = deadline > s_loop_ms ()? (long) (deadline - s_loop_ms ()): 0;
+            else
+            if (m_items.empty ())
+                break;
+
+            try {
+                zmq::pollitem_t *items = m_items.empty ()? NULL: &m_items [0];
+                if (m_spin)
+                    m_spin->poll (items, (int) m_items.size (), timeout);
+                else
+                    zmq::poll (items, m_items.size (), timeout);
+            }
+            catch (zmq::error_t &e) {
+                //  Interrupted by a signal; s_interrupted tells us if we stop
+                for (size_t index = 0; index < m_items.size (); index++)
+                    m_items [index].revents = 0;
+            }
+            s_loop_refresh ();
+
+            //  Readers first, then timers that are due
+            size_t items = m_items.size ();
+            for (size_t index = 0; index < items && rc == 0; index++)
+                if (m_items [index].revents & ZMQ_POLLIN)
+                    rc = dispatch (m_readers [index]);
+            if (rc == 0)
+                rc = advance (s_loop_ms ());
+        }
+        return rc;
+    }
+
+private:
+    struct reader_entry {
+        void *m_socket;             //  Socket, or null for fd reader
+        int m_fd;
+        zloop_handler m_handler;
+        int m_batch;
+        bool m_enabled;
+        bool m_removed;
+    };
+
+    //  A timer is linked into one wheel slot, by m_next and m_prev
+    struct timer_entry {
+        timer_entry *m_next;
+        timer_entry *m_prev;
+        int m_slot;                 //  Slot we're in, or -1
+        int m_id;
+        int64_t m_delay;
+        size_t m_times;             //  Runs left, or 0 for forever
+        int64_t m_expires;          //  Due at, msecs
+        zloop_handler m_handler;
+        bool m_cancelled;           //  Cancelled by its own handler
+    };
+
+    //  Level 0 has a slot per msec for 256 msecs; each level above has 64
+    //  slots, each as long as the whole level below. Four levels reach a
+    //  little over 18 hours; longer timers go round again.
+    enum {
+        LEVEL0_BITS = 8,
+        LEVEL_BITS = 6,
+        LEVELS = 4,
+        SLOTS = (1 << LEVEL0_BITS) + (LEVELS - 1) * (1 << LEVEL_BITS),
+        SPAN_BITS = LEVEL0_BITS + (LEVELS - 1) * LEVEL_BITS
+    };
+
+    void
+    add_reader (void *socket, int fd, zloop_handler handler, int batch)
+    {
+        reader_entry *created = new reader_entry ();
+        created->m_socket = socket;
+        created->m_fd = fd;
+        created->m_handler = handler;
+        created->m_batch = batch > 0? batch: 1;
+        created->m_enabled = true;
+        created->m_removed = false;
+        m_readers.push_back (created);
+        m_dirty = true;
+    }
+
+    void
+    rebuild ()
+    {
+        size_t kept = 0;
+        for (size_t index = 0; index < m_readers.size (); index++) {
+            if (m_readers [index]->m_removed)
+                delete m_readers [index];
+            else
+                m_readers [kept++] = m_readers [index];
+        }
+        m_readers.resize (kept);
+        m_items.resize (kept);
+        for (size_t index = 0; index < kept; index++) {
+            zmq::pollitem_t item = { m_readers [index]->m_socket, m_readers [index]->m_fd,
+                (short) (m_readers [index]->m_enabled? ZMQ_POLLIN: 0), 0 };
+            m_items [index] = item;
+        }
+        m_dirty = false;
+    }
+
+    //  Call the reader's handler, and again while its socket has input
+    int
+    dispatch (reader_entry *reader)
+    {
+        for (int count = 0; count < reader->m_batch; count++) {
+            if (reader->m_removed || !reader->m_enabled)
+                break;
+            if (count > 0) {
+                int events = 0;
+                size_t size = sizeof (events);
+                if (zmq_getsockopt (reader->m_socket, ZMQ_EVENTS, &events, &size) != 0
+                ||  !(events & ZMQ_POLLIN))
+                    break;
+            }
+            if (reader->m_handler () == -1)
+                return -1;
+        }
+        return 0;
+    }
+
+    //  ---------------------------------------------------------------------
+    //  Timer wheel. m_tick is the next msec we have to process; a timer goes
+    //  into the lowest level whose span covers the time until it is due.
+
+    void
+    wheel_add (timer_entry *timer)
+    {
+        int64_t base = m_firing? m_tick + 1: m_tick;
+        int64_t expires = timer->m_expires < base? base: timer->m_expires;
+        int64_t delta = expires - base;
+        if (delta >= (1LL << SPAN_BITS)) {
+            //  We'll find it is not due yet when it gets to level 0
+            expires = base + (1LL << SPAN_BITS) - 1;
+            delta = expires - base;
+        }
+        int slot;
+        if (delta < (1 << LEVEL0_BITS))
+            slot = (int) (expires & ((1 << LEVEL0_BITS) - 1));
+        else {
+            int level = 1;
+            while (delta >= (1LL << (LEVEL0_BITS + level * LEVEL_BITS)))
+                level++;
+            slot = level_slot (level, (int) ((expires >> level_shift (level))
+                                             & ((1 << LEVEL_BITS) - 1)));
+        }
+        timer_entry *head = &m_slots [slot];
+        timer->m_next = head;
+        timer->m_prev = head->m_prev;
+        head->m_prev->m_next = timer;
+        head->m_prev = timer;
+        timer->m_slot = slot;
+        m_bits [slot / 64] |= 1ULL << (slot % 64);
+    }
+
+    void
+    unlink (timer_entry *timer)
+    {
+        timer->m_prev->m_next = timer->m_next;
+        timer->m_next->m_prev = timer->m_prev;
+        int slot = timer->m_slot;
+        if (slot >= 0 && m_slots [slot].m_next == &m_slots [slot])
+            m_bits [slot / 64] &= ~(1ULL << (slot % 64));
+        timer->m_slot = -1;
+    }
+
+    //  Move a slot's timers onto list, leaving the slot empty
+    void
+    take_slot (int slot, timer_entry &list)
+    {
+        timer_entry *head = &m_slots [slot];
+        list.m_next = list.m_prev = &list;
+        if (head->m_next != head) {
+            list.m_next = head->m_next;
+            list.m_prev = head->m_prev;
+            list.m_next->m_prev = &list;
+            list.m_prev->m_next = &list;
+            head->m_next = head->m_prev = head;
+        }
+        m_bits [slot / 64] &= ~(1ULL << (slot % 64));
+        for (timer_entry *timer = list.m_next; timer != &list; timer = timer->m_next)
+            timer->m_slot = -1;
+    }
+
+    //  At the start of each level 0 round, bring down the timers due in
+    //  it from level 1, and so on up while each level starts a round
+    void
+    cascade ()
+    {
+        for (int level = 1; level < LEVELS; level++) {
+            int index = (int) ((m_tick >> level_shift (level)) & ((1 << LEVEL_BITS) - 1));
+            timer_entry list;
+            take_slot (level_slot (level, index), list);
+            while (list.m_next != &list) {
+                timer_entry *timer = list.m_next;
+                unlink (timer);
+                wheel_add (timer);
+            }
+            if (index != 0)
+                break;
+        }
+    }
+
+    //  Fire everything due up to now, skipping empty slots
+    int
+    advance (int64_t now)
+    {
+        m_now = now;
+        int rc = 0;
+        while (m_tick <= now && rc == 0) {
+            int index = (int) (m_tick & ((1 << LEVEL0_BITS) - 1));
+            if (index == 0)
+                cascade ();
+            int next = next_bit (index, 1 << LEVEL0_BITS);
+            if (next == index) {
+                rc = fire (index);
+                m_tick++;
+            }
+            else {
+                int64_t skip = next < 0? (1 << LEVEL0_BITS) - index: next - index;
+                m_tick = std::min (m_tick + skip, now + 1);
+            }
+        }
+        return rc;
+    }
+
+    int
+    fire (int slot)
+    {
+        timer_entry list;
+        take_slot (slot, list);
+        m_firing = true;
+        int rc = 0;
+        while (list.m_next != &list) {
+            timer_entry *timer = list.m_next;
+            unlink (timer);
+            if (rc != 0 || timer->m_expires > m_tick) {
+                wheel_add (timer);      //  Not due yet, or we're stopping
+                continue;
+            }
+            m_current = timer;
+            rc = timer->m_handler ();
+            m_current = 0;
+            if (timer->m_cancelled || (timer->m_times && --timer->m_times == 0)) {
+                m_timers.erase (timer->m_id);
+                delete timer;
+                continue;
+            }
+            timer->m_expires += timer->m_delay;
+            if (timer->m_expires <= m_now && timer->m_delay > 0)
+                timer->m_expires += ((m_now - timer->m_expires) / timer->m_delay + 1)
+                                  * timer->m_delay;
+            wheel_add (timer);
+        }
+        m_firing = false;
+        return rc;
+    }
+
+    //  When we next have to wake up, or -1 if there are no timers
+    int64_t
+    next_deadline ()
+    {
+        if (m_timers.empty ())
+            return -1;
+        int index = (int) (m_tick & ((1 << LEVEL0_BITS) - 1));
+        int next = next_bit (index, 1 << LEVEL0_BITS);
+        if (next >= 0)
+            return m_tick - index + next;
+
+        //  Level 0 slots before index are for the next round
+        int64_t deadline = -1;
+        next = next_bit (0, index);
+        if (next >= 0)
+            deadline = m_tick - index + (1 << LEVEL0_BITS) + next;
+
+        //  Higher levels are due when their next busy slot cascades; the
+        //  current slot too, if its round starts at m_tick
+        for (int level = 1; level < LEVELS; level++) {
+            int shift = level_shift (level);
+            int current = (int) ((m_tick >> shift) & ((1 << LEVEL_BITS) - 1));
+            int first = (m_tick & ((1LL << shift) - 1)) == 0? 0: 1;
+            for (int ahead = first; ahead < first + (1 << LEVEL_BITS); ahead++) {
+                int slot = level_slot (level, (current + ahead) & ((1 << LEVEL_BITS) - 1));
+                if (m_bits [slot / 64] & (1ULL << (slot % 64))) {
+                    int64_t when = ((m_tick >> shift) + ahead) << shift;
+                    if (deadline < 0 || when < deadline)
+                        deadline = when;
+                    break;
+                }
+            }
+        }
+        return deadline;
+    }
+
+    //  First busy level 0 slot in [from, to), or -1
+    int
+    next_bit (int from, int to)
+    {
+        for (int slot = from; slot < to; ) {
+            uint64_t word = m_bits [slot / 64] >> (slot % 64);
+            if (word == 0) {
+                slot = (slot / 64 + 1) * 64;
+                continue;
+            }
+            int found = slot + lowest_bit (word);
+            return found < to? found: -1;
+        }
+        return -1;
+    }
+
+    static int
+    lowest_bit (uint64_t word)
+    {
+#if defined (__GNUC__)
+        return __builtin_ctzll (word);
+#else
+        int bit = 0;
+        while (!(word & 1)) {
+            word >>= 1;
+            bit++;
+        }
+        return bit;
+#endif
+    }
+
+    static int level_shift (int level) {
+        return LEVEL0_BITS + (level - 1) * LEVEL_BITS;
+    }
+    static int level_slot (int level, int index) {
+        return (1 << LEVEL0_BITS) + (level - 1) * (1 << LEVEL_BITS) + index;
+    }
+
+    std::vector<reader_entry *> m_readers;
+    std::vector<zmq::pollitem_t> m_items;   //  One per reader, same order
+    bool m_dirty;                           //  Readers changed since we built items
+    zspin *m_spin;                          //  Busy-poll first, if set
+
+    std::map<int, timer_entry*> m_timers;       //  All timers, by id
+    timer_entry m_slots [SLOTS];                //  List heads
+    uint64_t m_bits [(SLOTS + 63) / 64];    //  Busy slots
+    int64_t m_tick;                         //  Next msec to process
+    int64_t m_now;                          //  Time we are advancing to
+    bool m_firing;                          //  Inside fire()
+    timer_entry *m_current;                     //  Timer whose handler is running
+    int m_last_id;
+};
+
+#endif
@@ -0,0 +1,378 @@
+#ifndef __ZMETRICS_HPP_INCLUDED__
+#define __ZMETRICS_HPP_INCLUDED__
+
+//  Metrics registry, served in Prometheus text format
+//
+//  The application thread updates counters, gauges and histograms; a side
+//  thread serves them over HTTP from a ZMQ_STREAM socket. Every metric has
+//  a single writer, so an update is a relaxed load and store, and a scrape
+//  only ever reads atomics. Metrics go on a lock-free list and are never
+//  removed, so registering one never waits for a scrape either.
+
+#include "zhelpers.hpp"
+#include "zhistogram.hpp"
+
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <algorithm>
+
+//  A counter that only goes up, updated by one thread
+class zcounter {
+public:
+    zcounter () : m_value (0) {}
+
+    void inc (uint64_t amount = 1) {
+        m_value.store (m_value.load (std::memory_order_relaxed) + amount,
+                       std::memory_order_relaxed);
+    }
+    void operator++ (int) {
+        inc ();
+    }
+    operator uint64_t () const {
+        return m_value.load (std::memory_order_relaxed);
+    }
+
+private:
+    std::atomic<uint64_t> m_value;
+};
+
+//  A value that goes up and down, updated by one thread
+class zgauge {
+public:
+    zgauge () : m_value (0) {}
+
+    void set (int64_t value) {
+        m_value.store (value, std::memory_order_relaxed);
+    }
+    operator int64_t () const {
+        return m_value.load (std::memory_order_relaxed);
+    }
+
+private:
+    std::atomic<int64_t> m_value;
+};
+
+class zmetrics {
+public:
+    zmetrics ()
+    {
+        m_head.store (0);
+        m_stop.store (false);
+        m_thread = 0;
+    }
+
+    ~zmetrics ()
+    {
+        stop ();
+        metric *next = m_head.load ();
+        while (next) {
+            metric *current = next;
+            next = current->m_next;
+            delete current;
+        }
+    }
+
+    //  --------------------------------------------------------------------------
+    //  Register a metric. The caller keeps ownership and must keep it alive
+    //  as long as the registry. Labels use Prometheus syntax without the
+    //  braces, see label(). Histograms are exported in base units: scale
+    //  converts what was recorded, e.g. 1e-9 for nanoseconds to seconds.
+
+    void add (std::string name, std::string help, std::string labels,
+              zcounter *counter)
+    {
+        push (new metric (name, help, labels, "counter", counter, 0, 0, 0));
+    }
+
+    void add (std::string name, std::string help, std::string labels,
+              zgauge *gauge)
+    {
+        push (new metric (name, help, labels, "gauge", 0, gauge, 0, 0));
+    }
+
+    void add (std::string name, std::string help, std::string labels,
+              zhistogram *histogram, double scale)
+    {
+        push (new metric (name, help, labels, "histogram", 0, 0, histogram, scale));
+    }
+
+    //  Format one label, escaping the value
+    static std::string
+    label (std::string name, std::string value)
+    {
+        std::string escaped;
+        for (size_t index = 0; index < value.size (); index++) {
+            if (value [index] == '\\' || value [index] == '"')
+                escaped += '\\';
+            if (value [index] == '\n')
+                escaped += "\\n";
+            else
+                escaped += value [index];
+        }
+        return name + "=\"" + escaped + "\"";
+    }
+
+    //  --------------------------------------------------------------------------
+    //  Write all metrics in Prometheus text exposition format
+
+    void write (std::ostream &out)
+    {
+        //  Metrics of one name must be together, under one HELP and TYPE
+        std::vector<metric *> metrics;
+        for (metric *item = m_head.load (std::memory_order_acquire); item; item = item->m_next)
+            metrics.push_back (item);
+        std::reverse (metrics.begin (), metrics.end ());
+        std::stable_sort (metrics.begin (), metrics.end (), by_name);
+
+        for (size_t index = 0; index < metrics.size (); index++) {
+            metric *item = metrics [index];
+            if (index == 0 || item->m_name != metrics [index - 1]->m_name) {
+                out << "# HELP " << item->m_name << " " << item->m_help << "\n";
+                out << "# TYPE " << item->m_name << " " << item->m_type << "\n";
+            }
+            std::string labels = item->m_labels.size ()? "{" + item->m_labels + "}": "";
+            if (item->m_counter)
+                out << item->m_name << labels << " " << (uint64_t) *item->m_counter << "\n";
+            else
+            if (item->m_gauge)
+                out << item->m_name << labels << " " << (int64_t) *item->m_gauge << "\n";
+            else
+                write_histogram (out, item);
+        }
+    }
+
+    //  --------------------------------------------------------------------------
+    //  Serve metrics over HTTP on endpoint, e.g. "tcp://*:9555", from a side
+    //  thread with its own context
+
+    void serve (std::string endpoint)
+    {
+        assert (!m_thread);
+        m_endpoint = endpoint;
+        m_thread = new std::thread (&zmetrics::server, this);
+    }
+
+    void stop ()
+    {
+        if (m_thread) {
+            m_stop.store (true);
+            m_thread->join ();
+            delete m_thread;
+            m_thread = 0;
+        }
+    }
+
+private:
+    struct metric {
+        std::string m_name;
+        std::string m_help;
+        std::string m_labels;
+        const char *m_type;
+        zcounter *m_counter;            //  Exactly one of these is set
+        zgauge *m_gauge;
+        zhistogram *m_histogram;
+        double m_scale;
+        metric *m_next;
+
+        metric (std::string name, std::string help, std::string labels,
+                const char *type, zcounter *counter, zgauge *gauge,
+                zhistogram *histogram, double scale)
+        {
+            m_name = name;
+            m_help = help;
+            m_labels = labels;
+            m_type = type;
+            m_counter = counter;
+            m_gauge = gauge;
+            m_histogram = histogram;
+            m_scale = scale;
+            m_next = 0;
+        }
+    };
+
+    static bool by_name (const metric *left, const metric *right)
+    {
+        return left->m_name < right->m_name;
+    }
+
+    void push (metric *item)
+    {
+        item->m_next = m_head.load (std::memory_order_relaxed);
+        while (!m_head.compare_exchange_weak (item->m_next, item,
+                   std::memory_order_release, std::memory_order_relaxed))
+            ;
+    }
+
+    //  Histograms get fixed buckets from 10us to 10s, in base units.
+    //  Each bound is rounded to the nearest edge of our own buckets, so
+    //  counts are good to about 3%, and so is the sum.
+    void write_histogram (std::ostream &out, metric *item)
+    {
+        static const double bounds [] = {
+            0.00001, 0.00005, 0.0001, 0.0005, 0.001, 0.005,
+            0.01, 0.05, 0.1, 0.5, 1, 5, 10
+        };
+        static const int bound_count = sizeof (bounds) / sizeof (bounds [0]);
+        std::string labels = item->m_labels.size ()? item->m_labels + ",": "";
+
+        uint64_t count = 0;
+        double sum = 0;
+        int bound = 0;
+        for (int index = 0; index < zhistogram::BUCKETS; index++) {
+            double lowest = zhistogram::lowest_in (index) * item->m_scale;
+            while (bound < bound_count && lowest > bounds [bound]) {
+                out << item->m_name << "_bucket{" << labels << "le=\""
+                    << bounds [bound] << "\"} " << count << "\n";
+                bound++;
+            }
+            uint64_t in_bucket = item->m_histogram->count_in (index);
+            if (in_bucket) {
+                count += in_bucket;
+                sum += in_bucket * item->m_scale
+                    * (zhistogram::lowest_in (index) + zhistogram::highest_in (index)) / 2;
+            }
+        }
+        for (; bound < bound_count; bound++)
+            out << item->m_name << "_bucket{" << labels << "le=\""
+                << bounds [bound] << "\"} " << count << "\n";
+        out << item->m_name << "_bucket{" << labels << "le=\"+Inf\"} " << count << "\n";
+        labels = item->m_labels.size ()? "{" + item->m_labels + "}": "";
+        out << item->m_name << "_sum" << labels << " " << sum << "\n";
+        out << item->m_name << "_count" << labels << " " << count << "\n";
+    }
+
+    //  Answer every HTTP request with the metrics and close the connection;
+    //  ZMQ_STREAM gives us each connect and disconnect as an empty frame
+    void server ()
+    {
+        zmq::context_t context (1);
+        zmq::socket_t http (context, ZMQ_STREAM);
+        int linger = 0;
+        http.setsockopt (ZMQ_LINGER, &linger, sizeof (linger));
+        try {
+            http.bind (m_endpoint.c_str ());
+        }
+        catch (zmq::error_t &e) {
+            s_console ("E: cannot serve metrics on %s", m_endpoint.c_str ());
+            return;
+        }
+        while (!m_stop.load ()) {
+            zmq::pollitem_t items [] = {
+                { static_cast<void*>(http), 0, ZMQ_POLLIN, 0 } };
+            try {
+                zmq::poll (items, 1, 100);
+            }
+            catch (zmq::error_t &e) {
+                continue;       //  Interrupted by a signal
+            }
+            if (!(items [0].revents & ZMQ_POLLIN))
+                continue;
+
+            zmq::message_t identity;
+            zmq::message_t request;
+            http.recv (&identity);
+            http.recv (&request);
+            if (request.size () == 0)
+                continue;
+
+            std::stringstream body;
+            write (body);
+            std::stringstream response;
+            response << "HTTP/1.0 200 OK\r\n"
+                     << "Content-Type: text/plain; version=0.0.4\r\n"
+                     << "Content-Length: " << body.str ().size () << "\r\n"
+                     << "\r\n" << body.str ();
+            std::string text = response.str ();
+            zmq::message_t reply (text.data (), text.size ());
+            zmq::message_t peer;
+            peer.copy (&identity);
+            http.send (identity, ZMQ_SNDMORE);
+            http.send (reply);
+            //  Empty frame closes the connection
+            zmq::message_t close;
+            http.send (peer, ZMQ_SNDMORE);
+            http.send (close);
+        }
+    }
+
+    std::atomic<metric *> m_head;       //  Newest first
+    std::atomic<bool> m_stop;
+    std::thread *m_thread;
+    std::string m_endpoint;
+};
+
+
+//  Counts messages and bytes going through a zmq::proxy. Pass socket() as
+//  the proxy's capture socket: the proxy sends it a copy of every frame,
+//  which we count on a side thread, leaving the proxy loop untouched. The
+//  capture socket is a PUB, so a slow meter drops copies rather than
+//  holding up the proxy.
+
+class zcapture {
+public:
+    zcapture (zmq::context_t &context, zmetrics &metrics, std::string labels = "")
+        : m_context (context)
+    {
+        std::stringstream endpoint;
+        endpoint << "inproc://zcapture-" << (void *) this;
+        m_endpoint = endpoint.str ();
+        m_capture = new zmq::socket_t (context, ZMQ_PUB);
+        m_capture->bind (m_endpoint.c_str ());
+        m_stop.store (false);
+
+        metrics.add ("zmq_proxy_messages_total",
+            "Messages passed through the proxy, both ways", labels, &m_messages);
+        metrics.add ("zmq_proxy_bytes_total",
+            "Bytes passed through the proxy, both ways", labels, &m_bytes);
+        m_thread = new std::thread (&zcapture::meter, this);
+    }
+
+    ~zcapture ()
+    {
+        m_stop.store (true);
+        m_thread->join ();
+        delete m_thread;
+        delete m_capture;
+    }
+
+    void *socket ()
+    {
+        return static_cast<void*>(*m_capture);
+    }
+
+private:
+    void meter ()
+    {
+        zmq::socket_t copies (m_context, ZMQ_SUB);
+        copies.setsockopt (ZMQ_SUBSCRIBE, "", 0);
+        copies.connect (m_endpoint.c_str ());
+        while (!m_stop.load ()) {
+            zmq::pollitem_t items [] = {
+                { static_cast<void*>(copies), 0, ZMQ_POLLIN, 0 } };
+            try {
+                zmq::poll (items, 1, 100);
+            }
+            catch (zmq::error_t &e) {
+                continue;       //  Interrupted by a signal
+            }
+            if (items [0].revents & ZMQ_POLLIN) {
+                zmq::message_t frame;
+                copies.recv (&frame);
+                m_bytes.inc (frame.size ());
+                if (!frame.more ())
+                    m_messages++;
+            }
+        }
+    }
+
+    zmq::context_t &m_context;
+    zmq::socket_t *m_capture;           //  Given to the proxy
+    std::string m_endpoint;
+    zcounter m_messages;
+    zcounter m_bytes;
+    std::atomic<bool> m_stop;
+    std::thread *m_thread;
+};
+
+#endif
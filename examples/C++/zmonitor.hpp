@@ -0,0 +1,265 @@
+#ifndef __ZMONITOR_HPP_INCLUDED__
+#define __ZMONITOR_HPP_INCLUDED__
+
+//  Connection telemetry for any socket, from zmq_socket_monitor
+//
+//  A side thread reads the socket's monitor events and keeps counters per
+//  peer: connects, disconnects, connect retries and handshake failures,
+//  plus the number of live sessions. Histograms of handshake time and
+//  session length are kept per socket, as there may be many peers. It all
+//  goes into a zmetrics registry, written only by the monitor thread.
+//
+//  Peers we connected to are known by endpoint. Peers that connected to
+//  us are known by remote address without the port, so that a client
+//  reconnecting over and over shows up as one busy peer.
+
+#include "zmetrics.hpp"
+
+#include <map>
+#include <thread>
+
+#if (!defined (WIN32))
+#   include <sys/socket.h>
+#   include <netinet/in.h>
+#   include <arpa/inet.h>
+#endif
+
+class zmonitor {
+public:
+
+    //  --------------------------------------------------------------------------
+    //  Start monitoring socket, which must belong to context. Name tells
+    //  sockets apart in metrics. Create and destroy on the socket's thread,
+    //  and destroy before the socket is closed.
+
+    zmonitor (zmq::context_t &context, zmq::socket_t &socket, std::string name,
+              zmetrics &metrics, int verbose = 0)
+        : m_context (context), m_socket (socket), m_metrics (metrics)
+    {
+        m_name = name;
+        m_verbose = verbose;
+        std::string labels = zmetrics::label ("socket", m_name);
+        m_metrics.add ("zmq_handshake_seconds",
+            "Time from connect or accept to completed handshake",
+            labels, &m_handshake_time, 1e-9);
+        m_metrics.add ("zmq_session_seconds", "Time connections stayed up",
+            labels, &m_session_time, 1e-9);
+
+        std::stringstream endpoint;
+        endpoint << "inproc://zmonitor-" << (void *) this;
+        m_endpoint = endpoint.str ();
+        int rc = zmq_socket_monitor (static_cast<void*>(socket),
+                                     m_endpoint.c_str (), ZMQ_EVENT_ALL);
+        assert (rc == 0);
+        m_stop.store (false);
+        m_thread = new std::thread (&zmonitor::monitor, this);
+    }
+
+    //  Stopping the monitor makes it send MONITOR_STOPPED, which ends
+    //  our thread
+    ~zmonitor ()
+    {
+        zmq_socket_monitor (static_cast<void*>(m_socket), NULL, 0);
+        m_stop.store (true);
+        m_thread->join ();
+        delete m_thread;
+        while (!m_peers.empty ()) {
+            delete m_peers.begin ()->second;
+            m_peers.erase (m_peers.begin ());
+        }
+    }
+
+private:
+    //  Counters for one peer; they live as long as we do
+    struct peer {
+        zcounter m_connects;
+        zcounter m_disconnects;
+        zcounter m_retries;
+        zcounter m_failures;
+        zgauge m_sessions;
+    };
+
+    //  One live connection, by file descriptor
+    struct session {
+        peer *m_peer;
+        int64_t m_started;          //  s_clock_ns() at connect or accept
+    };
+
+    //  We also check m_stop, as the monitor drops MONITOR_STOPPED if we
+    //  have not connected by the time it is stopped
+    void monitor ()
+    {
+        zmq::socket_t events (m_context, ZMQ_PAIR);
+        int linger = 0;
+        events.setsockopt (ZMQ_LINGER, &linger, sizeof (linger));
+        events.connect (m_endpoint.c_str ());
+        while (!m_stop.load ()) {
+            zmq::pollitem_t items [] = {
+                { static_cast<void*>(events), 0, ZMQ_POLLIN, 0 } };
+            try {
+                zmq::poll (items, 1, 100);
+            }
+            catch (zmq::error_t &e) {
+                continue;               //  Interrupted by a signal
+            }
+            if (!(items [0].revents & ZMQ_POLLIN))
+                continue;
+
+            //  First frame is event number and value, second is endpoint
+            zmq::message_t header;
+            zmq::message_t address;
+            events.recv (&header);
+            if (header.more ())
+                events.recv (&address);
+            if (header.size () < 6)
+                continue;
+            uint16_t event;
+            int32_t value;
+            memcpy (&event, header.data (), sizeof (event));
+            memcpy (&value, (char *) header.data () + 2, sizeof (value));
+            std::string endpoint ((char *) address.data (), address.size ());
+            if (event == ZMQ_EVENT_MONITOR_STOPPED)
+                break;
+            handle (event, value, endpoint);
+        }
+    }
+
+    void handle (int event, int value, std::string endpoint)
+    {
+        int64_t now = s_clock_ns ();
+        if (m_verbose)
+            s_console ("I: %s socket: %s %s (%d)", m_name.c_str (),
+                event_name (event), endpoint.c_str (), value);
+
+        if (event == ZMQ_EVENT_CONNECTED || event == ZMQ_EVENT_ACCEPTED) {
+            //  Value is the new connection's file descriptor
+            peer *from = peer_require (event == ZMQ_EVENT_ACCEPTED?
+                                       remote_address (value, endpoint): endpoint);
+            from->m_connects++;
+            from->m_sessions.set (from->m_sessions + 1);
+            session &started = m_sessions [value];
+            started.m_peer = from;
+            started.m_started = now;
+        }
+        else
+        if (event == ZMQ_EVENT_DISCONNECTED) {
+            std::map<int, session>::iterator it = m_sessions.find (value);
+            peer *from = it != m_sessions.end ()? it->second.m_peer: peer_require (endpoint);
+            from->m_disconnects++;
+            if (it != m_sessions.end ()) {
+                from->m_sessions.set (from->m_sessions - 1);
+                m_session_time.record (now - it->second.m_started);
+                m_sessions.erase (it);
+            }
+        }
+        else
+        if (event == ZMQ_EVENT_CONNECT_RETRIED)
+            peer_require (endpoint)->m_retries++;
+        else
+        if (event == ZMQ_EVENT_ACCEPT_FAILED
+        ||  event == ZMQ_EVENT_BIND_FAILED)
+            peer_require (endpoint)->m_failures++;
+#if defined (ZMQ_EVENT_HANDSHAKE_SUCCEEDED)
+        else
+        if (event == ZMQ_EVENT_HANDSHAKE_SUCCEEDED) {
+            std::map<int, session>::iterator it = m_sessions.find (value);
+            if (it != m_sessions.end ())
+                m_handshake_time.record (now - it->second.m_started);
+        }
+        else
+        if (event == ZMQ_EVENT_HANDSHAKE_FAILED_NO_DETAIL
+        ||  event == ZMQ_EVENT_HANDSHAKE_FAILED_PROTOCOL
+        ||  event == ZMQ_EVENT_HANDSHAKE_FAILED_AUTH) {
+            //  Value is the error, not the descriptor
+            peer_require (endpoint)->m_failures++;
+        }
+#endif
+    }
+
+    //  Find or create a peer; only the monitor thread calls this
+    peer *peer_require (std::string address)
+    {
+        std::map<std::string, peer*>::iterator it = m_peers.find (address);
+        if (it != m_peers.end ())
+            return it->second;
+
+        peer *created = new peer ();
+        m_peers [address] = created;
+        std::string labels = zmetrics::label ("socket", m_name) + ","
+                           + zmetrics::label ("peer", address);
+        m_metrics.add ("zmq_peer_connects_total",
+            "Connections made or accepted", labels, &created->m_connects);
+        m_metrics.add ("zmq_peer_disconnects_total",
+            "Connections lost", labels, &created->m_disconnects);
+        m_metrics.add ("zmq_peer_retries_total",
+            "Connection attempts retried", labels, &created->m_retries);
+        m_metrics.add ("zmq_peer_failures_total",
+            "Failed accepts, binds and handshakes", labels, &created->m_failures);
+        m_metrics.add ("zmq_peer_sessions", "Live connections", labels,
+            &created->m_sessions);
+        return created;
+    }
+
+    //  Remote address of an accepted connection, or the endpoint we
+    //  accepted it on if we can't tell
+    static std::string remote_address (int fd, std::string endpoint)
+    {
+#if (!defined (WIN32))
+        struct sockaddr_storage address;
+        socklen_t size = sizeof (address);
+        if (getpeername (fd, (struct sockaddr *) &address, &size) == 0) {
+            char text [INET6_ADDRSTRLEN] = "";
+            if (address.ss_family == AF_INET)
+                inet_ntop (AF_INET, &((struct sockaddr_in *) &address)->sin_addr,
+                           text, sizeof (text));
+            else
+            if (address.ss_family == AF_INET6)
+                inet_ntop (AF_INET6, &((struct sockaddr_in6 *) &address)->sin6_addr,
+                           text, sizeof (text));
+            if (*text)
+                return std::string ("tcp://") + text;
+        }
+#endif
+        return endpoint;
+    }
+
+    static const char *event_name (int event)
+    {
+        switch (event) {
+            case ZMQ_EVENT_CONNECTED:       return "connected";
+            case ZMQ_EVENT_CONNECT_DELAYED: return "connect delayed";
+            case ZMQ_EVENT_CONNECT_RETRIED: return "connect retried";
+            case ZMQ_EVENT_LISTENING:       return "listening";
+            case ZMQ_EVENT_BIND_FAILED:     return "bind failed";
+            case ZMQ_EVENT_ACCEPTED:        return "accepted";
+            case ZMQ_EVENT_ACCEPT_FAILED:   return "accept failed";
+            case ZMQ_EVENT_CLOSED:          return "closed";
+            case ZMQ_EVENT_CLOSE_FAILED:    return "close failed";
+            case ZMQ_EVENT_DISCONNECTED:    return "disconnected";
+#if defined (ZMQ_EVENT_HANDSHAKE_SUCCEEDED)
+            case ZMQ_EVENT_HANDSHAKE_SUCCEEDED:         return "handshake succeeded";
+            case ZMQ_EVENT_HANDSHAKE_FAILED_NO_DETAIL:  return "handshake failed";
+            case ZMQ_EVENT_HANDSHAKE_FAILED_PROTOCOL:   return "handshake failed (protocol)";
+            case ZMQ_EVENT_HANDSHAKE_FAILED_AUTH:       return "handshake failed (auth)";
+#endif
+        }
+        return "unknown event";
+    }
+
+    zmq::context_t &m_context;
+    zmq::socket_t &m_socket;
+    zmetrics &m_metrics;
+    std::string m_name;
+    std::string m_endpoint;             //  Where the monitor publishes
+    int m_verbose;
+    std::atomic<bool> m_stop;
+    std::thread *m_thread;
+
+    //  Only touched by the monitor thread, until it ends
+    std::map<std::string, peer*> m_peers;
+    std::map<int, session> m_sessions;
+    zhistogram m_handshake_time;        //  nsecs
+    zhistogram m_session_time;          //  nsecs
+};
+
+#endif
@@ -2,6 +2,7 @@
 #define __ZMSG_H_INCLUDED__
 
 #include "zhelpers.hpp"
+#include "zprobes.hpp"
 
 #include <vector>
 #include <string>
@@ -58,6 +59,7 @@ public:
 
    bool recv(zmq::socket_t & socket) {
       clear();
+      size_t bytes = 0;         //  For the probe; we count as we go
       while(1) {
          zmq::message_t message(0);
          try {
@@ -77,14 +79,17 @@ public:
          else {
             m_part_data.push_back(ustring((unsigned char*) message.data(), message.size()));
          }
+         bytes += m_part_data.back().size();
          if (!message.more()) {
             break;
          }
       }
+      ZPROBE2 (zmsg_recv, m_part_data.size(), bytes);
       return true;
    }
 
    void send(zmq::socket_t & socket) {
+       size_t bytes = 0;        //  For the probe; we count as we go
        for (size_t part_nbr = 0; part_nbr < m_part_data.size(); part_nbr++) {
           zmq::message_t message;
           ustring data = m_part_data[part_nbr];
@@ -98,12 +103,14 @@ public:
              message.rebuild(data.size());
              memcpy(message.data(), data.c_str(), data.size());
           }
+          bytes += data.size();
           try {
              socket.send(message, part_nbr < m_part_data.size() - 1 ? ZMQ_SNDMORE : 0);
           } catch (zmq::error_t error) {
              assert(error.num()!=0);
           }
        }
+       ZPROBE2 (zmsg_send, m_part_data.size(), bytes);
        clear();
    }
 
@@ -111,6 +118,14 @@ public:
       return m_part_data.size();
    }
 
+   //  Total size of all parts, in bytes
+   size_t size() {
+      size_t bytes = 0;
+      for (size_t part_nbr = 0; part_nbr < m_part_data.size(); part_nbr++)
+         bytes += m_part_data [part_nbr].size();
+      return bytes;
+   }
+
    void body_set(const char *body) {
       if (m_part_data.size() > 0) {
          m_part_data.erase(m_part_data.end()-1);
@@ -149,6 +164,15 @@ public:
       m_part_data.push_back((unsigned char*)part);
    }
 
+   //  Binary parts, as pop_front() returns them; these may hold zeros
+   void push_front(ustring const &part) {
+      m_part_data.insert(m_part_data.begin(), part);
+   }
+
+   void push_back(ustring const &part) {
+      m_part_data.push_back(part);
+   }
+
    //  --------------------------------------------------------------------------
    //  Formats 17-byte UUID as 33-char string starting with '@'
    //  Lets us print UUIDs as C strings and use them as addresses
@@ -245,10 +269,12 @@ public:
       return addr;
    }
 
-   void dump() {
-      std::cerr << "--------------------------------------" << std::endl;
+   //  Message as dump() prints it, one line per part
+   std::string describe() {
+      std::stringstream out;
+      out << "--------------------------------------" << std::endl;
       for (unsigned int part_nbr = 0; part_nbr < m_part_data.size(); part_nbr++) {
-          ustring data = m_part_data [part_nbr];
+          ustring &data = m_part_data [part_nbr];
 
           // Dump the message as text or binary
           int is_text = 1;
@@ -256,16 +282,21 @@ public:
               if (data [char_nbr] < 32 || data [char_nbr] > 127)
                   is_text = 0;
 
-          std::cerr << "[" << std::setw(3) << std::setfill('0') << (int) data.size() << "] ";
+          out << "[" << std::dec << std::setw(3) << std::setfill('0') << (int) data.size() << "] ";
           for (unsigned int char_nbr = 0; char_nbr < data.size(); char_nbr++) {
               if (is_text) {
-                  std::cerr << (char) data [char_nbr];
+                  out << (char) data [char_nbr];
               } else {
-                  std::cerr << std::hex << std::setw(2) << std::setfill('0') << (short int) data [char_nbr];
+                  out << std::hex << std::setw(2) << std::setfill('0') << (short int) data [char_nbr];
               }
           }
-          std::cerr << std::endl;
+          out << std::endl;
       }
+      return out.str();
+   }
+
+   void dump() {
+      std::cerr << describe();
    }
 
    static int
@@ -0,0 +1,410 @@
+//
+//  Microbenchmarks for zmsg and the zhelpers string helpers
+//
+//  Times each operation in isolation, over an inproc PAIR where sockets
+//  are involved, in the style of Google Benchmark: each benchmark runs
+//  with more and more iterations until one run takes long enough, and
+//  reports that run. Alongside the time per operation we count heap
+//  allocations per operation, by replacing the global operator new. That
+//  sees everything std::string, std::vector and new[] allocate, but not
+//  what libzmq gets from malloc, so the raw_ benchmarks give the baseline
+//  to compare zmsg against.
+//
+//  Syntax: zmsgbench [-f filter] [-t msecs] [-j file.json]
+//  Filter picks benchmarks whose names contain it.
+//
+#include "zmsg.hpp"
+
+#include <atomic>
+#include <new>
+#include <vector>
+#include <fstream>
+
+//  Every heap allocation goes through here
+static std::atomic<uint64_t> s_allocs (0);
+static std::atomic<uint64_t> s_alloc_bytes (0);
+
+void *operator new (size_t size)
+{
+    s_allocs.fetch_add (1, std::memory_order_relaxed);
+    s_alloc_bytes.fetch_add (size, std::memory_order_relaxed);
+    void *block = malloc (size? size: 1);
+    if (!block)
+        throw std::bad_alloc ();
+    return block;
+}
+
+void operator delete (void *block) noexcept
+{
+    free (block);
+}
+
+//  ---------------------------------------------------------------------
+//  Benchmark state, which times a run and counts its allocations. A
+//  benchmark can pause while it sets up the next batch of work.
+
+class bench_state {
+public:
+    bench_state (int64_t iterations)
+    {
+        m_iterations = iterations;
+        m_elapsed = 0;
+        m_allocs = 0;
+        m_bytes = 0;
+        resume ();
+    }
+    int64_t iterations ()
+    {
+        return m_iterations;
+    }
+    void pause ()
+    {
+        m_elapsed += s_clock_ns () - m_started;
+        m_allocs += s_allocs.load () - m_allocs_at;
+        m_bytes += s_alloc_bytes.load () - m_bytes_at;
+    }
+    void resume ()
+    {
+        m_allocs_at = s_allocs.load ();
+        m_bytes_at = s_alloc_bytes.load ();
+        m_started = s_clock_ns ();
+    }
+    int64_t m_iterations;
+    int64_t m_elapsed;          //  nsecs
+    uint64_t m_allocs;
+    uint64_t m_bytes;
+
+private:
+    int64_t m_started;
+    uint64_t m_allocs_at;
+    uint64_t m_bytes_at;
+};
+
+//  Sockets for the benchmarks that send, over inproc
+static zmq::socket_t *s_sender;
+static zmq::socket_t *s_receiver;
+
+//  A typical MDP request as it leaves a client, in five parts
+static size_t s_mdp_sizes [] = { 0, 6, 1, 4, 11 };
+
+static void
+s_mdp_request (zmsg &msg)
+{
+    msg.body_set ("Hello world");
+    msg.push_front ((char*)"echo");
+    msg.push_front ((char*)"\001");
+    msg.push_front ((char*)"MDPC01");
+    msg.push_front ((char*)"");
+}
+
+//  Receive and discard a message, without zmsg
+static void
+s_drain (zmq::socket_t &socket)
+{
+    zmq::message_t message;
+    do
+        socket.recv (&message);
+    while (message.more ());
+}
+
+//  A binary identity, as ROUTER sockets used to generate them
+static unsigned char s_uuid [17] = {
+    0, 0x12, 0x34, 0x56, 0x78, 0x9a, 0xbc, 0xde, 0xf0,
+    0x0f, 0xed, 0xcb, 0xa9, 0x87, 0x65, 0x43, 0x21 };
+
+//  ---------------------------------------------------------------------
+//  zmsg in memory
+
+static void
+bench_zmsg_push_front (bench_state &state)
+{
+    for (int64_t count = 0; count < state.iterations (); count++) {
+        zmsg msg;
+        s_mdp_request (msg);
+    }
+}
+
+//  These work on batches of messages made while the clock is paused
+
+#define BATCH_SIZE  1000
+
+static void
+bench_zmsg_pop_front (bench_state &state)
+{
+    std::vector<zmsg *> batch (BATCH_SIZE);
+    for (int64_t done = 0; done < state.iterations (); done += BATCH_SIZE) {
+        int64_t size = std::min<int64_t> (BATCH_SIZE, state.iterations () - done);
+        state.pause ();
+        for (int64_t index = 0; index < size; index++) {
+            batch [index] = new zmsg ();
+            s_mdp_request (*batch [index]);
+        }
+        state.resume ();
+        for (int64_t index = 0; index < size; index++)
+            while (batch [index]->parts ())
+                batch [index]->pop_front ();
+        state.pause ();
+        for (int64_t index = 0; index < size; index++)
+            delete batch [index];
+        state.resume ();
+    }
+}
+
+static void
+bench_zmsg_wrap (bench_state &state)
+{
+    std::vector<zmsg *> batch (BATCH_SIZE);
+    for (int64_t done = 0; done < state.iterations (); done += BATCH_SIZE) {
+        int64_t size = std::min<int64_t> (BATCH_SIZE, state.iterations () - done);
+        state.pause ();
+        for (int64_t index = 0; index < size; index++)
+            batch [index] = new zmsg ("Hello world");
+        state.resume ();
+        for (int64_t index = 0; index < size; index++)
+            batch [index]->wrap ("client-address", "");
+        state.pause ();
+        for (int64_t index = 0; index < size; index++)
+            delete batch [index];
+        state.resume ();
+    }
+}
+
+static void
+bench_zmsg_unwrap (bench_state &state)
+{
+    std::vector<zmsg *> batch (BATCH_SIZE);
+    for (int64_t done = 0; done < state.iterations (); done += BATCH_SIZE) {
+        int64_t size = std::min<int64_t> (BATCH_SIZE, state.iterations () - done);
+        state.pause ();
+        for (int64_t index = 0; index < size; index++) {
+            batch [index] = new zmsg ("Hello world");
+            batch [index]->wrap ("client-address", "");
+        }
+        state.resume ();
+        for (int64_t index = 0; index < size; index++)
+            batch [index]->unwrap ();
+        state.pause ();
+        for (int64_t index = 0; index < size; index++)
+            delete batch [index];
+        state.resume ();
+    }
+}
+
+static void
+bench_zmsg_encode_uuid (bench_state &state)
+{
+    for (int64_t count = 0; count < state.iterations (); count++) {
+        char *uuidstr = zmsg::encode_uuid (s_uuid);
+        delete [] uuidstr;
+    }
+}
+
+static void
+bench_zmsg_decode_uuid (bench_state &state)
+{
+    char *uuidstr = zmsg::encode_uuid (s_uuid);
+    for (int64_t count = 0; count < state.iterations (); count++) {
+        unsigned char *uuid = zmsg::decode_uuid (uuidstr);
+        delete [] uuid;
+    }
+    delete [] uuidstr;
+}
+
+//  ---------------------------------------------------------------------
+//  Over inproc; each iteration sends one message and receives it
+
+static void
+bench_raw_send_recv (bench_state &state)
+{
+    for (int64_t count = 0; count < state.iterations (); count++) {
+        for (int part = 0; part < 5; part++) {
+            zmq::message_t message (s_mdp_sizes [part]);
+            s_sender->send (message, part < 4? ZMQ_SNDMORE: 0);
+        }
+        s_drain (*s_receiver);
+    }
+}
+
+static void
+bench_zmsg_send (bench_state &state)
+{
+    for (int64_t count = 0; count < state.iterations (); count++) {
+        zmsg msg;
+        s_mdp_request (msg);
+        msg.send (*s_sender);
+        s_drain (*s_receiver);
+    }
+}
+
+static void
+bench_zmsg_recv (bench_state &state)
+{
+    for (int64_t count = 0; count < state.iterations (); count++) {
+        for (int part = 0; part < 5; part++) {
+            zmq::message_t message (s_mdp_sizes [part]);
+            s_sender->send (message, part < 4? ZMQ_SNDMORE: 0);
+        }
+        zmsg msg (*s_receiver);
+    }
+}
+
+static void
+bench_zmsg_send_uuid (bench_state &state)
+{
+    char *uuidstr = zmsg::encode_uuid (s_uuid);
+    for (int64_t count = 0; count < state.iterations (); count++) {
+        zmsg msg ("Hello world");
+        msg.wrap (uuidstr, "");
+        msg.send (*s_sender);
+        s_drain (*s_receiver);
+    }
+    delete [] uuidstr;
+}
+
+static void
+bench_zmsg_recv_uuid (bench_state &state)
+{
+    for (int64_t count = 0; count < state.iterations (); count++) {
+        zmq::message_t address (s_uuid, sizeof (s_uuid));
+        s_sender->send (address, ZMQ_SNDMORE);
+        zmq::message_t body (11);
+        s_sender->send (body);
+        zmsg msg (*s_receiver);
+    }
+}
+
+//  ---------------------------------------------------------------------
+//  zhelpers string helpers
+
+static void
+bench_s_send_recv (bench_state &state)
+{
+    std::string text ("Hello world");
+    for (int64_t count = 0; count < state.iterations (); count++) {
+        s_send (*s_sender, text);
+        std::string received = s_recv (*s_receiver);
+    }
+}
+
+static void
+bench_s_sendmore (bench_state &state)
+{
+    std::string address ("client-address");
+    std::string text ("Hello world");
+    for (int64_t count = 0; count < state.iterations (); count++) {
+        s_sendmore (*s_sender, address);
+        s_send (*s_sender, text);
+        s_drain (*s_receiver);
+    }
+}
+
+//  ---------------------------------------------------------------------
+//  Harness
+
+typedef struct {
+    const char *name;
+    void (*function) (bench_state &);
+} benchmark_t;
+
+static benchmark_t s_benchmarks [] = {
+    { "zmsg_push_front", bench_zmsg_push_front },
+    { "zmsg_pop_front", bench_zmsg_pop_front },
+    { "zmsg_wrap", bench_zmsg_wrap },
+    { "zmsg_unwrap", bench_zmsg_unwrap },
+    { "zmsg_encode_uuid", bench_zmsg_encode_uuid },
+    { "zmsg_decode_uuid", bench_zmsg_decode_uuid },
+    { "raw_send_recv", bench_raw_send_recv },
+    { "zmsg_send", bench_zmsg_send },
+    { "zmsg_recv", bench_zmsg_recv },
+    { "zmsg_send_uuid", bench_zmsg_send_uuid },
+    { "zmsg_recv_uuid", bench_zmsg_recv_uuid },
+    { "s_send_recv", bench_s_send_recv },
+    { "s_sendmore", bench_s_sendmore }
+};
+
+//  Run with ten times the iterations until a run takes at least
+//  min_ns, or is on course to, then report that run
+static void
+s_run (benchmark_t &benchmark, int64_t min_ns, std::ostream *json, bool first)
+{
+    int64_t iterations = 1;
+    bench_state *state;
+    while (true) {
+        state = new bench_state (iterations);
+        benchmark.function (*state);
+        state->pause ();
+        if (state->m_elapsed >= min_ns || iterations >= 1000000000)
+            break;
+        //  Aim straight for min_ns once a run is long enough to trust
+        int64_t next = state->m_elapsed > min_ns / 100
+                     ? (int64_t) (iterations * 1.4 * min_ns / state->m_elapsed)
+                     : iterations * 10;
+        iterations = next > iterations? next: iterations + 1;
+        delete state;
+    }
+    double ns_per_op = (double) state->m_elapsed / iterations;
+    double allocs_per_op = (double) state->m_allocs / iterations;
+    double bytes_per_op = (double) state->m_bytes / iterations;
+    std::cout << std::left << std::setw (20) << benchmark.name << std::right
+              << std::setw (10) << std::fixed << std::setprecision (1) << ns_per_op << " ns"
+              << std::setw (12) << iterations
+              << std::setw (10) << std::setprecision (2) << allocs_per_op
+              << std::setw (10) << std::setprecision (0) << bytes_per_op
+              << std::endl;
+    if (json)
+        *json << (first? "": ",\n") << "  {\"name\": \"" << benchmark.name << "\""
+              << ", \"iterations\": " << iterations
+              << ", \"ns_per_op\": " << std::setprecision (1) << ns_per_op
+              << ", \"allocs_per_op\": " << std::setprecision (2) << allocs_per_op
+              << ", \"bytes_per_op\": " << std::setprecision (0) << bytes_per_op << "}";
+    delete state;
+}
+
+int main (int argc, char *argv [])
+{
+    s_version_assert (4, 0);
+
+    std::string filter;
+    int msecs = 500;
+    std::string json_file;
+    for (int argn = 1; argn + 1 < argc; argn += 2) {
+        std::string option = argv [argn];
+        if (option == "-f") filter = argv [argn + 1];
+        else if (option == "-t") msecs = atoi (argv [argn + 1]);
+        else if (option == "-j") json_file = argv [argn + 1];
+        else {
+            std::cout << "syntax: zmsgbench [-f filter] [-t msecs] [-j file.json]"
+                      << std::endl;
+            return 1;
+        }
+    }
+
+    zmq::context_t context (1);
+    zmq::socket_t receiver (context, ZMQ_PAIR);
+    zmq::socket_t sender (context, ZMQ_PAIR);
+    receiver.bind ("inproc://zmsgbench");
+    sender.connect ("inproc://zmsgbench");
+    s_sender = &sender;
+    s_receiver = &receiver;
+
+    std::ofstream *json = 0;
+    if (json_file.size ()) {
+        json = new std::ofstream (json_file.c_str ());
+        *json << "[\n";
+    }
+    std::cout << std::left << std::setw (20) << "Benchmark" << std::right
+              << std::setw (13) << "Time" << std::setw (12) << "Iterations"
+              << std::setw (10) << "Allocs" << std::setw (10) << "Bytes" << std::endl;
+    bool first = true;
+    for (size_t index = 0; index < sizeof (s_benchmarks) / sizeof (s_benchmarks [0]); index++) {
+        if (filter.size () && std::string (s_benchmarks [index].name).find (filter) == std::string::npos)
+            continue;
+        s_run (s_benchmarks [index], (int64_t) msecs * 1000000, json, first);
+        first = false;
+    }
+    if (json) {
+        *json << "\n]\n";
+        delete json;
+    }
+    return 0;
+}
@@ -0,0 +1,429 @@
+#ifndef __ZPOOL_HPP_INCLUDED__
+#define __ZPOOL_HPP_INCLUDED__
+
+//  Worker thread pool for the multithreaded server pattern
+//
+//  Takes requests from a ROUTER socket and deals them out to worker
+//  threads, like zmq::proxy in front of a fixed set of REP workers, but
+//  the pool sizes itself: it adds a thread while requests wait for one,
+//  up to max_threads, and retires one when the threads have been mostly
+//  idle, down to min_threads.
+//
+//      zpool pool (context, handler, 2, 16);
+//      pool.run (frontend);                //  Until Ctrl-C, then drains
+//
+//  Workers are DEALER sockets, so each thread holds up to credit requests
+//  at a time and never waits for the dispatcher between them. A handler
+//  gets the request without its envelope, and may send any number of
+//  replies to it, including none.
+//
+//  Workers tell the dispatcher when they finish requests, and how long
+//  they spent on them; that is the busy time we size the pool by. Waiting
+//  requests are the backlog. When the backlog is full, we stop reading
+//  clients and leave them to queue in ZeroMQ.
+//
+//  When we are interrupted, we stop reading clients, finish the requests
+//  we hold, stop each thread once it's done, and join them all.
+//
+//  Worker threads are placed as zaffinity.hpp says.
+
+#include "zmsg.hpp"
+#include "zloop.hpp"
+#include "zmetrics.hpp"
+#include "zaffinity.hpp"
+
+#include <thread>
+#include <deque>
+
+#define ZPOOL_CREDIT    4           //  Requests a thread may hold at once
+#define ZPOOL_BACKLOG   1000        //  Requests we hold before we stop reading
+#define ZPOOL_TICK      100         //  msecs between load checks
+#define ZPOOL_WINDOW    50          //  Ticks we judge idleness over
+#define ZPOOL_IDLE      0.5         //  Retire a thread if less busy than this
+
+//  A worker thread, as its handler sees it
+class zpool_worker {
+public:
+    zpool_worker (zmq::socket_t &socket) : m_socket (socket) {}
+
+    //  Send a reply to the request we are handling
+    void reply (zmsg &reply)
+    {
+        for (size_t index = m_envelope.size (); index > 0; index--)
+            reply.push_front (m_envelope [index - 1]);
+        reply.send (m_socket);
+    }
+
+    void reply (const char *body)
+    {
+        zmsg message (body);
+        reply (message);
+    }
+
+private:
+    friend class zpool;
+    zmq::socket_t &m_socket;
+    std::vector<zmsg::ustring> m_envelope;  //  Return address of request
+};
+
+//  Handle one request; called on a worker thread
+typedef std::function<void (zmsg &request, zpool_worker &worker)> zpool_handler;
+
+class zpool {
+public:
+
+    //  ---------------------------------------------------------------------
+    //  Start the pool with min_threads threads
+
+    zpool (zmq::context_t &context, zpool_handler handler,
+           int min_threads, int max_threads, int credit = ZPOOL_CREDIT)
+        : m_context (context), m_handler (handler)
+    {
+        m_min = min_threads > 0? min_threads: 1;
+        m_max = max_threads > m_min? max_threads: m_min;
+        m_credit = credit > 0? credit: 1;
+        m_frontend = 0;
+        m_draining = false;
+        m_last_id = 0;
+        m_busy_ns = 0;
+        m_capacity_ns = 0;
+        m_ticks = 0;
+
+        std::stringstream endpoint;
+        endpoint << "inproc://zpool-" << (void *) this;
+        m_endpoint = endpoint.str ();
+        m_backend = new zmq::socket_t (context, ZMQ_ROUTER);
+        m_backend->bind (m_endpoint.c_str ());
+        while ((int) m_threads.size () < m_min)
+            spawn ();
+        m_live.set (m_min);
+    }
+
+    ~zpool ()
+    {
+        m_frontend = 0;
+        drain ();
+        delete m_backend;
+    }
+
+    //  ---------------------------------------------------------------------
+    //  Serve requests from frontend until interrupted, then drain
+
+    void
+    run (zmq::socket_t &frontend)
+    {
+        m_frontend = &frontend;
+        zloop loop;
+        loop.reader (frontend, [this, &loop] () {
+            m_pending.push_back (new zmsg (*m_frontend));
+            if (m_pending.size () >= ZPOOL_BACKLOG)
+                loop.reader_enable (*m_frontend, false);
+            dispatch ();
+            return 0;
+        }, 64);
+        loop.reader (*m_backend, [this, &loop] () {
+            from_worker ();
+            dispatch ();
+            if (m_pending.size () < ZPOOL_BACKLOG)
+                loop.reader_enable (*m_frontend, true);
+            return 0;
+        }, 64);
+        //  The timer also lets us see an interrupt that another thread got
+        loop.timer (ZPOOL_TICK, 0, [this] () {
+            return tick ();
+        });
+        loop.start ();
+        loop.reader_end (frontend);
+        loop.reader_end (*m_backend);
+        drain ();
+        m_frontend = 0;
+    }
+
+    //  ---------------------------------------------------------------------
+    //  Register our metrics, with the labels given
+
+    void
+    add_metrics (zmetrics &metrics, std::string labels)
+    {
+        metrics.add ("zpool_threads", "Worker threads running",
+                     labels, &m_live);
+        metrics.add ("zpool_backlog", "Requests waiting for a thread",
+                     labels, &m_backlog);
+        metrics.add ("zpool_requests_total", "Requests given to threads",
+                     labels, &m_requests);
+        metrics.add ("zpool_grown_total", "Threads added for backlog",
+                     labels, &m_grown);
+        metrics.add ("zpool_shrunk_total", "Threads retired for idleness",
+                     labels, &m_shrunk);
+    }
+
+    //  One line summary
+    std::string
+    report () const
+    {
+        std::stringstream out;
+        out << "threads=" << (int64_t) m_live << " backlog=" << (int64_t) m_backlog
+            << " requests=" << (uint64_t) m_requests
+            << " grown=" << (uint64_t) m_grown << " shrunk=" << (uint64_t) m_shrunk;
+        return out.str ();
+    }
+
+private:
+    //  A worker thread, as the dispatcher sees it
+    struct thread_entry {
+        std::string m_identity;
+        std::thread *m_thread;
+        int m_outstanding;              //  Requests given, not yet done
+        bool m_ready;                   //  Has said hello
+        bool m_retiring;                //  Told to stop, gets no more work
+    };
+
+    //  ---------------------------------------------------------------------
+    //  Worker thread: handle requests until told to stop. After each run of
+    //  requests we tell the dispatcher how many we did and how long we were
+    //  busy, which gives it back that much credit.
+
+    void
+    work (std::string identity)
+    {
+        zaffinity::global ().pin_next ();
+        zmq::socket_t socket (m_context, ZMQ_DEALER);
+        socket.setsockopt (ZMQ_IDENTITY, identity.c_str (), identity.size ());
+        socket.connect (m_endpoint.c_str ());
+        zmsg ready ("READY", socket);
+
+        zpool_worker worker (socket);
+        int done = 0;
+        int64_t busy = 0;
+        while (true) {
+            zmsg request;
+            if (!request.recv (socket))
+                break;                  //  Context is going away
+            if (request.parts () == 1 && strcmp (request.body (), "STOP") == 0)
+                break;
+
+            //  Envelope runs to the empty delimiter; without one, as from a
+            //  DEALER client, it's everything but the body
+            worker.m_envelope.clear ();
+            while (request.parts () > 1) {
+                worker.m_envelope.push_back (request.pop_front ());
+                if (worker.m_envelope.back ().empty ())
+                    break;
+            }
+            int64_t started = s_clock_ns ();
+            m_handler (request, worker);
+            busy += s_clock_ns () - started;
+            done++;
+
+            int events = 0;
+            size_t size = sizeof (events);
+            socket.getsockopt (ZMQ_EVENTS, &events, &size);
+            if (!(events & ZMQ_POLLIN)) {
+                zmsg credit;
+                credit.body_fmt ("DONE %d %lld", done, (long long) busy);
+                credit.send (socket);
+                done = 0;
+                busy = 0;
+            }
+        }
+        zmsg bye ("BYE", socket);
+    }
+
+    void
+    spawn ()
+    {
+        std::stringstream identity;
+        identity << "W" << ++m_last_id;
+        thread_entry *entry = new thread_entry;
+        entry->m_identity = identity.str ();
+        entry->m_outstanding = 0;
+        entry->m_ready = false;
+        entry->m_retiring = false;
+        entry->m_thread = new std::thread (&zpool::work, this, entry->m_identity);
+        m_threads.push_back (entry);
+    }
+
+    //  Ask a thread to stop; it finishes the requests it holds first
+    void
+    retire (thread_entry *entry)
+    {
+        zmsg stop ("STOP");
+        stop.push_front ((char *) entry->m_identity.c_str ());
+        stop.send (*m_backend);
+        entry->m_retiring = true;
+    }
+
+    //  ---------------------------------------------------------------------
+    //  Give waiting requests to the ready threads holding fewest
+
+    void
+    dispatch ()
+    {
+        while (!m_pending.empty ()) {
+            thread_entry *target = 0;
+            for (size_t index = 0; index < m_threads.size (); index++) {
+                thread_entry *entry = m_threads [index];
+                if (entry->m_ready && !entry->m_retiring
+                &&  entry->m_outstanding < m_credit
+                &&  (!target || entry->m_outstanding < target->m_outstanding))
+                    target = entry;
+            }
+            if (!target)
+                break;
+            zmsg *request = m_pending.front ();
+            m_pending.pop_front ();
+            request->push_front ((char *) target->m_identity.c_str ());
+            request->send (*m_backend);
+            delete request;
+            target->m_outstanding++;
+            m_requests++;
+        }
+        m_backlog.set (m_pending.size ());
+    }
+
+    //  ---------------------------------------------------------------------
+    //  Reply from a worker, which goes to the client, or a command
+
+    void
+    from_worker ()
+    {
+        zmsg msg (*m_backend);
+        std::string identity = (char *) msg.pop_front ().c_str ();
+        size_t index = 0;
+        while (index < m_threads.size () && m_threads [index]->m_identity != identity)
+            index++;
+        if (index == m_threads.size ())
+            return;
+        thread_entry *entry = m_threads [index];
+
+        if (msg.parts () > 1) {
+            if (m_frontend)
+                msg.send (*m_frontend);
+        }
+        else
+        if (strcmp (msg.body (), "READY") == 0) {
+            entry->m_ready = true;
+            if (m_draining)
+                retire (entry);
+        }
+        else
+        if (strncmp (msg.body (), "DONE ", 5) == 0) {
+            int done = 0;
+            long long busy = 0;
+            sscanf (msg.body () + 5, "%d %lld", &done, &busy);
+            entry->m_outstanding -= done;
+            m_busy_ns += busy;
+        }
+        else
+        if (strcmp (msg.body (), "BYE") == 0) {
+            entry->m_thread->join ();
+            delete entry->m_thread;
+            delete entry;
+            m_threads.erase (m_threads.begin () + index);
+            m_live.set (live ());
+        }
+    }
+
+    //  Threads that will take more work
+    int
+    live ()
+    {
+        int count = 0;
+        for (size_t index = 0; index < m_threads.size (); index++)
+            if (!m_threads [index]->m_retiring)
+                count++;
+        return count;
+    }
+
+    //  ---------------------------------------------------------------------
+    //  Size the pool: add a thread if requests are still waiting, and
+    //  retire one if the threads were mostly idle over the last window
+
+    int
+    tick ()
+    {
+        int threads = live ();
+        if (!m_pending.empty () && threads < m_max) {
+            spawn ();
+            threads++;
+            m_grown++;
+            m_busy_ns = m_capacity_ns = m_ticks = 0;
+        }
+        m_capacity_ns += (int64_t) threads * ZPOOL_TICK * 1000000;
+        if (++m_ticks >= ZPOOL_WINDOW) {
+            if (m_pending.empty () && threads > m_min
+            &&  m_busy_ns < m_capacity_ns * ZPOOL_IDLE) {
+                thread_entry *idlest = 0;
+                for (size_t index = 0; index < m_threads.size (); index++) {
+                    thread_entry *entry = m_threads [index];
+                    if (entry->m_ready && !entry->m_retiring
+                    &&  (!idlest || entry->m_outstanding < idlest->m_outstanding))
+                        idlest = entry;
+                }
+                if (idlest) {
+                    retire (idlest);
+                    threads--;
+                    m_shrunk++;
+                }
+            }
+            m_busy_ns = m_capacity_ns = m_ticks = 0;
+        }
+        m_live.set (threads);
+        return 0;
+    }
+
+    //  ---------------------------------------------------------------------
+    //  Finish the requests we hold, then stop and join every thread
+
+    void
+    drain ()
+    {
+        m_draining = true;
+        while (!m_threads.empty ()) {
+            dispatch ();
+            if (m_pending.empty ())
+                for (size_t index = 0; index < m_threads.size (); index++) {
+                    thread_entry *entry = m_threads [index];
+                    if (entry->m_ready && !entry->m_retiring)
+                        retire (entry);
+                }
+            zmq::pollitem_t items [] = {
+                { static_cast<void*>(*m_backend), 0, ZMQ_POLLIN, 0 } };
+            try {
+                zmq::poll (items, 1, ZPOOL_TICK);
+            }
+            catch (zmq::error_t &e) {
+                items [0].revents = 0;
+            }
+            if (items [0].revents & ZMQ_POLLIN)
+                from_worker ();
+        }
+        while (!m_pending.empty ()) {
+            delete m_pending.front ();
+            m_pending.pop_front ();
+        }
+    }
+
+    zmq::context_t &m_context;
+    zpool_handler m_handler;
+    int m_min;
+    int m_max;
+    int m_credit;
+    std::string m_endpoint;             //  Where workers connect
+    zmq::socket_t *m_backend;           //  ROUTER to workers
+    zmq::socket_t *m_frontend;          //  ROUTER to clients, while we run
+    std::vector<thread_entry *> m_threads;
+    std::deque<zmsg *> m_pending;       //  Requests waiting for a thread
+    bool m_draining;
+    int m_last_id;
+    int64_t m_busy_ns;                  //  Reported by threads, this window
+    int64_t m_capacity_ns;              //  Thread time available, this window
+    int m_ticks;
+    zgauge m_live;
+    zgauge m_backlog;
+    zcounter m_requests;
+    zcounter m_grown;
+    zcounter m_shrunk;
+};
+
+#endif
@@ -0,0 +1,38 @@
+#ifndef __ZPROBES_HPP_INCLUDED__
+#define __ZPROBES_HPP_INCLUDED__
+
+//  Static tracepoints (USDT) for perf and bpftrace
+//
+//  Where <sys/sdt.h> is available (install systemtap-sdt-dev or
+//  systemtap-sdt-devel), each ZPROBE compiles to a single nop plus a note
+//  in the ELF file, which a tracer patches into a breakpoint when it
+//  attaches. Nothing else runs until then, apart from working out the
+//  arguments, so keep those cheap. Elsewhere, or when built with
+//  -DZPROBES_DISABLE, probes compile to nothing at all.
+//
+//  All probes are in the 'zguide' provider; list them with
+//      bpftrace -l 'usdt:./mdbroker:zguide:*'
+//  and see the scripts in bpftrace/ for some uses.
+
+#if !defined (ZPROBES_DISABLE) && defined (__linux__) && defined (__has_include)
+#   if __has_include (<sys/sdt.h>)
+#       include <sys/sdt.h>
+#       define ZPROBES_ENABLED
+#   endif
+#endif
+
+#if defined (ZPROBES_ENABLED)
+#   define ZPROBE0(name)                    DTRACE_PROBE (zguide, name)
+#   define ZPROBE1(name,a)                  DTRACE_PROBE1 (zguide, name, a)
+#   define ZPROBE2(name,a,b)                DTRACE_PROBE2 (zguide, name, a, b)
+#   define ZPROBE3(name,a,b,c)              DTRACE_PROBE3 (zguide, name, a, b, c)
+#   define ZPROBE4(name,a,b,c,d)            DTRACE_PROBE4 (zguide, name, a, b, c, d)
+#else
+#   define ZPROBE0(name)
+#   define ZPROBE1(name,a)
+#   define ZPROBE2(name,a,b)
+#   define ZPROBE3(name,a,b,c)
+#   define ZPROBE4(name,a,b,c,d)
+#endif
+
+#endif
@@ -0,0 +1,176 @@
+#ifndef __ZRECORDER_HPP_INCLUDED__
+#define __ZRECORDER_HPP_INCLUDED__
+
+//  Flight recorder: a fixed-size ring holding compact headers of the last
+//  N messages seen on a socket. It costs a clock read and a few stores per
+//  message, so we can leave it on all the time and dump it when something
+//  goes wrong, instead of restarting with -v.
+//
+//  One thread records into a ring; any thread may dump it. Each slot has
+//  a sequence stamp which the writer makes odd while it fills the slot,
+//  so a reader skips slots it catches half-written instead of locking.
+
+#include "zhelpers.hpp"
+
+#include <atomic>
+#include <string.h>
+
+//  Set by SIGUSR1 once zrecorder::catch_signal() is called; the owner
+//  of the recorder should dump it and clear this
+static volatile sig_atomic_t s_recorder_dump = 0;
+
+static void s_recorder_signal (int signal_value)
+{
+    s_recorder_dump = 1;
+}
+
+class zrecorder {
+public:
+    enum {
+        IN = '<',                   //  Directions
+        OUT = '>',
+        PEER_MAX = 17,              //  Enough for a UUID identity
+        SERVICE_MAX = 23
+    };
+
+    //  Size is rounded up to a power of two
+    zrecorder (size_t size = 1024)
+    {
+        m_size = 1;
+        while (m_size < size)
+            m_size <<= 1;
+        m_slots = new slot [m_size];
+        for (size_t index = 0; index < m_size; index++)
+            m_slots [index].m_sequence.store (0, std::memory_order_relaxed);
+        m_head.store (0, std::memory_order_relaxed);
+    }
+
+    ~zrecorder ()
+    {
+        delete [] m_slots;
+    }
+
+    //  --------------------------------------------------------------------------
+    //  Record one message. Command must be a string constant, we only keep
+    //  the pointer; peer and service are truncated to fit.
+
+    void record (char direction, const std::string &peer, const char *command,
+                 const std::string &service, size_t parts, size_t bytes)
+    {
+        //  Only one thread records, so this needs no read-modify-write
+        uint64_t sequence = m_head.load (std::memory_order_relaxed);
+        slot &entry = m_slots [sequence & (m_size - 1)];
+        entry.m_sequence.store (sequence * 2 + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence (std::memory_order_release);
+
+        entry.m_time = s_clock_ns ();
+        entry.m_direction = direction;
+        entry.m_command = command;
+        entry.m_parts = (uint16_t) parts;
+        entry.m_bytes = (uint32_t) bytes;
+        entry.m_peer_size = (uint8_t) (peer.size () < PEER_MAX? peer.size (): PEER_MAX);
+        memcpy (entry.m_peer, peer.data (), entry.m_peer_size);
+        entry.m_service_size =
+            (uint8_t) (service.size () < SERVICE_MAX? service.size (): SERVICE_MAX);
+        memcpy (entry.m_service, service.data (), entry.m_service_size);
+
+        entry.m_sequence.store (sequence * 2 + 2, std::memory_order_release);
+        m_head.store (sequence + 1, std::memory_order_release);
+    }
+
+    //  --------------------------------------------------------------------------
+    //  Print recorded messages, oldest first, one per line. Times are in
+    //  usecs before now. Binary peer identities are printed in hex.
+
+    void dump (std::ostream &out)
+    {
+        int64_t now = s_clock_ns ();
+        uint64_t head = m_head.load (std::memory_order_acquire);
+        uint64_t sequence = head > m_size? head - m_size: 0;
+        for (; sequence < head; sequence++) {
+            slot &entry = m_slots [sequence & (m_size - 1)];
+            uint64_t stamp = entry.m_sequence.load (std::memory_order_acquire);
+            if (stamp != sequence * 2 + 2)
+                continue;       //  Being written, or overwritten already
+            slot copy;
+            copy.m_time = entry.m_time;
+            copy.m_direction = entry.m_direction;
+            copy.m_command = entry.m_command;
+            copy.m_parts = entry.m_parts;
+            copy.m_bytes = entry.m_bytes;
+            copy.m_peer_size = entry.m_peer_size;
+            memcpy (copy.m_peer, entry.m_peer, copy.m_peer_size);
+            copy.m_service_size = entry.m_service_size;
+            memcpy (copy.m_service, entry.m_service, copy.m_service_size);
+            std::atomic_thread_fence (std::memory_order_acquire);
+            if (entry.m_sequence.load (std::memory_order_relaxed) != stamp)
+                continue;       //  Overwritten while we copied it
+
+            out << "-" << (now - copy.m_time) / 1000 << "us "
+                << copy.m_direction << " "
+                << (copy.m_command? copy.m_command: "?")
+                << " service=" << std::string (copy.m_service, copy.m_service_size)
+                << " peer=" << printable (copy.m_peer, copy.m_peer_size)
+                << " parts=" << copy.m_parts
+                << " bytes=" << copy.m_bytes << "\n";
+        }
+    }
+
+    //  Messages recorded since we started, including those overwritten
+    uint64_t count ()
+    {
+        return m_head.load (std::memory_order_relaxed);
+    }
+
+    //  --------------------------------------------------------------------------
+    //  Set s_recorder_dump on SIGUSR1. This interrupts a blocking poll,
+    //  which the caller should expect.
+
+    static void catch_signal ()
+    {
+#if (!defined(WIN32))
+        struct sigaction action;
+        action.sa_handler = s_recorder_signal;
+        action.sa_flags = 0;
+        sigemptyset (&action.sa_mask);
+        sigaction (SIGUSR1, &action, NULL);
+#endif
+    }
+
+private:
+    static std::string printable (const char *data, size_t size)
+    {
+        bool is_text = true;
+        for (size_t index = 0; index < size; index++)
+            if ((unsigned char) data [index] < 32 || (unsigned char) data [index] > 127)
+                is_text = false;
+        if (is_text)
+            return std::string (data, size);
+
+        std::stringstream hex;
+        for (size_t index = 0; index < size; index++)
+            hex << std::hex << std::setw (2) << std::setfill ('0')
+                << (int) (unsigned char) data [index];
+        return hex.str ();
+    }
+
+    //  One recorded message
+    struct slot {
+        std::atomic<uint64_t> m_sequence;   //  Odd while being written
+        int64_t m_time;                     //  s_clock_ns() when recorded
+        const char *m_command;
+        uint32_t m_bytes;
+        uint16_t m_parts;
+        char m_direction;
+        uint8_t m_peer_size;
+        uint8_t m_service_size;
+        char m_peer [PEER_MAX];
+        char m_service [SERVICE_MAX];
+    };
+
+    slot *m_slots;
+    size_t m_size;
+    std::atomic<uint64_t> m_head;           //  Next sequence to write
+};
+
+#endif
@@ -0,0 +1,353 @@
+#ifndef __ZRING_HPP_INCLUDED__
+#define __ZRING_HPP_INCLUDED__
+
+//  Lock-free ring channels between threads of one process
+//
+//  An inproc socket carries each message through a libzmq pipe, and wakes
+//  the reader through its mailbox. Between two stages of one pipeline we
+//  can do with much less: a ring of pointers, written and read with one
+//  atomic store each, and a file descriptor to wake the reader only when
+//  it is waiting. zring_spsc has one writer and one reader; zring_mpsc has
+//  any number of writers and one reader.
+//
+//      zring_spsc<item_t *> ring (1024);
+//      ring.send (item);                   //  False if the ring is full
+//
+//      zmq::pollitem_t items [] = { { 0, ring.fd (), ZMQ_POLLIN, 0 } };
+//      while (true) {
+//          item_t *item;
+//          while (ring.recv (item))
+//              ...
+//          zmq::poll (items, 1, -1);       //  Or with sockets, or in a zloop
+//      }
+//
+//  A reader that finds the ring empty arms the wake-up, so the next send
+//  makes fd() readable. Read until recv() returns false before you poll
+//  again, or you may sleep with items waiting. While the reader is busy,
+//  writers make no system calls at all. send_batch() and recv_batch() move
+//  many items for one update of the shared indexes.
+//
+//  Rings carry plain values, usually pointers: pass messages from a pool
+//  and return them on a ring going the other way, and nothing is copied
+//  or allocated per message. Capacity is rounded up to a power of two.
+
+#include "zhelpers.hpp"
+
+#include <atomic>
+#include <unistd.h>
+
+#if defined (__linux__)
+#   include <sys/eventfd.h>
+#else
+#   include <fcntl.h>
+#endif
+
+//  Wakes the reader of a ring, through a descriptor zmq::poll can wait on
+class zring_waker {
+public:
+    zring_waker () : m_waiting (false)
+    {
+#if defined (__linux__)
+        m_fds [0] = m_fds [1] = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+        assert (m_fds [0] != -1);
+#else
+        int rc = pipe (m_fds);
+        assert (rc == 0);
+        fcntl (m_fds [0], F_SETFL, O_NONBLOCK);
+        fcntl (m_fds [1], F_SETFL, O_NONBLOCK);
+#endif
+    }
+
+    ~zring_waker ()
+    {
+        close (m_fds [0]);
+        if (m_fds [1] != m_fds [0])
+            close (m_fds [1]);
+    }
+
+    int fd () const {
+        return m_fds [0];
+    }
+
+    //  Writer: we published items; wake the reader if it's waiting
+    void wake ()
+    {
+        std::atomic_thread_fence (std::memory_order_seq_cst);
+        if (m_waiting.load (std::memory_order_relaxed)
+        &&  m_waiting.exchange (false)) {
+            uint64_t one = 1;
+            ssize_t rc = write (m_fds [1], &one, sizeof (one));
+            (void) rc;                  //  Full pipe is already readable
+        }
+    }
+
+    //  Reader: we found nothing, and will wait on fd(). The caller must
+    //  look at the ring once more afterwards, in case a writer got in first.
+    //  This also clears a late wake-up for items we have already taken.
+    void arm ()
+    {
+        clear ();
+        m_waiting.store (true);
+        std::atomic_thread_fence (std::memory_order_seq_cst);
+    }
+
+    //  Reader: we have items after all, or were woken
+    void disarm ()
+    {
+        m_waiting.store (false, std::memory_order_relaxed);
+    }
+
+private:
+    //  Read what writers wrote, so fd() is no longer readable
+    void clear ()
+    {
+        char buffer [64];
+        while (read (m_fds [0], buffer, sizeof (buffer)) > 0)
+            ;
+    }
+
+    std::atomic<bool> m_waiting;        //  Reader is, or is about to be, asleep
+    int m_fds [2];                      //  Read end, write end
+};
+
+//  Round up to a power of two
+static inline size_t
+s_ring_capacity (size_t wanted)
+{
+    size_t capacity = 2;
+    while (capacity < wanted)
+        capacity <<= 1;
+    return capacity;
+}
+
+//  ---------------------------------------------------------------------
+//  One writer, one reader. Each side keeps its index on a cache line of
+//  its own, with a copy of the other side's index that it refreshes only
+//  when the ring looks full, or empty, so the sides rarely touch each
+//  other's lines.
+
+template <typename T>
+class zring_spsc {
+public:
+    zring_spsc (size_t capacity)
+    {
+        m_mask = s_ring_capacity (capacity) - 1;
+        m_items = new T [m_mask + 1];
+        m_head.store (0);
+        m_tail.store (0);
+        m_head_cache = 0;
+        m_tail_cache = 0;
+        m_armed = false;
+    }
+
+    ~zring_spsc ()
+    {
+        delete [] m_items;
+    }
+
+    int fd () const {
+        return m_waker.fd ();
+    }
+
+    //  Writer: add an item, or return false if the ring is full
+    bool send (const T &item)
+    {
+        return send_batch (&item, 1) == 1;
+    }
+
+    //  Writer: add up to count items; returns how many went in
+    size_t send_batch (const T *items, size_t count)
+    {
+        uint64_t head = m_head.load (std::memory_order_relaxed);
+        if (head + count - m_tail_cache > m_mask + 1) {
+            m_tail_cache = m_tail.load (std::memory_order_acquire);
+            if (head + count - m_tail_cache > m_mask + 1)
+                count = (size_t) (m_mask + 1 - (head - m_tail_cache));
+        }
+        if (count == 0)
+            return 0;
+        for (size_t index = 0; index < count; index++)
+            m_items [(head + index) & m_mask] = items [index];
+        m_head.store (head + count, std::memory_order_release);
+        m_waker.wake ();
+        return count;
+    }
+
+    //  Reader: take the oldest item, or return false if the ring is empty
+    bool recv (T &item)
+    {
+        return recv_batch (&item, 1) == 1;
+    }
+
+    //  Reader: take up to count items; returns how many we took
+    size_t recv_batch (T *items, size_t count)
+    {
+        uint64_t tail = m_tail.load (std::memory_order_relaxed);
+        if (m_head_cache == tail) {
+            m_head_cache = m_head.load (std::memory_order_acquire);
+            if (m_head_cache == tail) {
+                //  Empty: arm the wake-up, then look once more
+                m_waker.arm ();
+                m_armed = true;
+                m_head_cache = m_head.load (std::memory_order_acquire);
+                if (m_head_cache == tail)
+                    return 0;
+            }
+        }
+        if (m_armed) {
+            m_waker.disarm ();
+            m_armed = false;
+        }
+        if (count > m_head_cache - tail)
+            count = (size_t) (m_head_cache - tail);
+        for (size_t index = 0; index < count; index++)
+            items [index] = m_items [(tail + index) & m_mask];
+        m_tail.store (tail + count, std::memory_order_release);
+        return count;
+    }
+
+private:
+    //  Writer's cache line, then reader's
+    char m_pad1 [64];
+    std::atomic<uint64_t> m_head;       //  Next item to write
+    uint64_t m_tail_cache;              //  Reader's index, as last seen
+    char m_pad2 [64];
+    std::atomic<uint64_t> m_tail;       //  Next item to read
+    uint64_t m_head_cache;              //  Writer's index, as last seen
+    bool m_armed;                       //  Reader has armed the wake-up
+    char m_pad3 [64];
+    uint64_t m_mask;
+    T *m_items;
+    char m_pad4 [64];
+    zring_waker m_waker;
+};
+
+//  ---------------------------------------------------------------------
+//  Any number of writers, one reader. Writers claim a slot by moving the
+//  shared head on, and each slot has a sequence number that says whether
+//  it is free for a writer in this lap, or holds an item for the reader.
+//  A writer that has claimed a slot never waits for another writer.
+
+template <typename T>
+class zring_mpsc {
+public:
+    zring_mpsc (size_t capacity)
+    {
+        m_mask = s_ring_capacity (capacity) - 1;
+        m_slots = new slot [m_mask + 1];
+        for (uint64_t index = 0; index <= m_mask; index++)
+            m_slots [index].m_sequence.store (index, std::memory_order_relaxed);
+        m_head.store (0);
+        m_tail = 0;
+        m_armed = false;
+    }
+
+    ~zring_mpsc ()
+    {
+        delete [] m_slots;
+    }
+
+    int fd () const {
+        return m_waker.fd ();
+    }
+
+    //  Writer: add an item, or return false if the ring is full
+    bool send (const T &item)
+    {
+        if (!put (item))
+            return false;
+        m_waker.wake ();
+        return true;
+    }
+
+    //  Writer: add up to count items, waking the reader once; returns how
+    //  many went in
+    size_t send_batch (const T *items, size_t count)
+    {
+        size_t sent = 0;
+        while (sent < count && put (items [sent]))
+            sent++;
+        if (sent)
+            m_waker.wake ();
+        return sent;
+    }
+
+    //  Reader: take the oldest item, or return false if the ring is empty
+    bool recv (T &item)
+    {
+        return recv_batch (&item, 1) == 1;
+    }
+
+    //  Reader: take up to count items; returns how many we took
+    size_t recv_batch (T *items, size_t count)
+    {
+        size_t taken = 0;
+        while (taken < count && take (items [taken]))
+            taken++;
+        if (taken == 0) {
+            //  Empty: arm the wake-up, then look once more
+            m_waker.arm ();
+            m_armed = true;
+            while (taken < count && take (items [taken]))
+                taken++;
+        }
+        if (taken && m_armed) {
+            m_waker.disarm ();
+            m_armed = false;
+        }
+        return taken;
+    }
+
+private:
+    struct slot {
+        std::atomic<uint64_t> m_sequence;
+        T m_item;
+    };
+
+    bool put (const T &item)
+    {
+        uint64_t head = m_head.load (std::memory_order_relaxed);
+        while (true) {
+            slot *target = &m_slots [head & m_mask];
+            int64_t lap = (int64_t) (target->m_sequence.load (std::memory_order_acquire) - head);
+            if (lap == 0) {
+                if (m_head.compare_exchange_weak (head, head + 1, std::memory_order_relaxed)) {
+                    target->m_item = item;
+                    target->m_sequence.store (head + 1, std::memory_order_release);
+                    return true;
+                }
+                //  Another writer got it; head now holds the new value
+            }
+            else
+            if (lap < 0)
+                return false;           //  Reader hasn't freed it: full
+            else
+                head = m_head.load (std::memory_order_relaxed);
+        }
+    }
+
+    bool take (T &item)
+    {
+        slot *source = &m_slots [m_tail & m_mask];
+        if (source->m_sequence.load (std::memory_order_acquire) != m_tail + 1)
+            return false;
+        item = source->m_item;
+        source->m_sequence.store (m_tail + m_mask + 1, std::memory_order_release);
+        m_tail++;
+        return true;
+    }
+
+    //  Writers' cache line, then reader's
+    char m_pad1 [64];
+    std::atomic<uint64_t> m_head;       //  Next slot to claim
+    char m_pad2 [64];
+    uint64_t m_tail;                    //  Next slot to read
+    bool m_armed;                       //  Reader has armed the wake-up
+    char m_pad3 [64];
+    uint64_t m_mask;
+    slot *m_slots;
+    char m_pad4 [64];
+    zring_waker m_waker;
+};
+
+#endif
@@ -0,0 +1,153 @@
+#ifndef __ZSPIN_HPP_INCLUDED__
+#define __ZSPIN_HPP_INCLUDED__
+
+//  Busy-polling, for loops that can spend a CPU to cut wake-up latency
+//
+//  zspin::poll works like zmq::poll, but first spins for up to a budget
+//  of usecs, checking the sockets' ZMQ_EVENTS, and only then blocks for
+//  the rest of the timeout. A message that arrives while we spin is seen
+//  at once, without the scheduler having to wake us. With a budget of
+//  zero it is plain zmq::poll.
+//
+//  Spinning burns the CPU it saves latency on, so we count the time spent
+//  spinning and sleeping, and how many wake-ups each gave us, as metrics;
+//  if spin wake-ups are rare the budget is wasted. Pin the spinning thread
+//  to a CPU of its own with pin(), or it fights the threads it waits on;
+//  do that after starting other threads, as they inherit it.
+
+#include "zmetrics.hpp"
+#include "zaffinity.hpp"
+
+class zspin {
+public:
+    zspin (int64_t budget_usecs = 0) : m_budget (budget_usecs * 1000) {}
+
+    //  Spin for up to usecs before blocking; zero turns spinning off
+    void set_budget (int64_t usecs) {
+        m_budget = usecs * 1000;
+    }
+    int64_t budget () const {
+        return m_budget / 1000;
+    }
+
+    //  ---------------------------------------------------------------------
+    //  Like zmq::poll, with timeout in msecs or -1 to wait forever
+
+    int
+    poll (zmq::pollitem_t *items, int count, long timeout)
+    {
+        int64_t started = s_clock_ns ();
+        if (m_budget > 0 && timeout != 0) {
+            int64_t spin_until = started + m_budget;
+            if (timeout > 0 && spin_until > started + (int64_t) timeout * 1000000)
+                spin_until = started + (int64_t) timeout * 1000000;
+            //  Sockets tell us cheaply if they have input; file descriptors
+            //  need a poll call, which we still make without sleeping
+            bool sockets_only = true;
+            for (int index = 0; index < count; index++)
+                if (!items [index].socket)
+                    sockets_only = false;
+
+            int64_t now = started;
+            while (now < spin_until) {
+                int rc = sockets_only? check (items, count): zmq::poll (items, count, 0);
+                now = s_clock_ns ();
+                if (rc > 0) {
+                    m_spin_ns.inc (now - started);
+                    m_spin_wakes++;
+                    return rc;
+                }
+                relax ();
+            }
+            m_spin_ns.inc (now - started);
+            if (timeout > 0) {
+                timeout -= (long) ((now - started) / 1000000);
+                if (timeout <= 0)
+                    return 0;
+            }
+            started = now;
+        }
+        int rc = zmq::poll (items, count, timeout);
+        m_sleep_ns.inc (s_clock_ns () - started);
+        if (rc > 0)
+            m_sleep_wakes++;
+        return rc;
+    }
+
+    //  ---------------------------------------------------------------------
+    //  Register our counters, with the labels given
+
+    void
+    add_metrics (zmetrics &metrics, std::string labels)
+    {
+        metrics.add ("zspin_spin_nanoseconds_total", "Time spent spinning for input",
+                     labels, &m_spin_ns);
+        metrics.add ("zspin_sleep_nanoseconds_total", "Time spent blocked in poll",
+                     labels, &m_sleep_ns);
+        metrics.add ("zspin_spin_wakes_total", "Input found while spinning",
+                     labels, &m_spin_wakes);
+        metrics.add ("zspin_sleep_wakes_total", "Input found after blocking",
+                     labels, &m_sleep_wakes);
+    }
+
+    //  One line summary of the counters
+    std::string
+    report () const
+    {
+        std::stringstream out;
+        out << "spin " << (uint64_t) m_spin_ns / 1000000 << " msecs, "
+            << (uint64_t) m_spin_wakes << " wakes; sleep "
+            << (uint64_t) m_sleep_ns / 1000000 << " msecs, "
+            << (uint64_t) m_sleep_wakes << " wakes";
+        return out.str ();
+    }
+
+    //  ---------------------------------------------------------------------
+    //  Pin the calling thread to one CPU; returns 0, or -1 if we can't
+
+    static int
+    pin (int cpu)
+    {
+        return zaffinity::pin_cpu (cpu);
+    }
+
+private:
+    //  Check sockets for input without a system call
+    static int
+    check (zmq::pollitem_t *items, int count)
+    {
+        int ready = 0;
+        for (int index = 0; index < count; index++) {
+            items [index].revents = 0;
+            if (!(items [index].events & ZMQ_POLLIN))
+                continue;
+            int events = 0;
+            size_t size = sizeof (events);
+            if (zmq_getsockopt (items [index].socket, ZMQ_EVENTS, &events, &size) == 0
+            &&  (events & ZMQ_POLLIN)) {
+                items [index].revents = ZMQ_POLLIN;
+                ready++;
+            }
+        }
+        return ready;
+    }
+
+    //  Tell the CPU we're spinning, to spare the other hyperthread
+    static void
+    relax ()
+    {
+#if defined (__x86_64__) || defined (__i386__)
+        __builtin_ia32_pause ();
+#elif defined (__aarch64__)
+        asm volatile ("yield");
+#endif
+    }
+
+    int64_t m_budget;                   //  nsecs
+    zcounter m_spin_ns;
+    zcounter m_sleep_ns;
+    zcounter m_spin_wakes;
+    zcounter m_sleep_wakes;
+};
+
+#endif